@@ -0,0 +1,115 @@
+#include "common.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "admission.h"
+
+static uint64_t admission_now_us(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static uint64_t admission_sqrt(uint64_t value) {
+	uint64_t root = 0;
+	for (uint64_t bit = (uint64_t) 1 << 62; bit; bit >>= 2) {
+		if (value >= root + bit) {
+			value -= root + bit;
+			root = (root >> 1) + bit;
+		} else {
+			root >>= 1;
+		}
+	}
+	return root;
+}
+
+// Time of the next shed: sheds come closer together the longer shedding goes on
+static uint64_t admission_control_law(const Admission *admission, uint64_t from) {
+	// interval / sqrt(count), with the square root taken in 1/1024 units
+	uint64_t root = admission_sqrt((uint64_t) admission->shed_count << 20);
+	return from + (admission->interval_us << 10) / (root ? root : 1);
+}
+
+void admission_init(Admission *admission, unsigned target_ms, unsigned interval_ms) {
+	pthread_mutex_init(&admission->lock, NULL);
+	admission->target_us = (uint64_t) target_ms * 1000;
+	admission->interval_us = (uint64_t) interval_ms * 1000;
+	admission->first_above_us = 0;
+	admission->shed_next_us = 0;
+	admission->shed_count = 0;
+	admission->shed_owed = 0;
+	admission->shedding = false;
+	for (int class = 0; class < ADMISSION_CLASS_COUNT; ++class) {
+		admission->in_flight[class] = 0;
+	}
+}
+
+bool admission_admit(Admission *admission, AdmissionClass class, uint64_t queued_us, size_t backlog) {
+	uint64_t now = admission_now_us();
+	pthread_mutex_lock(&admission->lock);
+	if (admission->target_us == 0) {
+		++admission->in_flight[class];
+		pthread_mutex_unlock(&admission->lock);
+		return true;
+	}
+
+	// The delay has to stay above target for a full interval before anything is shed.
+	// An empty queue means there is no standing queue, whatever the delay. A request
+	// that waited long has itself seen the queue above target for part of the interval.
+	bool above_target = false;
+	if (queued_us < admission->target_us || backlog == 0) {
+		admission->first_above_us = 0;
+	} else if (admission->first_above_us == 0) {
+		uint64_t seen = queued_us - admission->target_us;
+		admission->first_above_us = now + admission->interval_us - (seen < admission->interval_us ? seen : admission->interval_us);
+		above_target = now >= admission->first_above_us;
+	} else if (now >= admission->first_above_us) {
+		above_target = true;
+	}
+
+	bool shed = false;
+	if (admission->shedding) {
+		if (!above_target) {
+			admission->shedding = false;
+			admission->shed_owed = 0;
+		} else if (now >= admission->shed_next_us) {
+			shed = true;
+			++admission->shed_count;
+			admission->shed_next_us = admission_control_law(admission, admission->shed_next_us);
+		}
+	} else if (above_target) {
+		shed = true;
+		admission->shedding = true;
+		// Resume near the previous rate if the last shedding period ended recently
+		bool recent = now - admission->shed_next_us < 8 * admission->interval_us;
+		admission->shed_count = recent && admission->shed_count > 2 ? admission->shed_count - 2 : 1;
+		admission->shed_next_us = admission_control_law(admission, now);
+	}
+
+	// DNS lookups are cheap and latency sensitive. While bulk requests are being
+	// served, a shed due on a lookup falls on the next bulk request instead.
+	if (class == ADMISSION_DNS) {
+		if (shed && admission->in_flight[ADMISSION_BULK] > 0) {
+			++admission->shed_owed;
+			shed = false;
+		}
+	} else if (!shed && admission->shed_owed > 0) {
+		--admission->shed_owed;
+		shed = true;
+	}
+
+	if (!shed) {
+		++admission->in_flight[class];
+	}
+	pthread_mutex_unlock(&admission->lock);
+	return !shed;
+}
+
+void admission_done(Admission *admission, AdmissionClass class) {
+	pthread_mutex_lock(&admission->lock);
+	--admission->in_flight[class];
+	pthread_mutex_unlock(&admission->lock);
+}
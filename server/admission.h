@@ -0,0 +1,57 @@
+#ifndef ADMISSION_H_
+#define ADMISSION_H_
+/**
+ * Admission control module
+ * Decides whether a dequeued request is served or shed, following CoDel: as long
+ * as the time requests spend queued stays above a target for a whole interval,
+ * requests are shed at an increasing rate until the queue delay drops again.
+ * Sheds fall on bulk requests where possible: while bulk requests are in flight,
+ * a shed due on a DNS lookup is passed on to the next bulk request.
+ */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum {
+	ADMISSION_DNS,
+	ADMISSION_BULK,
+	ADMISSION_CLASS_COUNT
+} AdmissionClass;
+
+typedef struct {
+	pthread_mutex_t lock;
+	uint64_t target_us; // Acceptable standing queue delay
+	uint64_t interval_us; // How long the delay may stay above target
+	uint64_t first_above_us; // When the delay may first cause a shed, 0 if below target
+	uint64_t shed_next_us; // Next shed while shedding
+	unsigned shed_count; // Sheds in the current shedding period
+	unsigned shed_owed; // Sheds deferred from DNS lookups to bulk requests
+	bool shedding;
+	unsigned in_flight[ADMISSION_CLASS_COUNT]; // Admitted requests not yet finished
+} Admission;
+
+/**
+ * Initialize an admission controller.
+ * @param target_ms Queue delay target in milliseconds. 0 admits everything.
+ * @param interval_ms Interval in milliseconds, roughly the normal request duration.
+ */
+void admission_init(Admission *admission, unsigned target_ms, unsigned interval_ms);
+
+/**
+ * Decide on a request taken from the queue. Admitted requests must be finished
+ * with admission_done.
+ * @param class Class of the request.
+ * @param queued_us Time the request spent queued.
+ * @param backlog Requests still waiting in the queue.
+ * @return true to serve the request, false to shed it.
+ */
+bool admission_admit(Admission *admission, AdmissionClass class, uint64_t queued_us, size_t backlog);
+
+/**
+ * Finish a request admitted with admission_admit.
+ */
+void admission_done(Admission *admission, AdmissionClass class);
+
+#endif
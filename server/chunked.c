@@ -0,0 +1,149 @@
+#include "common.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include "chunked.h"
+#include "socket.h"
+
+#define CRLF "\r\n"
+#define CHUNK_SIZE_MAX (UINT64_MAX >> 4) // Largest size that can take one more hex digit
+
+enum {
+	CHUNKED_SIZE, // Hex digits of the chunk size
+	CHUNKED_EXTENSION, // Chunk extensions up to the end of the line; ignored
+	CHUNKED_SIZE_LF,
+	CHUNKED_DATA,
+	CHUNKED_DATA_CR,
+	CHUNKED_DATA_LF,
+	CHUNKED_TRAILER, // Start of a trailer line, or the empty line ending the body
+	CHUNKED_TRAILER_LINE, // Trailer fields are ignored
+	CHUNKED_END_LF,
+	CHUNKED_DONE
+};
+
+static int chunked_hex_value(char c) {
+	if (c >= '0' && c <= '9') {
+		return c - '0';
+	}
+	if (c >= 'a' && c <= 'f') {
+		return c - 'a' + 10;
+	}
+	if (c >= 'A' && c <= 'F') {
+		return c - 'A' + 10;
+	}
+	return -1;
+}
+
+void chunked_decoder_init(ChunkedDecoder *decoder) {
+	decoder->state = CHUNKED_SIZE;
+	decoder->remaining = 0;
+	decoder->size_digits = false;
+	decoder->done = false;
+	decoder->excess = 0;
+}
+
+ssize_t chunked_decode(ChunkedDecoder *decoder, char *buf, size_t size) {
+	size_t in = 0;
+	size_t out = 0;
+
+	while (in < size && decoder->state != CHUNKED_DONE) {
+		char c = buf[in];
+		switch (decoder->state) {
+		case CHUNKED_SIZE: {
+			int value = chunked_hex_value(c);
+			if (value >= 0) {
+				if (decoder->remaining > CHUNK_SIZE_MAX) {
+					return -1;
+				}
+				decoder->remaining = decoder->remaining << 4 | value;
+				decoder->size_digits = true;
+			} else if (!decoder->size_digits) {
+				return -1;
+			} else if (c == ';' || c == ' ' || c == '\t') {
+				decoder->state = CHUNKED_EXTENSION;
+			} else if (c == '\r') {
+				decoder->state = CHUNKED_SIZE_LF;
+			} else {
+				return -1;
+			}
+			++in;
+			break;
+		}
+		case CHUNKED_EXTENSION:
+			if (c == '\r') {
+				decoder->state = CHUNKED_SIZE_LF;
+			}
+			++in;
+			break;
+		case CHUNKED_SIZE_LF:
+			if (c != '\n') {
+				return -1;
+			}
+			decoder->state = decoder->remaining > 0 ? CHUNKED_DATA : CHUNKED_TRAILER;
+			++in;
+			break;
+		case CHUNKED_DATA: {
+			size_t length = size - in;
+			if (length > decoder->remaining) {
+				length = decoder->remaining;
+			}
+			memmove(buf + out, buf + in, length);
+			in += length;
+			out += length;
+			decoder->remaining -= length;
+			if (decoder->remaining == 0) {
+				decoder->state = CHUNKED_DATA_CR;
+			}
+			break;
+		}
+		case CHUNKED_DATA_CR:
+			if (c != '\r') {
+				return -1;
+			}
+			decoder->state = CHUNKED_DATA_LF;
+			++in;
+			break;
+		case CHUNKED_DATA_LF:
+			if (c != '\n') {
+				return -1;
+			}
+			decoder->state = CHUNKED_SIZE;
+			decoder->size_digits = false;
+			++in;
+			break;
+		case CHUNKED_TRAILER:
+			decoder->state = c == '\r' ? CHUNKED_END_LF : CHUNKED_TRAILER_LINE;
+			++in;
+			break;
+		case CHUNKED_TRAILER_LINE:
+			if (c == '\n') {
+				decoder->state = CHUNKED_TRAILER;
+			}
+			++in;
+			break;
+		case CHUNKED_END_LF:
+			if (c != '\n') {
+				return -1;
+			}
+			decoder->state = CHUNKED_DONE;
+			decoder->done = true;
+			++in;
+			break;
+		}
+	}
+	decoder->excess = size - in;
+	return out;
+}
+
+int chunked_write(int fd, const void *data, size_t size) {
+	char size_line[32];
+	int length = snprintf(size_line, sizeof size_line, "%zx" CRLF, size);
+	struct iovec chunk[] = {
+		{ size_line, length },
+		{ (void *) data, size },
+		{ CRLF, strlen(CRLF) },
+	};
+	return socket_writev(fd, chunk, 3) < 0 ? -1 : 0;
+}
@@ -0,0 +1,43 @@
+#ifndef CHUNKED_H_
+#define CHUNKED_H_
+/**
+ * Chunked transfer coding module
+ * A streaming decoder for chunked request bodies and a writer for chunked
+ * responses. See RFC 7230 section 4.1.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * Decoder state. Initialize with chunked_decoder_init.
+ */
+typedef struct {
+	int state;
+	uint64_t remaining; // Bytes left in the current chunk, or the chunk size being parsed
+	bool size_digits; // The chunk size being parsed has a digit
+	bool done; // The last chunk and the trailer have been consumed
+	size_t excess; // Bytes after the end of the body in the piece last decoded
+} ChunkedDecoder;
+
+void chunked_decoder_init(ChunkedDecoder *decoder);
+
+/**
+ * Decode a piece of a chunked body in place.
+ * @param buf Encoded bytes. On return it starts with the decoded data.
+ * @param size Number of bytes in buf.
+ * @return Number of decoded bytes at the start of buf, or -1 if the coding is
+ * malformed. Bytes after the end of the body are ignored and counted in excess.
+ */
+ssize_t chunked_decode(ChunkedDecoder *decoder, char *buf, size_t size);
+
+/**
+ * Write one chunk to a socket with a single gather write.
+ * @param size Number of bytes at data. 0 writes the last chunk, ending the body.
+ * @return 0 on success, -1 on failure.
+ */
+int chunked_write(int fd, const void *data, size_t size);
+
+#endif
@@ -0,0 +1,124 @@
+#include "common.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "durability.h"
+#include "socket.h"
+#include "util.h"
+
+// A request waiting in a group
+typedef struct Waiter {
+	struct Waiter *next;
+	int fd;
+	dev_t device;
+	int result;
+	bool done;
+} Waiter;
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t done;
+	DurabilityMode mode;
+	struct timespec window;
+	Waiter *pending; // Requests not yet taken by a leader
+	bool leading; // A leader is collecting or flushing a group
+} durability = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER,
+	.mode = DURABILITY_NONE,
+};
+
+void durability_init(DurabilityMode mode, unsigned window_ms) {
+	durability.mode = mode;
+	durability.window.tv_sec = window_ms / 1000;
+	durability.window.tv_nsec = (window_ms % 1000) * 1000000L;
+}
+
+// Flush each filesystem of a group once. Called without the lock.
+static void durability_flush(Waiter *group) {
+	for (Waiter *waiter = group; waiter; waiter = waiter->next) {
+		// The first request of each filesystem flushes it for the rest
+		Waiter *first = group;
+		while (first->device != waiter->device) {
+			first = first->next;
+		}
+		if (first == waiter) {
+			waiter->result = syncfs(waiter->fd);
+			if (waiter->result == -1) {
+				VERBOSE("syncfs failed: %s", strerror(errno));
+			}
+		} else {
+			waiter->result = first->result;
+		}
+	}
+}
+
+static int durability_group_sync(int fd) {
+	struct stat stats;
+	if (fstat(fd, &stats) == -1) {
+		return -1;
+	}
+	Waiter self = { NULL, fd, stats.st_dev, 0, false };
+
+	pthread_mutex_lock(&durability.lock);
+	self.next = durability.pending;
+	durability.pending = &self;
+	while (!self.done) {
+		if (durability.leading) {
+			pthread_cond_wait(&durability.done, &durability.lock);
+			continue;
+		}
+
+		// Lead a group: let others join for a moment, then flush for all of them
+		durability.leading = true;
+		pthread_mutex_unlock(&durability.lock);
+		nanosleep(&durability.window, NULL);
+		pthread_mutex_lock(&durability.lock);
+		Waiter *group = durability.pending;
+		durability.pending = NULL;
+		pthread_mutex_unlock(&durability.lock);
+
+		durability_flush(group);
+
+		pthread_mutex_lock(&durability.lock);
+		for (Waiter *waiter = group; waiter; waiter = waiter->next) {
+			waiter->done = true;
+		}
+		durability.leading = false;
+		pthread_cond_broadcast(&durability.done);
+	}
+	pthread_mutex_unlock(&durability.lock);
+	return self.result;
+}
+
+int durability_sync_file(int fd) {
+	// A group flushes the data together with the rename
+	return durability.mode == DURABILITY_REQUEST ? fdatasync(fd) : 0;
+}
+
+int durability_sync_rename(int fd, const char *directory) {
+	switch (durability.mode) {
+	case DURABILITY_REQUEST: {
+		int directory_fd = open(directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (directory_fd == -1) {
+			return -1;
+		}
+		int r = fsync(directory_fd);
+		socket_close(&directory_fd);
+		return r;
+	}
+	case DURABILITY_GROUP:
+		// The file lives on the filesystem of the directory, so one syncfs covers both
+		return durability_group_sync(fd);
+	default:
+		return 0;
+	}
+}
@@ -0,0 +1,39 @@
+#ifndef DURABILITY_H_
+#define DURABILITY_H_
+/**
+ * Durability module
+ * Makes written files and directory entries durable according to a policy. In
+ * group mode concurrent requests are batched: the first waiter waits a short
+ * window for others to join, then flushes each filesystem in the batch once with
+ * syncfs and wakes everyone in it.
+ */
+
+typedef enum {
+	DURABILITY_NONE, // Leave flushing to the kernel
+	DURABILITY_REQUEST, // fdatasync and fsync on every request
+	DURABILITY_GROUP, // Batched syncfs
+} DurabilityMode;
+
+/**
+ * Set the policy. Call before any other function of the module.
+ * @param window_ms How long a group waits for more requests to join, in milliseconds.
+ */
+void durability_init(DurabilityMode mode, unsigned window_ms);
+
+/**
+ * Make the data of a file durable before it is renamed into place. Does nothing
+ * in group mode, where durability_sync_rename flushes the data as well.
+ * @return 0 on success, -1 on failure.
+ */
+int durability_sync_file(int fd);
+
+/**
+ * Make a rename into a directory durable. In group mode this is a single group
+ * entry that also flushes the data of the renamed file.
+ * @param fd The renamed file.
+ * @param directory The directory it was renamed into.
+ * @return 0 on success, -1 on failure.
+ */
+int durability_sync_rename(int fd, const char *directory);
+
+#endif
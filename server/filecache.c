@@ -0,0 +1,327 @@
+#include "common.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "filecache.h"
+#include "metrics.h"
+#include "socket.h"
+#include "thread.h"
+#include "util.h"
+
+// Changes that make a cached descriptor, its stat result or a directory listing stale
+#define FILECACHE_ENTRY_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)
+#define FILECACHE_WATCH_EVENTS (IN_MODIFY | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF | FILECACHE_ENTRY_EVENTS)
+
+static struct {
+	pthread_mutex_t lock;
+	unsigned capacity;
+	unsigned count;
+	uint64_t check_us;
+	FileCacheEntry **buckets;
+	uint32_t mask; // Number of buckets - 1
+	FileCacheEntry lru; // List head, most recently used first
+	size_t response_limit;
+	size_t response_bytes; // Held by cached entries
+	int inotify; // -1 if changes are not watched
+} cache = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.inotify = -1,
+};
+
+static uint64_t filecache_now_us(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// FNV-1a
+static uint32_t filecache_hash(const char *path) {
+	uint32_t hash = 2166136261u;
+	for (; *path; ++path) {
+		hash = (hash ^ (unsigned char) *path) * 16777619u;
+	}
+	return hash;
+}
+
+// Find a cached entry. Called with the lock held.
+static FileCacheEntry *filecache_lookup(const char *path, uint32_t hash) {
+	for (FileCacheEntry *entry = cache.buckets[hash & cache.mask]; entry; entry = entry->hash_next) {
+		if (entry->hash == hash && strcmp(entry->path, path) == 0) {
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+static void filecache_lru_remove(FileCacheEntry *entry) {
+	entry->lru_prev->lru_next = entry->lru_next;
+	entry->lru_next->lru_prev = entry->lru_prev;
+}
+
+static void filecache_lru_push(FileCacheEntry *entry) {
+	entry->lru_prev = &cache.lru;
+	entry->lru_next = cache.lru.lru_next;
+	cache.lru.lru_next->lru_prev = entry;
+	cache.lru.lru_next = entry;
+}
+
+// Free an entry nobody uses. Called with the lock held.
+static void filecache_destroy(FileCacheEntry *entry) {
+	if (entry->watch != -1) {
+		// Watches are per inode, so another path may still need it
+		bool shared = false;
+		for (FileCacheEntry *other = cache.lru.lru_next; other != &cache.lru; other = other->lru_next) {
+			shared = shared || other->watch == entry->watch;
+		}
+		if (!shared) {
+			inotify_rm_watch(cache.inotify, entry->watch);
+		}
+	}
+	socket_close(&entry->fd);
+	free(entry->response);
+	free(entry->path);
+	free(entry);
+}
+
+// Make an entry unreachable, freeing it unless it is in use. Called with the lock held.
+static void filecache_drop(FileCacheEntry *entry) {
+	FileCacheEntry **link = &cache.buckets[entry->hash & cache.mask];
+	while (*link != entry) {
+		link = &(*link)->hash_next;
+	}
+	*link = entry->hash_next;
+	filecache_lru_remove(entry);
+	entry->cached = false;
+	--cache.count;
+	if (entry->response) {
+		cache.response_bytes -= entry->response_size;
+	}
+	if (entry->refs == 0) {
+		filecache_destroy(entry);
+	}
+}
+
+static void *filecache_watcher(void *arg) {
+	(void) arg;
+	union {
+		struct inotify_event event; // For alignment
+		char bytes[4096];
+	} buffer;
+	for (;;) {
+		ssize_t length = read(cache.inotify, buffer.bytes, sizeof buffer.bytes);
+		if (length == -1 && errno == EINTR) {
+			continue;
+		}
+		if (length <= 0) {
+			VERBOSE("File cache stopped watching for changes");
+			return NULL;
+		}
+
+		pthread_mutex_lock(&cache.lock);
+		for (char *p = buffer.bytes; p < buffer.bytes + length; ) {
+			const struct inotify_event *event = (const struct inotify_event *) p;
+			p += sizeof(struct inotify_event) + event->len;
+			if (event->len > 0 && !(event->mask & FILECACHE_ENTRY_EVENTS)) {
+				continue; // Contents of a file in a watched directory changed, not its entries
+			}
+			FileCacheEntry *entry = cache.lru.lru_next;
+			while (entry != &cache.lru) {
+				FileCacheEntry *next = entry->lru_next;
+				// A lost event could be about anything
+				if (entry->watch == event->wd || (event->mask & IN_Q_OVERFLOW)) {
+					filecache_drop(entry);
+				}
+				entry = next;
+			}
+		}
+		pthread_mutex_unlock(&cache.lock);
+	}
+}
+
+int filecache_init(unsigned capacity, unsigned check_ms, size_t response_limit) {
+	cache.capacity = capacity;
+	cache.check_us = (uint64_t) check_ms * 1000;
+	cache.response_limit = response_limit;
+	cache.lru.lru_next = cache.lru.lru_prev = &cache.lru;
+	if (capacity == 0) {
+		return 0;
+	}
+
+	uint32_t buckets = 16;
+	while (buckets < 2 * capacity && buckets < (UINT32_C(1) << 24)) {
+		buckets *= 2;
+	}
+	cache.buckets = calloc(buckets, sizeof(*cache.buckets));
+	if (!cache.buckets) {
+		return -1;
+	}
+	cache.mask = buckets - 1;
+
+	cache.inotify = inotify_init1(IN_CLOEXEC);
+	if (cache.inotify == -1 || thread_create_detached(filecache_watcher, NULL) == -1) {
+		VERBOSE("File cache cannot watch for changes, checking every %u ms", check_ms);
+		socket_close(&cache.inotify);
+	}
+	return 0;
+}
+
+// Open a file and stat it, into a new private entry
+static FileCacheEntry *filecache_open_file(const char *path, bool watch) {
+	FileCacheEntry *entry = calloc(1, sizeof(*entry));
+	if (!entry) {
+		return NULL;
+	}
+	entry->watch = -1;
+	entry->refs = 1;
+	entry->fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (entry->fd == -1) {
+		free(entry);
+		return NULL;
+	}
+	// Watch before stat so no change after the stat goes unnoticed
+	if (watch) {
+		entry->watch = inotify_add_watch(cache.inotify, path, FILECACHE_WATCH_EVENTS);
+	}
+	if (fstat(entry->fd, &entry->stats) == -1) {
+		int saved_errno = errno;
+		pthread_mutex_lock(&cache.lock);
+		filecache_destroy(entry);
+		pthread_mutex_unlock(&cache.lock);
+		errno = saved_errno;
+		return NULL;
+	}
+	return entry;
+}
+
+// Whether the path still names the file as it was when the entry was made
+static bool filecache_unchanged(const FileCacheEntry *entry) {
+	struct stat now;
+	return stat(entry->path, &now) == 0 &&
+		now.st_dev == entry->stats.st_dev &&
+		now.st_ino == entry->stats.st_ino &&
+		now.st_size == entry->stats.st_size &&
+		now.st_mtim.tv_sec == entry->stats.st_mtim.tv_sec &&
+		now.st_mtim.tv_nsec == entry->stats.st_mtim.tv_nsec &&
+		now.st_ctim.tv_sec == entry->stats.st_ctim.tv_sec &&
+		now.st_ctim.tv_nsec == entry->stats.st_ctim.tv_nsec;
+}
+
+FileCacheEntry *filecache_open(const char *path) {
+	if (cache.capacity == 0) {
+		return filecache_open_file(path, false);
+	}
+
+	uint32_t hash = filecache_hash(path);
+	uint64_t now = filecache_now_us();
+	bool check = false;
+	pthread_mutex_lock(&cache.lock);
+	FileCacheEntry *entry = filecache_lookup(path, hash);
+	if (entry) {
+		++entry->refs;
+		filecache_lru_remove(entry);
+		filecache_lru_push(entry);
+		// One thread checks for everyone
+		check = cache.check_us > 0 && now - entry->checked_us >= cache.check_us;
+		if (check) {
+			entry->checked_us = now;
+		}
+	}
+	pthread_mutex_unlock(&cache.lock);
+
+	if (entry && check && !filecache_unchanged(entry)) {
+		metrics_count(METRICS_FILE_CACHE_STALE);
+		pthread_mutex_lock(&cache.lock);
+		if (entry->cached) {
+			filecache_drop(entry);
+		}
+		pthread_mutex_unlock(&cache.lock);
+		filecache_release(entry);
+		entry = NULL;
+	}
+	if (entry) {
+		metrics_count(METRICS_FILE_CACHE_HIT);
+		return entry;
+	}
+
+	// Miss: open outside the lock, then insert unless another thread was faster
+	if (!check) {
+		metrics_count(METRICS_FILE_CACHE_MISS); // Stale hits were counted as such
+	}
+	entry = filecache_open_file(path, cache.inotify != -1);
+	if (!entry || (!S_ISREG(entry->stats.st_mode) && !S_ISDIR(entry->stats.st_mode))) {
+		return entry;
+	}
+	if ((entry->watch == -1 && cache.check_us == 0) || !(entry->path = strdup(path))) {
+		return entry; // Changes could not be noticed
+	}
+	entry->hash = hash;
+	entry->checked_us = now;
+
+	pthread_mutex_lock(&cache.lock);
+	if (!filecache_lookup(path, hash)) {
+		FileCacheEntry **bucket = &cache.buckets[hash & cache.mask];
+		entry->hash_next = *bucket;
+		*bucket = entry;
+		filecache_lru_push(entry);
+		entry->cached = true;
+		++cache.count;
+		while (cache.count > cache.capacity) {
+			filecache_drop(cache.lru.lru_prev);
+		}
+	}
+	pthread_mutex_unlock(&cache.lock);
+	return entry;
+}
+
+bool filecache_response(FileCacheEntry *entry, const char **response, size_t *size) {
+	// Set once, while the entry is referenced, and freed only after the last release
+	const char *data = __atomic_load_n(&entry->response, __ATOMIC_ACQUIRE);
+	if (!data) {
+		return false;
+	}
+	*response = data;
+	*size = entry->response_size;
+	return true;
+}
+
+bool filecache_set_response(FileCacheEntry *entry, char *response, size_t size) {
+	if (size > cache.response_limit) {
+		return false;
+	}
+	bool stored = false;
+	pthread_mutex_lock(&cache.lock);
+	if (entry->cached && !entry->response) {
+		FileCacheEntry *victim = cache.lru.lru_prev;
+		while (cache.response_bytes + size > cache.response_limit && victim != &cache.lru) {
+			FileCacheEntry *prev = victim->lru_prev;
+			if (victim->response) {
+				filecache_drop(victim);
+			}
+			victim = prev;
+		}
+		entry->response_size = size;
+		__atomic_store_n(&entry->response, response, __ATOMIC_RELEASE);
+		cache.response_bytes += size;
+		stored = true;
+	}
+	pthread_mutex_unlock(&cache.lock);
+	return stored;
+}
+
+void filecache_release(FileCacheEntry *entry) {
+	pthread_mutex_lock(&cache.lock);
+	if (--entry->refs == 0 && !entry->cached) {
+		filecache_destroy(entry);
+	}
+	pthread_mutex_unlock(&cache.lock);
+}
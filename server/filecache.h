@@ -0,0 +1,87 @@
+#ifndef FILECACHE_H_
+#define FILECACHE_H_
+/**
+ * File cache module
+ * A bounded cache of open regular files and directories and their stat results
+ * keyed by path, shared by all threads. Entries are dropped when inotify reports
+ * a change to the file or to the entries of the directory, and a hit older than
+ * the check interval is compared against a fresh stat of the path. Least recently
+ * used entries are evicted when the cache is full.
+ *
+ * A cached file can also hold a complete pre-rendered response, such as a small
+ * file or a directory listing. The memory these take is capped; least recently
+ * used files give theirs up first.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+/**
+ * An open file. fd and stats are read-only for the caller. The other fields are
+ * private to the module.
+ */
+typedef struct FileCacheEntry {
+	int fd;
+	struct stat stats;
+
+	struct FileCacheEntry *hash_next;
+	struct FileCacheEntry *lru_prev;
+	struct FileCacheEntry *lru_next;
+	char *path;
+	uint32_t hash;
+	unsigned refs;
+	int watch; // inotify watch descriptor, -1 if none
+	bool cached; // Reachable from the cache
+	char *response; // Pre-rendered response, NULL if none
+	size_t response_size;
+	uint64_t checked_us; // When the entry was last compared against the path
+} FileCacheEntry;
+
+/**
+ * Set up the cache and start the thread watching for changes. Call once before
+ * any other function of the module.
+ * @param capacity Number of files kept open, 0 to disable caching.
+ * @param check_ms How old a hit may be before it is checked with stat, in
+ * milliseconds. 0 relies on inotify alone.
+ * @param response_limit Bytes of pre-rendered responses kept, 0 to keep none.
+ * @return 0 on success, -1 on failure.
+ */
+int filecache_init(unsigned capacity, unsigned check_ms, size_t response_limit);
+
+/**
+ * Open a file for reading, from the cache if possible. Only regular files and
+ * directories are cached. The descriptor may be shared with other threads, so
+ * its file offset must not be used: read files with pread or sendfile, and
+ * directories through a descriptor of your own opened with openat.
+ * @param path Path of the file.
+ * @return An entry to be released with filecache_release, NULL on failure
+ * (with errno set by open or fstat).
+ */
+FileCacheEntry *filecache_open(const char *path);
+
+/**
+ * Get the pre-rendered response stored with an entry.
+ * @param response Set to the response. It stays valid until the entry is released.
+ * @param size Set to the size of the response.
+ * @return true if the entry has a response, false otherwise.
+ */
+bool filecache_response(FileCacheEntry *entry, const char **response, size_t *size);
+
+/**
+ * Store a pre-rendered response with a cached entry, making room by evicting
+ * the least recently used files that have one.
+ * @param response A malloc'd buffer. The entry takes ownership if it is stored.
+ * @param size Size of the response.
+ * @return true if the response was stored, false if the entry is not cached,
+ * already has a response or the response does not fit in the limit.
+ */
+bool filecache_set_response(FileCacheEntry *entry, char *response, size_t size);
+
+/**
+ * Release an entry returned by filecache_open.
+ */
+void filecache_release(FileCacheEntry *entry);
+
+#endif
@@ -1,78 +1,465 @@
 #include "common.h"
 
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
 
+#include "chunked.h"
 #include "http.h"
 #include "socket.h"
 #include "string.h"
 #include "url.h"
 #include "util.h"
 
-/**
- * HTTP PUT buffer contents to a remote URL
- * @param url URL to PUT the contents to
- * @param buf Buffer whose contents to send
- * @param count Size of buffer (number of bytes to send)
- * @return HTTP status code, 200 for OK. See the HTTP RFC for details.
- */
-int http_put_buf(const char *url, const void *buf, size_t count) {
-	char *host = url_get_field(url, URL_HOST);
-	char *port = url_get_field(url, URL_PORT);
-	char *path = url_get_field(url, URL_PATH);
+#define HTTP_POOL_IDLE_MAX 4 // Idle connections kept per host
+#define HTTP_POOL_IDLE_S 4 // Idle connections older than this may have been dropped by a middlebox
+#define HTTP_RESOLVE_TTL_S 60 // How long resolved addresses are used before looking them up again
+#define HTTP_HEADER_MAX 8192 // Longest response header accepted
+#define HTTP_BUFFER_SIZE 16384 // For response and request bodies
+#define HTTP_READ_TIMEOUT_MS 10000 // Longest wait for more of a response
+
+// A remote host and port, with its idle connections
+typedef struct HttpHost {
+	struct HttpHost *next;
+	char *host;
+	char *port;
+	SocketAddress addresses[SOCKET_RESOLVE_MAX];
+	int address_count;
+	time_t expires; // Monotonic seconds after which the addresses are looked up again
+	int idle[HTTP_POOL_IDLE_MAX]; // Most recently used last
+	time_t idle_since[HTTP_POOL_IDLE_MAX]; // Monotonic seconds each idle connection was released at
+	int idle_count;
+} HttpHost;
+
+// Hosts are never freed, so a pointer to one stays valid without the lock
+static struct {
+	pthread_mutex_t lock;
+	HttpHost *hosts;
+} pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+// What the response header says about the body and the connection
+typedef struct {
+	int status_code;
+	bool keep_alive;
+	bool chunked;
+	bool length_known;
+	uint64_t content_length;
+} HttpResponseHeader;
+
+static time_t http_now(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec;
+}
+
+// Find a host, adding it if it is new. Called with the lock held.
+static HttpHost *http_pool_host(const char *host, const char *port) {
+	for (HttpHost *entry = pool.hosts; entry; entry = entry->next) {
+		if (strcmp(entry->host, host) == 0 && strcmp(entry->port, port) == 0) {
+			return entry;
+		}
+	}
+	HttpHost *entry = calloc(1, sizeof(*entry));
+	if (!entry || !(entry->host = strdup(host)) || !(entry->port = strdup(port))) {
+		if (entry) {
+			free(entry->host);
+		}
+		free(entry);
+		return NULL;
+	}
+	entry->next = pool.hosts;
+	pool.hosts = entry;
+	return entry;
+}
+
+// Whether an idle connection can still be used: the peer has neither closed it nor sent anything
+static bool http_idle_usable(int fd) {
+	char byte;
+	return recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT) == -1 &&
+		(errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+// Get a connection to a host, an idle one if there is one
+static int http_pool_acquire(const char *host, const char *port, bool *reused) {
+	SocketAddress addresses[SOCKET_RESOLVE_MAX];
+	int count = 0;
+	int fd = -1;
+	time_t now = http_now();
+
+	pthread_mutex_lock(&pool.lock);
+	HttpHost *entry = http_pool_host(host, port);
+	while (entry && entry->idle_count > 0 && fd == -1) {
+		fd = entry->idle[--entry->idle_count];
+		if (now - entry->idle_since[entry->idle_count] > HTTP_POOL_IDLE_S || !http_idle_usable(fd)) {
+			socket_close(&fd);
+		}
+	}
+	if (entry && fd == -1 && now < entry->expires) {
+		count = entry->address_count;
+		memcpy(addresses, entry->addresses, count * sizeof(*addresses));
+	}
+	pthread_mutex_unlock(&pool.lock);
+
+	*reused = fd != -1;
+	if (*reused) {
+		return fd;
+	}
+
+	// Resolve and connect outside the lock
+	bool cached = count > 0;
+	if (!cached) {
+		count = socket_resolve(host, port, SOCK_STREAM, addresses, SOCKET_RESOLVE_MAX);
+		if (count <= 0) {
+			VERBOSE("Could not resolve %s", host);
+			return -1;
+		}
+	}
+	fd = socket_connect_addresses(addresses, count);
+
+	// Keep addresses that worked, drop cached ones that did not
+	pthread_mutex_lock(&pool.lock);
+	if (entry && !cached && fd != -1) {
+		entry->address_count = count;
+		memcpy(entry->addresses, addresses, count * sizeof(*addresses));
+		entry->expires = now + HTTP_RESOLVE_TTL_S;
+	} else if (entry && cached && fd == -1) {
+		entry->expires = 0;
+	}
+	pthread_mutex_unlock(&pool.lock);
+	return fd;
+}
+
+// Give a connection whose response was read to its end back to the pool
+static void http_pool_release(const char *host, const char *port, int fd) {
+	pthread_mutex_lock(&pool.lock);
+	HttpHost *entry = http_pool_host(host, port);
+	if (entry && entry->idle_count < HTTP_POOL_IDLE_MAX) {
+		entry->idle_since[entry->idle_count] = http_now();
+		entry->idle[entry->idle_count++] = fd;
+		fd = -1;
+	}
+	pthread_mutex_unlock(&pool.lock);
+	socket_close(&fd);
+}
+
+void http_pool_close(void) {
+	pthread_mutex_lock(&pool.lock);
+	for (HttpHost *entry = pool.hosts; entry; entry = entry->next) {
+		while (entry->idle_count > 0) {
+			socket_close(&entry->idle[--entry->idle_count]);
+		}
+		entry->expires = 0;
+	}
+	pthread_mutex_unlock(&pool.lock);
+}
+
+// Whether a comma separated header value lists a token, ignoring case
+static bool http_has_token(const char *value, size_t length, const char *token) {
+	size_t token_length = strlen(token);
+	const char *end = value + length;
+	while (value < end) {
+		while (value < end && (*value == ' ' || *value == '\t' || *value == ',')) {
+			++value;
+		}
+		const char *item = value;
+		while (value < end && *value != ',') {
+			++value;
+		}
+		const char *item_end = value;
+		while (item_end > item && (item_end[-1] == ' ' || item_end[-1] == '\t')) {
+			--item_end;
+		}
+		if ((size_t) (item_end - item) == token_length && strncasecmp(item, token, token_length) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Parse a response header ending in an empty line. Returns 0, or -1 if it is malformed.
+static int http_parse_header(const char *header, size_t size, HttpResponseHeader *parsed) {
+	int major, minor;
+	if (sscanf(header, "HTTP/%d.%d %3d", &major, &minor, &parsed->status_code) != 3 || major != 1) {
+		return -1;
+	}
+	bool close = false;
+	bool keep_alive = false;
+	parsed->chunked = false;
+	parsed->length_known = false;
+	parsed->content_length = 0;
+
+	const char *end = header + size;
+	const char *line = (const char *) memchr(header, '\n', size) + 1;
+	while (line < end) {
+		const char *line_end = memchr(line, '\n', end - line);
+		const char *colon = memchr(line, ':', line_end - line);
+		if (colon) {
+			size_t name_length = colon - line;
+			const char *value = colon + 1;
+			const char *value_end = line_end;
+			while (value < value_end && (*value == ' ' || *value == '\t')) {
+				++value;
+			}
+			while (value_end > value && (value_end[-1] == '\r' || value_end[-1] == ' ' || value_end[-1] == '\t')) {
+				--value_end;
+			}
+			size_t value_length = value_end - value;
+
+			if (name_length == strlen("Content-Length") && strncasecmp(line, "Content-Length", name_length) == 0) {
+				uint64_t length = 0;
+				for (const char *digit = value; digit < value_end; ++digit) {
+					if (*digit < '0' || *digit > '9' || length > (UINT64_MAX - 9) / 10) {
+						return -1;
+					}
+					length = length * 10 + (*digit - '0');
+				}
+				parsed->length_known = value_length > 0;
+				parsed->content_length = length;
+			} else if (name_length == strlen("Transfer-Encoding") && strncasecmp(line, "Transfer-Encoding", name_length) == 0) {
+				parsed->chunked = http_has_token(value, value_length, "chunked");
+			} else if (name_length == strlen("Connection") && strncasecmp(line, "Connection", name_length) == 0) {
+				close = close || http_has_token(value, value_length, "close");
+				keep_alive = keep_alive || http_has_token(value, value_length, "keep-alive");
+			}
+		}
+		line = line_end + 1;
+	}
+	parsed->keep_alive = !close && (minor >= 1 || keep_alive);
+	return 0;
+}
+
+// Read what has arrived of a response, waiting for it no longer than HTTP_READ_TIMEOUT_MS
+static ssize_t http_read(int fd, void *buf, size_t count) {
+	struct pollfd ready = { fd, POLLIN, 0 };
+	int polled;
+	while ((polled = poll(&ready, 1, HTTP_READ_TIMEOUT_MS)) == -1 && errno == EINTR);
+	if (polled == 0) {
+		VERBOSE("HTTP response timed out");
+		errno = ETIMEDOUT;
+		return -1;
+	}
+	return polled == -1 ? -1 : socket_read(fd, buf, count);
+}
+
+// Read a response to its end, passing the body to the sink. Returns the status
+// code, or -1 on failure. received tells whether anything arrived at all.
+static int http_read_response(int fd, HttpBodySink sink, void *context, bool *keep_alive, bool *received) {
+	char buffer[HTTP_BUFFER_SIZE];
+	size_t size = 0;
+	*keep_alive = false;
+	*received = false;
+
+	HttpResponseHeader header;
+	do {
+		// Read up to the end of the header; interim 1xx responses are skipped
+		const char *end;
+		while (!(end = memmem(buffer, size, "\r\n\r\n", 4))) {
+			if (size == HTTP_HEADER_MAX) {
+				VERBOSE("HTTP response header too long");
+				return -1;
+			}
+			ssize_t r = http_read(fd, buffer + size, HTTP_HEADER_MAX - size);
+			if (r <= 0) {
+				return -1;
+			}
+			size += r;
+			buffer[size] = '\0'; // For sscanf of the status line
+			*received = true;
+		}
+		size_t header_size = end + 4 - buffer;
+		if (http_parse_header(buffer, header_size, &header) == -1) {
+			VERBOSE("Malformed HTTP response");
+			return -1;
+		}
+		memmove(buffer, buffer + header_size, size - header_size);
+		size -= header_size;
+	} while (header.status_code >= 100 && header.status_code < 200);
+
+	bool keep = header.keep_alive;
+	bool until_close = false;
+	uint64_t remaining = header.content_length;
+	if (header.status_code == 204 || header.status_code == 304) {
+		header.chunked = false;
+		remaining = 0;
+	} else if (!header.chunked && !header.length_known) {
+		until_close = true;
+		keep = false;
+	}
+
+	ChunkedDecoder decoder;
+	chunked_decoder_init(&decoder);
+	for (;;) {
+		size_t length = size;
+		if (header.chunked) {
+			ssize_t decoded = chunked_decode(&decoder, buffer, size);
+			if (decoded == -1) {
+				VERBOSE("Malformed chunked HTTP response");
+				return -1;
+			}
+			length = decoded;
+			if (decoder.excess > 0) {
+				keep = false; // More than the body; do not trust the connection
+			}
+		} else if (!until_close) {
+			if (length > remaining) {
+				length = remaining; // More than the peer announced; do not trust the connection
+				keep = false;
+			}
+			remaining -= length;
+		}
+		if (length > 0 && sink && sink(context, buffer, length) == -1) {
+			return -1;
+		}
+		if (header.chunked ? decoder.done : (!until_close && remaining == 0)) {
+			break;
+		}
+
+		ssize_t r = http_read(fd, buffer, sizeof buffer);
+		if (r == -1 || (r == 0 && !until_close)) {
+			return -1;
+		}
+		if (r == 0) {
+			break;
+		}
+		size = r;
+	}
+	*keep_alive = keep;
+	return header.status_code;
+}
+
+// Send a request header and its body, either from a buffer or from a source
+static int http_send_request(int fd, const String *header, const void *buf, size_t count,
+	HttpBodySource source, void *context) {
+	if (!source) {
+		struct iovec request[] = {
+			{ header->c_str, header->size },
+			{ (void *) buf, count },
+		};
+		return socket_writev(fd, request, 2) == -1 ? -1 : 0;
+	}
+
+	if (socket_send(fd, header->c_str, header->size, MSG_MORE) == -1) {
+		return -1;
+	}
+	char chunk[HTTP_BUFFER_SIZE];
+	ssize_t length;
+	while ((length = source(context, chunk, sizeof chunk)) > 0) {
+		if (chunked_write(fd, chunk, length) == -1) {
+			return -1;
+		}
+	}
+	return length == -1 ? -1 : chunked_write(fd, NULL, 0);
+}
+
+static int http_request(const char *method, const char *url, const void *buf, size_t count,
+	HttpBodySource source, void *source_context, HttpBodySink sink, void *sink_context) {
+	// Parse the URL once; host and port are decoded into stack buffers
+	// and the path is sent as it is, still percent-encoded.
+	Url parsed;
+	char host[256];
+	char port[32] = "80";
+	UrlSpan path = { 0, 0, false };
+	bool url_ok = url_parse(url, &parsed) == 0 &&
+		url_decode(url, &parsed.host, host, sizeof host) > 0 &&
+		(!parsed.port.present || url_decode(url, &parsed.port, port, sizeof port) > 0) &&
+		url_span(&parsed, URL_PATH, &path);
 
 	int response_code = -1;
 
-	if (host && port && path) {
-		String *buffer = string_new("");
+	if (url_ok) {
+		String *buffer = string_new(method);
 
-		string_append_c(buffer, "PUT ");
-		string_append_c(buffer, path);
+		string_append_c(buffer, " ");
+		if (path.length > 0) {
+			String path_str = { (char *) url + path.offset, path.length };
+			string_append(buffer, &path_str);
+		} else {
+			string_append_c(buffer, "/");
+		}
 		string_append_c(buffer, " HTTP/1.1\r\n");
 
 		string_append_c(buffer, "Host: ");
 		string_append_c(buffer, host);
 		string_append_c(buffer, "\r\n");
 
-		string_append_c(buffer, "Content-type: text/plain\r\n");
-
-		if (count > 0) {
-			char length_str[16];
+		if (source) {
+			string_append_c(buffer, "Content-type: text/plain\r\n");
+			string_append_c(buffer, "Transfer-Encoding: chunked\r\n");
+		} else if (buf) {
+			char length_str[24];
 			snprintf(length_str, sizeof length_str, "%zu", count);
+			string_append_c(buffer, "Content-type: text/plain\r\n");
 			string_append_c(buffer, "Content-length: ");
 			string_append_c(buffer, length_str);
 			string_append_c(buffer, "\r\n");
 		}
 
-		string_append_c(buffer, "Connection: close\r\n");
 		string_append_c(buffer, "Iam: anilakar\r\n");
 
 		string_append_c(buffer, "\r\n");
 
-		int http_socket = socket_tcp_connect(host, port);
-		if (http_socket >= 0) {
-			if (-1 == socket_write(http_socket, buffer->c_str, buffer->size) ||
-				-1 == socket_write(http_socket, buf, count)) {
+		// The peer may have closed a pooled connection just as it was taken; such
+		// a request fails before any response and is sent again on a new one,
+		// unless its body came from a source that cannot be replayed.
+		for (int attempt = 0; attempt < 2; ++attempt) {
+			bool reused = false;
+			int http_socket = http_pool_acquire(host, port, &reused);
+			if (http_socket == -1) {
+				VERBOSE("Could not connect to %s", host);
+				break;
+			}
+			bool keep_alive = false;
+			bool received = false;
+			if (-1 == http_send_request(http_socket, buffer, buf, count, source, source_context)) {
 				VERBOSE("Could not write to HTTP server.");
 			} else {
-				char response[512]; // Need only the first line
-				int r = socket_read(http_socket, response, sizeof response - 1);
-				response[r] = '\0';
-				sscanf(response, "HTTP/1.1 %d", &response_code);				
+				response_code = http_read_response(http_socket, sink, sink_context, &keep_alive, &received);
+			}
+			if (response_code != -1 && keep_alive) {
+				http_pool_release(host, port, http_socket);
+			} else {
+				socket_close(&http_socket);
+			}
+			if (response_code != -1 || !reused || received || source) {
+				break;
 			}
 		}
-		socket_close(&http_socket);
 		string_delete(buffer);
-
 	}
 	else {
 		VERBOSE("Malformed URL: %s", url);
 	}
 
-	free(path);
-	free(port);
-	free(host);
-
 	VERBOSE("HTTP Response: %d", response_code);
 	return response_code;
 }
 
+/**
+ * HTTP PUT buffer contents to a remote URL
+ * @param url URL to PUT the contents to
+ * @param buf Buffer whose contents to send
+ * @param count Size of buffer (number of bytes to send)
+ * @return HTTP status code, 200 for OK. See the HTTP RFC for details.
+ */
+int http_put_buf(const char *url, const void *buf, size_t count) {
+	return http_request("PUT", url, buf ? buf : "", count, NULL, NULL, NULL, NULL);
+}
+
+int http_put(const char *url, HttpBodySource source, void *context) {
+	return http_request("PUT", url, NULL, 0, source, context, NULL, NULL);
+}
+
+int http_get(const char *url, HttpBodySink sink, void *context) {
+	return http_request("GET", url, NULL, 0, NULL, NULL, sink, context);
+}
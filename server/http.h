@@ -1,7 +1,33 @@
 #ifndef HTTP_H_
 #define HTTP_H_
+/**
+ * HTTP client module
+ * Requests to remote HTTP servers over persistent connections. Idle connections
+ * are pooled per host and port, and resolved addresses are cached for a while,
+ * so repeated requests to the same peer skip both the lookup and the handshake.
+ * Responses are read to their end so that the connection can be reused.
+ */
 
 #include <stddef.h>
+#include <sys/types.h>
+
+/**
+ * Produces a request body piece by piece.
+ * @param context As given with the request.
+ * @param buf Buffer to fill.
+ * @param size Size of the buffer.
+ * @return Number of bytes put in buf, 0 at the end of the body, -1 to abort.
+ */
+typedef ssize_t (*HttpBodySource)(void *context, void *buf, size_t size);
+
+/**
+ * Consumes a response body piece by piece.
+ * @param context As given with the request.
+ * @param data Next bytes of the body, with any transfer coding removed.
+ * @param size Number of bytes at data.
+ * @return 0 to continue, -1 to abort.
+ */
+typedef int (*HttpBodySink)(void *context, const void *data, size_t size);
 
 /**
  * HTTP PUT buffer contents to a remote URL
@@ -9,7 +35,31 @@
  * @param buf Buffer whose contents to send
  * @param count Size of buffer (number of bytes to send)
  * @return HTTP status code, 200 for OK. See the HTTP RFC for details.
+ * -1 if no response was received.
  */
 int http_put_buf(const char *url, const void *buf, size_t count);
 
+/**
+ * HTTP PUT a body of unknown length to a remote URL, with chunked coding.
+ * @param url URL to PUT the body to.
+ * @param source Called for the body until it returns 0.
+ * @param context Passed to source.
+ * @return HTTP status code, -1 if no response was received.
+ */
+int http_put(const char *url, HttpBodySource source, void *context);
+
+/**
+ * HTTP GET a remote URL.
+ * @param url URL to get.
+ * @param sink Called with the response body as it arrives. NULL to discard it.
+ * @param context Passed to sink.
+ * @return HTTP status code, -1 if no complete response was received.
+ */
+int http_get(const char *url, HttpBodySink sink, void *context);
+
+/**
+ * Close the pooled idle connections and forget the cached addresses.
+ */
+void http_pool_close(void);
+
 #endif
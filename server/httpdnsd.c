@@ -3,15 +3,19 @@
 
 #include "common.h"
 
+#include <limits.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #include "httpserver.h"
+#include "log.h"
+#include "socket.h"
 #include "util.h"
 
 /**
@@ -70,34 +74,290 @@ static void daemonize(void) {
 
 static void print_usage_and_exit(const char *program_name) {
 	printf(
-		"Usage: %s [-f] [-v] PORT\n"
+		"Usage: %s [-f] [-v] [-o OPTION[,OPTION...]] PORT\n"
 		"    -f    Stay on foreground\n"
 		"    -v    Print verbose output\n"
-		"    PORT  Port or service name to listen on\n", program_name);
+		"    -o    Set server options:\n"
+		"          listeners=N   Listening sockets with SO_REUSEPORT, one accept\n"
+		"                        thread each; 0 for one per CPU (default 1)\n"
+		"          backlog=N     Accept queue length (default %d)\n"
+		"          incoming-cpu  Steer connections by receiving CPU (SO_INCOMING_CPU)\n"
+		"          io-uring      Use io_uring for accept and I/O when the kernel has it\n"
+		"          defer-accept=S    Seconds the kernel holds a connection until its\n"
+		"                            request arrives (TCP_DEFER_ACCEPT)\n"
+		"          fastopen=N        Pending TCP Fast Open requests (TCP_FASTOPEN)\n"
+		"          nodelay           Disable Nagle's algorithm (TCP_NODELAY)\n"
+		"          sndbuf=BYTES      Socket send buffer size (SO_SNDBUF)\n"
+		"          rcvbuf=BYTES      Socket receive buffer size (SO_RCVBUF)\n"
+		"          notsent-lowat=BYTES  Unsent bytes kept in the kernel (TCP_NOTSENT_LOWAT)\n"
+		"          busy-poll=US      Microseconds to busy poll on reads (SO_BUSY_POLL)\n"
+		"          user-timeout=MS   Time sent data may go unacknowledged before the\n"
+		"                            connection is dropped (TCP_USER_TIMEOUT)\n"
+		"                            0 leaves any of these at the kernel default\n"
+		"          idle-timeout=S    Seconds to wait for a request (default %d)\n"
+		"          header-timeout=S  Seconds to receive a request header (default %d)\n"
+		"          body-timeout=S    Seconds without progress receiving a body (default %d)\n"
+		"          write-timeout=S   Seconds without progress sending a response (default %d)\n"
+		"                            0 disables a timeout\n"
+		"          shed-target=MS    Queue delay above which bulk requests are shed\n"
+		"                            with 503 (default %d, 0 never sheds)\n"
+		"          shed-interval=MS  Time the delay may stay above target (default %d)\n"
+		"          dns-workers=N     Worker threads for DNS lookups (default %d)\n"
+		"          bulk-workers=N    Worker threads for other requests (default %d)\n"
+		"          dns-limit=N       DNS connections queued or served (default %d)\n"
+		"          bulk-limit=N      Other connections queued or served (default %d)\n"
+		"          bulk-rate=KIB     Bandwidth in KiB/s shared by file transfers\n"
+		"                            (default 0, unlimited)\n"
+		"          get-weight=N      Bandwidth share of a download (default 1)\n"
+		"          put-weight=N      Bandwidth share of an upload (default 1)\n"
+		"          durability=MODE   Flush uploads to disk before answering 201:\n"
+		"                            none (default), request (fsync each upload)\n"
+		"                            or group (batch concurrent uploads)\n"
+		"          group-window=MS   Time a group waits for more uploads (default %d)\n"
+		"          file-cache=N      Files kept open for GET, 0 disables (default %d)\n"
+		"          file-cache-check=MS  Age at which a cached file is checked for\n"
+		"                            changes inotify missed (default %d, 0 never)\n"
+		"          response-cache=KIB  Memory for pre-rendered responses of small\n"
+		"                            cached files (default %d, 0 disables)\n"
+		"          small-file=BYTES  Largest file kept as a response (default %d)\n"
+		"          sidecar-min=BYTES  Smallest text file sent from a precompressed\n"
+		"                            copy such as FILE.gz or FILE.zst (default %d)\n"
+		"          sidecar-generate  Make missing copies with gzip and zstd\n"
+		"          registry=URL      Where to register the server; empty to not\n"
+		"                            register (default: the course server)\n"
+		"          registry-deadline=MS  Time shutdown waits for deregistering\n"
+		"                            (default %d)\n"
+		"          metrics=PATH      Path serving metrics in the Prometheus text\n"
+		"                            format; empty for none (default %s)\n"
+		"    PORT  Port or service name to listen on\n", program_name, SOCKET_DEFAULT_BACKLOG,
+		HTTPSERVER_DEFAULT_IDLE_TIMEOUT, HTTPSERVER_DEFAULT_HEADER_TIMEOUT,
+		HTTPSERVER_DEFAULT_BODY_TIMEOUT, HTTPSERVER_DEFAULT_WRITE_TIMEOUT,
+		HTTPSERVER_DEFAULT_SHED_TARGET, HTTPSERVER_DEFAULT_SHED_INTERVAL,
+		HTTPSERVER_DEFAULT_DNS_WORKERS, HTTPSERVER_DEFAULT_BULK_WORKERS,
+		HTTPSERVER_DEFAULT_DNS_LIMIT, HTTPSERVER_DEFAULT_BULK_LIMIT, HTTPSERVER_DEFAULT_GROUP_WINDOW,
+		HTTPSERVER_DEFAULT_FILE_CACHE, HTTPSERVER_DEFAULT_FILE_CACHE_CHECK,
+		HTTPSERVER_DEFAULT_RESPONSE_CACHE, HTTPSERVER_DEFAULT_SMALL_FILE,
+		HTTPSERVER_DEFAULT_SIDECAR_MIN, HTTPSERVER_DEFAULT_REGISTRY_DEADLINE,
+		HTTPSERVER_DEFAULT_METRICS);
 	exit(0);
 }
 
+// Parse an integer option value. Exits on malformed values.
+static int parse_int_option(const char *program_name, const char *name, const char *value, int min) {
+	char *end = NULL;
+	long number = value ? strtol(value, &end, 10) : 0;
+	if (!value || *end != '\0' || number < min || number > INT_MAX) {
+		printf("Invalid value for option '%s'\n", name);
+		print_usage_and_exit(program_name);
+	}
+	return number;
+}
+
+// Parse a comma separated list of name=value server options
+static void parse_server_options(const char *program_name, char *subopts, HttpServerConfig *config) {
+	enum {
+		OPT_LISTENERS, OPT_BACKLOG, OPT_INCOMING_CPU, OPT_IO_URING,
+		OPT_DEFER_ACCEPT, OPT_FASTOPEN, OPT_NODELAY, OPT_SNDBUF, OPT_RCVBUF,
+		OPT_NOTSENT_LOWAT, OPT_BUSY_POLL, OPT_USER_TIMEOUT,
+		OPT_IDLE_TIMEOUT, OPT_HEADER_TIMEOUT, OPT_BODY_TIMEOUT, OPT_WRITE_TIMEOUT,
+		OPT_SHED_TARGET, OPT_SHED_INTERVAL, OPT_DNS_WORKERS, OPT_BULK_WORKERS,
+		OPT_DNS_LIMIT, OPT_BULK_LIMIT, OPT_BULK_RATE, OPT_GET_WEIGHT, OPT_PUT_WEIGHT,
+		OPT_DURABILITY, OPT_GROUP_WINDOW, OPT_FILE_CACHE, OPT_FILE_CACHE_CHECK,
+		OPT_RESPONSE_CACHE, OPT_SMALL_FILE, OPT_SIDECAR_MIN, OPT_SIDECAR_GENERATE,
+		OPT_REGISTRY, OPT_REGISTRY_DEADLINE, OPT_METRICS
+	};
+	char *const names[] = {
+		[OPT_LISTENERS] = "listeners",
+		[OPT_BACKLOG] = "backlog",
+		[OPT_INCOMING_CPU] = "incoming-cpu",
+		[OPT_IO_URING] = "io-uring",
+		[OPT_DEFER_ACCEPT] = "defer-accept",
+		[OPT_FASTOPEN] = "fastopen",
+		[OPT_NODELAY] = "nodelay",
+		[OPT_SNDBUF] = "sndbuf",
+		[OPT_RCVBUF] = "rcvbuf",
+		[OPT_NOTSENT_LOWAT] = "notsent-lowat",
+		[OPT_BUSY_POLL] = "busy-poll",
+		[OPT_USER_TIMEOUT] = "user-timeout",
+		[OPT_IDLE_TIMEOUT] = "idle-timeout",
+		[OPT_HEADER_TIMEOUT] = "header-timeout",
+		[OPT_BODY_TIMEOUT] = "body-timeout",
+		[OPT_WRITE_TIMEOUT] = "write-timeout",
+		[OPT_SHED_TARGET] = "shed-target",
+		[OPT_SHED_INTERVAL] = "shed-interval",
+		[OPT_DNS_WORKERS] = "dns-workers",
+		[OPT_BULK_WORKERS] = "bulk-workers",
+		[OPT_DNS_LIMIT] = "dns-limit",
+		[OPT_BULK_LIMIT] = "bulk-limit",
+		[OPT_BULK_RATE] = "bulk-rate",
+		[OPT_GET_WEIGHT] = "get-weight",
+		[OPT_PUT_WEIGHT] = "put-weight",
+		[OPT_DURABILITY] = "durability",
+		[OPT_GROUP_WINDOW] = "group-window",
+		[OPT_FILE_CACHE] = "file-cache",
+		[OPT_FILE_CACHE_CHECK] = "file-cache-check",
+		[OPT_RESPONSE_CACHE] = "response-cache",
+		[OPT_SMALL_FILE] = "small-file",
+		[OPT_SIDECAR_MIN] = "sidecar-min",
+		[OPT_SIDECAR_GENERATE] = "sidecar-generate",
+		[OPT_REGISTRY] = "registry",
+		[OPT_REGISTRY_DEADLINE] = "registry-deadline",
+		[OPT_METRICS] = "metrics",
+		NULL
+	};
+
+	while (*subopts != '\0') {
+		char *value = NULL;
+		int index = getsubopt(&subopts, names, &value);
+		switch (index) {
+		case OPT_LISTENERS:
+			config->listeners = parse_int_option(program_name, names[index], value, 0);
+			break;
+		case OPT_BACKLOG:
+			config->backlog = parse_int_option(program_name, names[index], value, 1);
+			break;
+		case OPT_INCOMING_CPU:
+			config->incoming_cpu = true;
+			break;
+		case OPT_IO_URING:
+			config->io_uring = true;
+			break;
+		case OPT_DEFER_ACCEPT:
+			config->defer_accept = parse_int_option(program_name, names[index], value, 0);
+			break;
+		case OPT_FASTOPEN:
+			config->fastopen = parse_int_option(program_name, names[index], value, 0);
+			break;
+		case OPT_NODELAY:
+			config->nodelay = true;
+			break;
+		case OPT_SNDBUF:
+			config->send_buffer = parse_int_option(program_name, names[index], value, 0);
+			break;
+		case OPT_RCVBUF:
+			config->receive_buffer = parse_int_option(program_name, names[index], value, 0);
+			break;
+		case OPT_NOTSENT_LOWAT:
+			config->notsent_lowat = parse_int_option(program_name, names[index], value, 0);
+			break;
+		case OPT_BUSY_POLL:
+			config->busy_poll = parse_int_option(program_name, names[index], value, 0);
+			break;
+		case OPT_USER_TIMEOUT:
+			config->user_timeout = parse_int_option(program_name, names[index], value, 0);
+			break;
+		case OPT_IDLE_TIMEOUT:
+			config->idle_timeout = parse_int_option(program_name, names[index], value, 0);
+			break;
+		case OPT_HEADER_TIMEOUT:
+			config->header_timeout = parse_int_option(program_name, names[index], value, 0);
+			break;
+		case OPT_BODY_TIMEOUT:
+			config->body_timeout = parse_int_option(program_name, names[index], value, 0);
+			break;
+		case OPT_WRITE_TIMEOUT:
+			config->write_timeout = parse_int_option(program_name, names[index], value, 0);
+			break;
+		case OPT_SHED_TARGET:
+			config->shed_target = parse_int_option(program_name, names[index], value, 0);
+			break;
+		case OPT_SHED_INTERVAL:
+			config->shed_interval = parse_int_option(program_name, names[index], value, 1);
+			break;
+		case OPT_DNS_WORKERS:
+			config->dns_workers = parse_int_option(program_name, names[index], value, 1);
+			break;
+		case OPT_BULK_WORKERS:
+			config->bulk_workers = parse_int_option(program_name, names[index], value, 1);
+			break;
+		case OPT_DNS_LIMIT:
+			config->dns_limit = parse_int_option(program_name, names[index], value, 1);
+			break;
+		case OPT_BULK_LIMIT:
+			config->bulk_limit = parse_int_option(program_name, names[index], value, 1);
+			break;
+		case OPT_BULK_RATE:
+			config->bulk_rate = parse_int_option(program_name, names[index], value, 0);
+			break;
+		case OPT_GET_WEIGHT:
+			config->get_weight = parse_int_option(program_name, names[index], value, 1);
+			break;
+		case OPT_PUT_WEIGHT:
+			config->put_weight = parse_int_option(program_name, names[index], value, 1);
+			break;
+		case OPT_DURABILITY:
+			if (value && !strcmp(value, "none")) {
+				config->durability = DURABILITY_NONE;
+			} else if (value && !strcmp(value, "request")) {
+				config->durability = DURABILITY_REQUEST;
+			} else if (value && !strcmp(value, "group")) {
+				config->durability = DURABILITY_GROUP;
+			} else {
+				printf("Invalid value for option '%s'\n", names[index]);
+				print_usage_and_exit(program_name);
+			}
+			break;
+		case OPT_GROUP_WINDOW:
+			config->group_window = parse_int_option(program_name, names[index], value, 0);
+			break;
+		case OPT_FILE_CACHE:
+			config->file_cache = parse_int_option(program_name, names[index], value, 0);
+			break;
+		case OPT_FILE_CACHE_CHECK:
+			config->file_cache_check = parse_int_option(program_name, names[index], value, 0);
+			break;
+		case OPT_RESPONSE_CACHE:
+			config->response_cache = parse_int_option(program_name, names[index], value, 0);
+			break;
+		case OPT_SMALL_FILE:
+			config->small_file = parse_int_option(program_name, names[index], value, 0);
+			break;
+		case OPT_SIDECAR_MIN:
+			config->sidecar_min = parse_int_option(program_name, names[index], value, 0);
+			break;
+		case OPT_SIDECAR_GENERATE:
+			config->sidecar_generate = true;
+			break;
+		case OPT_REGISTRY:
+			config->registry = value ? value : "";
+			break;
+		case OPT_REGISTRY_DEADLINE:
+			config->registry_deadline = parse_int_option(program_name, names[index], value, 0);
+			break;
+		case OPT_METRICS:
+			config->metrics = value ? value : "";
+			break;
+		default:
+			printf("Unknown server option '%s'\n", value);
+			print_usage_and_exit(program_name);
+		}
+	}
+}
+
 int main(int argc, char *argv[]) {
 	struct {
 		bool daemonize;
 		bool verbose;
-		char *port;
+		HttpServerConfig server;
 	} options = {
 		.daemonize = true,
 		.verbose = false,
-		.port = NULL,
 	};
+	httpserver_config_default(&options.server);
 
 	// Accept -v for verbose mode. Disable getopt internal warnings.
 	extern int opterr, optopt, optind;
 	opterr = 0;
 	int optchar;
-	while (-1 != (optchar = getopt(argc, argv, "fv"))) {
+	while (-1 != (optchar = getopt(argc, argv, "fvo:"))) {
 		if (optchar == 'f'){
 			options.daemonize = false;
 		}
 		else if (optchar == 'v') {
 			options.verbose = true;
+		}
+		else if (optchar == 'o') {
+			parse_server_options(argv[0], optarg, &options.server);
 		} else {
 			printf("Unknown option '%c'\n", optopt);
 			print_usage_and_exit(argv[0]);
@@ -107,7 +367,7 @@ int main(int argc, char *argv[]) {
 	if (argc - optind != 1) {
 		print_usage_and_exit(argv[0]);
 	}
-	options.port = argv[optind + 0];
+	options.server.port = argv[optind + 0];
 
 	// Go to background
 	if (options.daemonize) {
@@ -119,8 +379,14 @@ int main(int argc, char *argv[]) {
 		freopen("/dev/null", "w", stderr);
 	}
 
-	httpserver_run(options.port);
+	// Threads do not survive daemonizing; start logging only after it
+	if (log_start(options.verbose ? LOG_LEVEL_VERBOSE : LOG_LEVEL_NONE) == -1) {
+		fprintf(stderr, "Could not start logging\n");
+	}
 
-	return EXIT_SUCCESS;
-}
+	int result = httpserver_run(&options.server);
+
+	log_stop();
 
+	return result == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -1,31 +1,54 @@
 #include "common.h"
 
+#include <ctype.h>
 #include <errno.h>
-#include <dirent.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <linux/tcp.h> // struct tcp_info of glibc lacks the byte counters
 #include <netdb.h>
 #include <netinet/in.h>
+#include <pthread.h>
+#include <sched.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/select.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "admission.h"
+#include "chunked.h"
 #include "dns.h"
+#include "durability.h"
+#include "filecache.h"
 #include "http.h"
 #include "httpserver.h"
+#include "metrics.h"
+#include "mime.h"
+#include "pacer.h"
+#include "registration.h"
+#include "sidecar.h"
 #include "socket.h"
 #include "string.h"
-#include "thread.h"
+#include "timer.h"
+#include "uring.h"
 #include "util.h"
+#include "workqueue.h"
 
 #define CRLF "\r\n"
+#define HEADER_MAX 512 // Enough for any response header we generate
 #define I_AM "anilakar"
 #define DEFAULT_DNS_SERVER "8.8.8.8" // Google's open DNS resolver
 #define REGISTRATION_URL "http://nwprog1.netlab.hut.fi:3000/servers-" I_AM ".txt"
@@ -37,228 +60,1206 @@ void signal_handler(int signal) {
 	caught_signal = 1;
 }
 
-// Thread parameters
-typedef struct {
+// What a connection is waiting for. Each phase has its own deadline.
+typedef enum {
+	DEADLINE_IDLE, // First byte of a request
+	DEADLINE_HEADER, // Rest of the request header
+	DEADLINE_BODY, // Progress on the request body
+	DEADLINE_WRITE, // Progress on sending the response
+	DEADLINE_COUNT
+} DeadlinePhase;
+
+#define TIMER_TICK_MS 100
+
+static unsigned deadline_ms[DEADLINE_COUNT]; // 0 for no deadline
+
+// Execution classes. DNS lookups and bulk transfers are served by separate
+// worker pools so lookups never wait behind transfers.
+static WorkQueue *work_queues[ADMISSION_CLASS_COUNT];
+static unsigned class_limit[ADMISSION_CLASS_COUNT]; // Connections held per class
+static unsigned class_connections[ADMISSION_CLASS_COUNT];
+static Admission admission;
+
+// Bandwidth sharing of bulk transfers
+static Pacer bulk_pacer;
+static unsigned get_weight;
+static unsigned put_weight;
+
+// Files up to this size, and listings up to the other, are served from
+// pre-rendered responses in the file cache
+static size_t small_file_max;
+static size_t listing_cache_max;
+static size_t listing_copies_size; // Bytes held by listings being collected, at most listing_cache_max in all
+
+// Smallest file served from a precompressed copy
+static size_t sidecar_min;
+
+// Path of the metrics endpoint, empty for none
+static const char *metrics_path = "";
+static const char *const class_names[ADMISSION_CLASS_COUNT] = {
+	[ADMISSION_DNS] = "dns",
+	[ADMISSION_BULK] = "bulk",
+};
+
+// A connection waiting for or being served by a worker
+typedef struct Connection {
+	WorkItem work;
 	int client_fd;
-} ThreadData;
-
-static void httpserver_reply_full(int fd, const char *code_and_status) {
-	char content_length[16];
-	snprintf(content_length, sizeof(content_length), "%zu", strlen(code_and_status));
-
-	String *reply = string_new("");
-	string_append_c(reply, "HTTP/1.1 ");
-	string_append_c(reply, code_and_status);
-	string_append_c(reply, CRLF);
-	string_append_c(reply, "Iam: " I_AM CRLF);
-	string_append_c(reply, "Content-Type: text/plain" CRLF);
-	string_append_c(reply, "Content-Length: ");
-	string_append_c(reply, content_length);
-	string_append_c(reply, CRLF);
-	string_append_c(reply, "Connection: close" CRLF CRLF);
-	string_append_c(reply, code_and_status);
-	socket_write(fd, reply->c_str, reply->size);
-	string_delete(reply);
-}
-
-static void httpserver_reply_header(int fd, const char *code_and_status) {
-	String *reply = string_new("");
-	string_append_c(reply, "HTTP/1.1 ");
-	string_append_c(reply, code_and_status);
-	string_append_c(reply, CRLF);
-	string_append_c(reply, "Iam: " I_AM CRLF);
-	string_append_c(reply, "Connection: close" CRLF CRLF);
-	socket_write(fd, reply->c_str, reply->size);
-	string_delete(reply);
+	struct sockaddr_storage peer;
+	socklen_t peer_length; // 0 if the peer address was not recorded at accept
+	char *buffer; // Request bytes already received, NULL if none
+	ssize_t buffered;
+	Timer deadline;
+	int phase;
+	uint64_t progress; // Bytes received or acknowledged when the deadline was last checked
+	AdmissionClass class; // Worker pool the connection is queued to
+	uint64_t accepted_us; // When the listener took the connection
+	uint64_t reading_us; // Time the request header took to arrive
+	PacerFlow flow;
+	struct Connection *pending_prev; // Neighbours in the pending list of the listener
+	struct Connection *pending_next;
+} Connection;
+
+// A listening socket and the thread accepting from it. Accepted connections
+// stay with the thread until their request header has arrived, so that idle
+// and slow clients do not hold workers.
+typedef struct {
+	int listen_socket;
+	int pending; // epoll set of connections whose request header is still arriving
+	Connection *pending_list; // The connections in the set, to close them at shutdown
+	int cpu; // CPU to pin the accept thread to, -1 for none
+	pthread_t thread;
+} Listener;
+
+#define PENDING_EVENTS 64 // Readiness events taken per epoll_wait
+
+static unsigned pending_connections; // Connections waiting for their request header in all listeners
+
+// io_uring engine
+#define URING_ENTRIES 256
+#define URING_BUFFER_COUNT 64 // Provided receive buffers per listener
+#define URING_BUFFER_GROUP 0
+#define URING_SEND_FILE_MIN 262144 // Smaller files are not worth a ring
+#define REQUEST_BUFFER_SIZE 8192
+
+static bool use_uring = false;
+static bool uring_failed = false; // Set once if a ring could not be created
+static pthread_key_t uring_key; // Ring of each worker thread, for file sends
+
+// Header lines common to every response
+#define HEADER_FIELDS "Iam: " I_AM CRLF
+#define TEXT_PLAIN "text/plain"
+
+static const char *const connection_header[] = {
+	"Connection: close" CRLF,
+	"Connection: keep-alive" CRLF,
+};
+
+// Content lengths of bodies whose length is not known up front
+#define BODY_CHUNKED ((size_t) -1) // Sent with chunked transfer coding
+#define BODY_UNTIL_CLOSE ((size_t) -2) // Ended by closing the connection, for HTTP/1.0 clients
+#define BODY_NONE ((size_t) -3) // No body at all, as in 304 responses
+
+// Render a complete response header with a body of given type and length.
+// content_type is NULL for a response without a body. fields holds additional
+// header lines, each ending in CRLF.
+// Returns the header size, or 0 if it did not fit in the buffer.
+static size_t httpserver_format_header_with(char *buf, size_t size, const char *code_and_status,
+		const char *content_type, const char *fields, size_t content_length, bool keep_alive) {
+	char type_field[128] = "";
+	if (content_type) {
+		snprintf(type_field, sizeof type_field, "Content-Type: %s" CRLF, content_type);
+	}
+	char length_field[64] = "";
+	if (content_length == BODY_CHUNKED) {
+		snprintf(length_field, sizeof length_field, "Transfer-Encoding: chunked" CRLF);
+	} else if (content_length != BODY_UNTIL_CLOSE && content_length != BODY_NONE) {
+		snprintf(length_field, sizeof length_field, "Content-Length: %zu" CRLF, content_length);
+	}
+	int r = snprintf(buf, size,
+		"HTTP/1.1 %s" CRLF
+		HEADER_FIELDS
+		"%s"
+		"%s"
+		"%s"
+		"%s" CRLF,
+		code_and_status, type_field, fields, length_field, connection_header[keep_alive]);
+	if (r < 0 || (size_t) r >= size) {
+		return 0;
+	}
+	metrics_status(atoi(code_and_status));
+	return r;
+}
+
+// Render a complete response header with a plain text body of given length.
+static size_t httpserver_format_header(char *buf, size_t size, const char *code_and_status,
+		size_t content_length, bool keep_alive) {
+	return httpserver_format_header_with(buf, size, code_and_status, TEXT_PLAIN, "", content_length, keep_alive);
+}
+
+// Responses whose bytes never change. Rendered once at startup by
+// httpserver_render_static_replies, read-only afterwards.
+typedef enum {
+	REPLY_CONTINUE,
+	REPLY_CREATED,
+	REPLY_BAD_REQUEST,
+	REPLY_FORBIDDEN,
+	REPLY_NOT_FOUND,
+	REPLY_METHOD_NOT_ALLOWED,
+	REPLY_INTERNAL_SERVER_ERROR,
+	REPLY_SERVICE_UNAVAILABLE,
+	REPLY_COUNT
+} StaticReply;
+
+static const char *const static_reply_status[REPLY_COUNT] = {
+	[REPLY_CONTINUE] = "100 Continue",
+	[REPLY_CREATED] = "201 Created",
+	[REPLY_BAD_REQUEST] = "400 Bad Request",
+	[REPLY_FORBIDDEN] = "403 Forbidden",
+	[REPLY_NOT_FOUND] = "404 Not Found",
+	[REPLY_METHOD_NOT_ALLOWED] = "405 Method Not Allowed",
+	[REPLY_INTERNAL_SERVER_ERROR] = "503 Internal Server Error",
+	[REPLY_SERVICE_UNAVAILABLE] = "503 Service Unavailable",
+};
+
+// Sent with load shedding replies
+#define RETRY_AFTER "Retry-After: 1" CRLF
+
+typedef struct {
+	const char *data;
+	size_t size;
+} StaticBuffer;
+
+// Connections are closed after one request, so only the close variant is rendered
+static StaticBuffer static_replies[REPLY_COUNT];
+
+static int httpserver_render_static_replies(void) {
+	for (int reply = 0; reply < REPLY_COUNT; ++reply) {
+		const char *status = static_reply_status[reply];
+		char buffer[HEADER_MAX];
+		size_t size;
+		if (reply == REPLY_CONTINUE) {
+			// Interim response, header only
+			size = snprintf(buffer, sizeof buffer, "HTTP/1.1 %s" CRLF "Iam: " I_AM CRLF CRLF, status);
+		} else {
+			// Status line doubles as the body
+			size = httpserver_format_header(buffer, sizeof buffer, status, strlen(status), false);
+			if (reply == REPLY_SERVICE_UNAVAILABLE) {
+				// Insert before the blank line ending the header
+				memcpy(buffer + size - strlen(CRLF), RETRY_AFTER CRLF, strlen(RETRY_AFTER CRLF));
+				size += strlen(RETRY_AFTER);
+			}
+			memcpy(buffer + size, status, strlen(status));
+			size += strlen(status);
+		}
+
+		char *data = malloc(size);
+		if (!data) {
+			return -1;
+		}
+		memcpy(data, buffer, size);
+		static_replies[reply].data = data;
+		static_replies[reply].size = size;
+	}
+	return 0;
+}
+
+static void httpserver_free_static_replies(void) {
+	for (int reply = 0; reply < REPLY_COUNT; ++reply) {
+		free((char *) static_replies[reply].data);
+		static_replies[reply].data = NULL;
+	}
+}
+
+static void httpserver_reply_static(int fd, StaticReply reply) {
+	const StaticBuffer *buffer = &static_replies[reply];
+	metrics_status(atoi(static_reply_status[reply]));
+	socket_write(fd, buffer->data, buffer->size);
 }
 
 static void httpserver_reply_ok(int fd, String **payload_lines) {
-	char content_length[16];
+	size_t line_count = 0;
 	size_t content_length_bytes = 0;
-	for (String **it = payload_lines; *it; ++it) {
+	for (String **it = payload_lines; it && *it; ++it) {
 		content_length_bytes += (*it)->size + 2; // + 2 CRLF
+		++line_count;
 	}
-	snprintf(content_length, sizeof content_length, "%zu", content_length_bytes);
 
-	String *reply = string_new("");
-	string_append_c(reply, "HTTP/1.1 200 OK" CRLF);
-	string_append_c(reply, "Iam: " I_AM CRLF);
-	string_append_c(reply, "Content-Type: text/plain" CRLF);
-	string_append_c(reply, "Content-Length: ");
-	string_append_c(reply, content_length);
-	string_append_c(reply, CRLF);
-	string_append_c(reply, "Connection: close" CRLF CRLF);
-	socket_write(fd, reply->c_str, reply->size);
-	for (String **it = payload_lines; *it; ++it) {
-		socket_write(fd, (*it)->c_str, (*it)->size);
-		socket_write(fd, CRLF, strlen(CRLF));
+	// Header, then each payload line followed by a CRLF, in one write
+	char header[HEADER_MAX];
+	struct iovec *reply = malloc(sizeof(*reply) * (1 + 2 * line_count));
+	if (!reply) {
+		return;
+	}
+	int iovcnt = 0;
+	reply[iovcnt].iov_base = header;
+	reply[iovcnt++].iov_len = httpserver_format_header(header, sizeof header, "200 OK", content_length_bytes, false);
+	for (String **it = payload_lines; it && *it; ++it) {
+		reply[iovcnt].iov_base = (*it)->c_str;
+		reply[iovcnt++].iov_len = (*it)->size;
+		reply[iovcnt].iov_base = CRLF;
+		reply[iovcnt++].iov_len = strlen(CRLF);
 	}
-	string_delete(reply);
+	socket_writev(fd, reply, iovcnt);
+	free(reply);
 }
 
 static void httpserver_reply_bad_request(int fd) {
-	httpserver_reply_full(fd, "400 Bad Request");
+	httpserver_reply_static(fd, REPLY_BAD_REQUEST);
 }
 
 static void httpserver_reply_forbidden(int fd) {
-	httpserver_reply_full(fd, "403 Forbidden");
+	httpserver_reply_static(fd, REPLY_FORBIDDEN);
 }
 
 static void httpserver_reply_not_found(int fd) {
-	httpserver_reply_full(fd, "404 Not Found");
+	httpserver_reply_static(fd, REPLY_NOT_FOUND);
 }
 
 static void httpserver_reply_method_not_allowed(int fd) {
-	httpserver_reply_full(fd, "405 Method Not Allowed");
+	httpserver_reply_static(fd, REPLY_METHOD_NOT_ALLOWED);
 }
 
 static void httpserver_reply_internal_server_error(int fd) {
-	httpserver_reply_full(fd, "503 Internal Server Error");
-}
-
-static void httpserver_reply_get_file(int *network_socket, int *local_file) {
-	// Find out file size and rewind
-	size_t file_size = lseek(*local_file, 0, SEEK_END);
-	char content_length[16];
-	snprintf(content_length, sizeof(content_length), "%zu", file_size);
-	lseek(*local_file, 0, SEEK_SET);
-
-	// Generate and send header
-	String *reply = string_new("");
-	string_append_c(reply, "HTTP/1.1 200 OK" CRLF);
-	string_append_c(reply, "Iam: " I_AM CRLF);
-	string_append_c(reply, "Content-Type: text/plain" CRLF);
-	string_append_c(reply, "Content-Length: ");
-	string_append_c(reply, content_length);
-	string_append_c(reply, CRLF);
-	string_append_c(reply, "Connection: close" CRLF CRLF);
-	socket_write(*network_socket, reply->c_str, reply->size);
-	string_delete(reply);
-
-	// Send content/payload
-	size_t bytes_remaining = file_size;
-	while (bytes_remaining > 0) {
-		char buffer[8192];
-		ssize_t bytes_read = socket_read(*local_file, buffer, sizeof buffer);
-		if (bytes_read < 0) {
-			break; // Abort, there's really nothing helpful to do after the headers are on the wire
-		}
-		ssize_t bytes_written = socket_write(*network_socket, buffer, bytes_read);
-		if (bytes_written < 0) {
-			break; // As above
-		}
-		bytes_remaining -= bytes_written;
-	}
-}
-
-static inline String *httpserver_get_directory_contents_dir(DIR *directory) {
-	struct dirent entry;
-	struct dirent *iter;
-	String *s = string_new("");
-	if (s) {
-		while (readdir_r(directory, &entry, &iter), iter) {
-			if (!string_append_c(s, entry.d_name) || !string_append_c(s, "\r\n")) {
-				string_delete(s); 
-				s = NULL;
-				break;
+	httpserver_reply_static(fd, REPLY_INTERNAL_SERVER_ERROR);
+}
+
+// Ring of the calling worker thread for file sends, NULL if io_uring is not in use
+static Uring *httpserver_thread_ring(void) {
+	if (!use_uring || __atomic_load_n(&uring_failed, __ATOMIC_RELAXED)) {
+		return NULL;
+	}
+	Uring *ring = pthread_getspecific(uring_key);
+	if (!ring) {
+		ring = malloc(sizeof(*ring));
+		if (!ring || uring_init(ring, 16) == -1) {
+			__atomic_store_n(&uring_failed, true, __ATOMIC_RELAXED);
+			free(ring);
+			return NULL;
+		}
+		pthread_setspecific(uring_key, ring);
+	}
+	return ring;
+}
+
+static void httpserver_thread_ring_delete(void *ring) {
+	uring_destroy(ring);
+	free(ring);
+}
+
+/**
+ * Find a field of a request header.
+ * @param header Request header split to lines, request line first.
+ * @param name Field name, matched case-insensitively.
+ * @return The field value without leading whitespace, NULL if the field is not present.
+ */
+static const char *httpserver_header_value(String **header, const char *name) {
+	size_t length = strlen(name);
+	for (String **line = header + 1; *line && (*line)->size > 0; ++line) {
+		const char *field = (*line)->c_str;
+		if (strncasecmp(field, name, length) == 0 && field[length] == ':') {
+			return field + length + 1 + strspn(field + length + 1, " \t");
+		}
+	}
+	return NULL;
+}
+
+#define HTTP_DATE_FORMAT "%a, %d %b %Y %H:%M:%S GMT"
+#define ETAG_MAX 64
+#define VALIDATORS_MAX 192
+
+static bool httpserver_parse_date(const char *value, time_t *date) {
+	struct tm fields;
+	memset(&fields, 0, sizeof fields);
+	const char *end = strptime(value, HTTP_DATE_FORMAT, &fields);
+	if (!end || *end != '\0') {
+		return false;
+	}
+	*date = timegm(&fields);
+	return true;
+}
+
+// Validators of the version of a file or directory being served
+typedef struct {
+	char etag[ETAG_MAX];
+	char fields[VALIDATORS_MAX]; // ETag and Last-Modified header lines, and the extra ones given
+} Validators;
+
+// The entity tag changes with the inode, size or modification time. extra holds
+// more header lines describing the version, each ending in CRLF.
+static void httpserver_validators(Validators *validators, const struct stat *stats, const char *extra) {
+	snprintf(validators->etag, sizeof validators->etag, "\"%llx-%llx-%llx.%lx\"",
+		(unsigned long long) stats->st_ino, (unsigned long long) stats->st_size,
+		(unsigned long long) stats->st_mtim.tv_sec, (unsigned long) stats->st_mtim.tv_nsec);
+	char date[32];
+	struct tm fields;
+	gmtime_r(&stats->st_mtime, &fields);
+	strftime(date, sizeof date, HTTP_DATE_FORMAT, &fields);
+	snprintf(validators->fields, sizeof validators->fields, "ETag: %s" CRLF "Last-Modified: %s" CRLF "%s",
+		validators->etag, date, extra);
+}
+
+// Whether a list of entity tags, as in If-None-Match, has the given one.
+// Weak and strong tags compare equal.
+static bool httpserver_etag_listed(const char *list, const char *etag) {
+	size_t length = strlen(etag);
+	for (const char *p = list; *p; ) {
+		p += strspn(p, " \t,");
+		if (*p == '*') {
+			return true;
+		}
+		if (strncmp(p, "W/", 2) == 0) {
+			p += 2;
+		}
+		if (*p != '"') {
+			return false;
+		}
+		const char *end = strchr(p + 1, '"');
+		if (!end) {
+			return false;
+		}
+		if ((size_t) (end + 1 - p) == length && strncmp(p, etag, length) == 0) {
+			return true;
+		}
+		p = end + 1;
+	}
+	return false;
+}
+
+// Whether the client already has the current version, by If-None-Match or,
+// without it, If-Modified-Since
+static bool httpserver_not_modified(String **header, const Validators *validators, const struct stat *stats) {
+	const char *value = httpserver_header_value(header, "If-None-Match");
+	if (value) {
+		return httpserver_etag_listed(value, validators->etag);
+	}
+	value = httpserver_header_value(header, "If-Modified-Since");
+	time_t date;
+	return value && httpserver_parse_date(value, &date) && stats->st_mtime <= date;
+}
+
+static void httpserver_reply_not_modified(int fd, const Validators *validators) {
+	char header[HEADER_MAX];
+	socket_write(fd, header, httpserver_format_header_with(header, sizeof header,
+		"304 Not Modified", NULL, validators->fields, BODY_NONE, false));
+}
+
+#define RANGES_MAX 16 // Requests for more ranges are served the whole file
+#define BYTERANGES_BOUNDARY "7c3a91e05d24b8f6"
+
+// Byte positions of a range, both inclusive as in Content-Range
+typedef struct {
+	off_t first;
+	off_t last;
+} ByteRange;
+
+// Parse a Range field value against the size of a file. Returns the number of
+// satisfiable ranges, 0 if none of them is satisfiable, or -1 if the field is to
+// be ignored: it is malformed, uses another unit or asks for too many ranges.
+static int httpserver_parse_ranges(const char *value, off_t size, ByteRange *ranges) {
+	if (strncasecmp(value, "bytes=", strlen("bytes=")) != 0) {
+		return -1;
+	}
+	const char *p = value + strlen("bytes=");
+	int specs = 0;
+	int count = 0;
+	for (;;) {
+		p += strspn(p, " \t,");
+		if (*p == '\0') {
+			break;
+		}
+		long long first = -1;
+		long long last = -1;
+		char *end;
+		errno = 0;
+		if (isdigit((unsigned char) *p)) {
+			first = strtoll(p, &end, 10);
+			p = end;
+		}
+		if (*p++ != '-') {
+			return -1;
+		}
+		if (isdigit((unsigned char) *p)) {
+			last = strtoll(p, &end, 10);
+			p = end;
+		}
+		p += strspn(p, " \t");
+		if (errno == ERANGE || (first == -1 && last == -1) || (last != -1 && last < first) ||
+			(*p != ',' && *p != '\0')) {
+			return -1;
+		}
+		++specs;
+
+		ByteRange range;
+		if (first == -1) {
+			// Suffix: the last bytes of the file
+			if (last == 0 || size == 0) {
+				continue;
 			}
+			range.first = last < size ? size - last : 0;
+			range.last = size - 1;
+		} else {
+			if (first >= size) {
+				continue;
+			}
+			range.first = first;
+			range.last = last == -1 || last >= size ? size - 1 : last;
+		}
+		if (count == RANGES_MAX) {
+			return -1;
+		}
+		ranges[count++] = range;
+	}
+	return specs > 0 ? count : -1;
+}
+
+// Whether a Range request is for the current version of the file: If-Range is
+// absent, or carries its entity tag or modification time
+static bool httpserver_if_range_matches(String **header, const Validators *validators, const struct stat *stats) {
+	const char *value = httpserver_header_value(header, "If-Range");
+	if (!value) {
+		return true;
+	}
+	if (*value == '"') {
+		return strcmp(value, validators->etag) == 0;
+	}
+	time_t date;
+	return httpserver_parse_date(value, &date) && date == stats->st_mtime;
+}
+
+// Send part of a file without copying it through user space. Large parts go
+// through io_uring if enabled. Returns 0 when everything was sent, -1 otherwise.
+static int httpserver_send_file_range(int socket, int file, off_t offset, size_t count) {
+	Uring *ring = count >= URING_SEND_FILE_MIN ? httpserver_thread_ring() : NULL;
+	if (ring) {
+		ssize_t sent = uring_send_file(ring, socket, file, offset, count);
+		if (sent < 0) {
+			return -1;
+		}
+		offset += sent;
+		count -= sent;
+	}
+	return count == 0 || socket_sendfile(socket, file, offset, count) == (ssize_t) count ? 0 : -1;
+}
+
+static void httpserver_reply_range_not_satisfiable(int fd, off_t file_size) {
+	const char *status = "416 Range Not Satisfiable";
+	char fields[64];
+	snprintf(fields, sizeof fields, "Content-Range: bytes */%lld" CRLF, (long long) file_size);
+	char header[HEADER_MAX];
+	struct iovec reply[] = {
+		{ header, httpserver_format_header_with(header, sizeof header, status, TEXT_PLAIN, fields, strlen(status), false) },
+		{ (char *) status, strlen(status) },
+	};
+	socket_writev(fd, reply, 2);
+}
+
+// Send several ranges of a file as a multipart/byteranges body
+static void httpserver_reply_byteranges(int fd, int file, off_t file_size, const ByteRange *ranges, int count,
+		const Validators *validators, const char *content_type) {
+	static const char closing[] = CRLF "--" BYTERANGES_BOUNDARY "--" CRLF;
+	char part_headers[RANGES_MAX][192];
+	size_t part_sizes[RANGES_MAX];
+	size_t content_length = strlen(closing);
+	for (int i = 0; i < count; ++i) {
+		part_sizes[i] = snprintf(part_headers[i], sizeof part_headers[i],
+			CRLF "--" BYTERANGES_BOUNDARY CRLF
+			"Content-Type: %s" CRLF
+			"Content-Range: bytes %lld-%lld/%lld" CRLF CRLF,
+			content_type, (long long) ranges[i].first, (long long) ranges[i].last, (long long) file_size);
+		content_length += part_sizes[i] + (ranges[i].last - ranges[i].first + 1);
+	}
+
+	// Hold each header back so it leaves together with the data following it
+	char header[HEADER_MAX];
+	size_t header_size = httpserver_format_header_with(header, sizeof header, "206 Partial Content",
+		"multipart/byteranges; boundary=" BYTERANGES_BOUNDARY, validators->fields, content_length, false);
+	if (socket_send(fd, header, header_size, MSG_MORE) < 0) {
+		return;
+	}
+	for (int i = 0; i < count; ++i) {
+		if (socket_send(fd, part_headers[i], part_sizes[i], MSG_MORE) < 0 ||
+			httpserver_send_file_range(fd, file, ranges[i].first, ranges[i].last - ranges[i].first + 1) == -1) {
+			return;
 		}
 	}
-	if (!s) {
+	socket_write(fd, closing, strlen(closing));
+}
+
+// Send a small file from its pre-rendered response, rendering and storing
+// one first if there is none. Returns 0 if the file was sent, -1 if it should
+// be sent the usual way.
+static int httpserver_reply_cached_file(int fd, FileCacheEntry *file, const Validators *validators,
+		const char *content_type) {
+	const char *response;
+	size_t size;
+	if (filecache_response(file, &response, &size)) {
+		metrics_count(METRICS_RESPONSE_CACHE_HIT);
+		metrics_status(200);
+		socket_write(fd, response, size);
+		return 0;
+	}
+	metrics_count(METRICS_RESPONSE_CACHE_MISS);
+
+	size_t file_size = file->stats.st_size;
+	char fields[VALIDATORS_MAX + 32];
+	snprintf(fields, sizeof fields, "Accept-Ranges: bytes" CRLF "%s", validators->fields);
+	char header[HEADER_MAX];
+	size_t header_size = httpserver_format_header_with(header, sizeof header, "200 OK",
+		content_type, fields, file_size, false);
+	char *rendered = malloc(header_size + file_size);
+	if (!rendered) {
+		return -1;
+	}
+	memcpy(rendered, header, header_size);
+	// The file may have changed since it was opened; send it the usual way then
+	if (pread(file->fd, rendered + header_size, file_size, 0) != (ssize_t) file_size) {
+		free(rendered);
+		return -1;
+	}
+	socket_write(fd, rendered, header_size + file_size);
+	if (!filecache_set_response(file, rendered, header_size + file_size)) {
+		free(rendered);
+	}
+	return 0;
+}
+
+/**
+ * Send a file, or the ranges of it the request asks for. File contents sent
+ * from the file share the bulk bandwidth; pre-rendered responses do not.
+ * @param header Request header split to lines, for Range and If-Range.
+ * @param precompressed Whether file is a precompressed copy of the one asked for.
+ * @param flow Pacing of the transfer.
+ */
+static void httpserver_reply_get_file(int *network_socket, FileCacheEntry *file, String **header,
+		const Validators *validators, const char *content_type, bool precompressed, PacerFlow *flow) {
+	const struct stat *stats = &file->stats;
+	off_t file_size = stats->st_size;
+	ByteRange ranges[RANGES_MAX];
+	int range_count = -1;
+	const char *range = httpserver_header_value(header, "Range");
+	if (range && httpserver_if_range_matches(header, validators, stats)) {
+		range_count = httpserver_parse_ranges(range, file_size, ranges);
+	}
+
+	if (range_count == 0) {
+		httpserver_reply_range_not_satisfiable(*network_socket, file_size);
+		return;
+	}
+	if (range_count > 1) {
+		pacer_join(&bulk_pacer, flow, *network_socket, get_weight, true);
+		httpserver_reply_byteranges(*network_socket, file->fd, file_size, ranges, range_count, validators, content_type);
+		pacer_leave(&bulk_pacer, flow);
+		return;
+	}
+	// The response kept with a file is of the file itself
+	if (range_count == -1 && !precompressed && (size_t) file_size <= small_file_max &&
+		httpserver_reply_cached_file(*network_socket, file, validators, content_type) == 0) {
+		return;
+	}
+
+	// A single range or the whole file. The header is held back to leave with
+	// the first bytes of content.
+	char header_buffer[HEADER_MAX];
+	char fields[VALIDATORS_MAX + 96];
+	size_t header_size;
+	off_t offset = 0;
+	size_t count = file_size;
+	if (range_count == 1) {
+		snprintf(fields, sizeof fields, "Content-Range: bytes %lld-%lld/%lld" CRLF "%s",
+			(long long) ranges[0].first, (long long) ranges[0].last, (long long) file_size,
+			validators->fields);
+		offset = ranges[0].first;
+		count = ranges[0].last - ranges[0].first + 1;
+		header_size = httpserver_format_header_with(header_buffer, sizeof header_buffer,
+			"206 Partial Content", content_type, fields, count, false);
+	} else {
+		snprintf(fields, sizeof fields, "Accept-Ranges: bytes" CRLF "%s", validators->fields);
+		header_size = httpserver_format_header_with(header_buffer, sizeof header_buffer,
+			"200 OK", content_type, fields, count, false);
+	}
+	pacer_join(&bulk_pacer, flow, *network_socket, get_weight, true);
+	// Nothing helpful to do on failure after the header is on the wire
+	if (socket_send(*network_socket, header_buffer, header_size, count > 0 ? MSG_MORE : 0) >= 0) {
+		httpserver_send_file_range(*network_socket, file->fd, offset, count);
+	}
+	pacer_leave(&bulk_pacer, flow);
+}
+
+#define LISTING_BATCH_SIZE 65536 // Bytes of directory entries read at once
+
+// Entry returned by getdents64, see man 2 getdents
+struct linux_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+// Send a piece of a response body of unknown length. Size 0 ends the body.
+static int httpserver_write_body_part(int fd, const char *data, size_t size, bool chunked) {
+	if (chunked) {
+		return chunked_write(fd, data, size);
+	}
+	return size == 0 || socket_write(fd, data, size) >= 0 ? 0 : -1;
+}
+
+// A rendered listing being collected for the file cache. The copies of all
+// listings being collected share one budget, so concurrent listings cannot
+// together hold more than the response cache could keep.
+typedef struct {
+	char *data; // NULL once the listing is too large to keep
+	size_t size;
+	size_t capacity; // Bytes taken from the budget
+} ListingCopy;
+
+// Take bytes from the budget of listing copies
+static bool httpserver_listing_copy_reserve(size_t size) {
+	if (__atomic_add_fetch(&listing_copies_size, size, __ATOMIC_RELAXED) <= listing_cache_max) {
+		return true;
+	}
+	__atomic_sub_fetch(&listing_copies_size, size, __ATOMIC_RELAXED);
+	return false;
+}
+
+// Give up a copy and return its bytes to the budget
+static void httpserver_listing_copy_drop(ListingCopy *copy) {
+	free(copy->data);
+	copy->data = NULL;
+	__atomic_sub_fetch(&listing_copies_size, copy->capacity, __ATOMIC_RELAXED);
+	copy->capacity = 0;
+}
+
+static void httpserver_listing_copy_init(ListingCopy *copy, bool wanted) {
+	copy->data = NULL;
+	copy->size = 0;
+	copy->capacity = 0;
+	if (wanted && httpserver_listing_copy_reserve(LISTING_BATCH_SIZE)) {
+		copy->capacity = LISTING_BATCH_SIZE;
+		if (!(copy->data = malloc(copy->capacity))) {
+			httpserver_listing_copy_drop(copy);
+		}
+	}
+}
+
+static void httpserver_listing_copy_append(ListingCopy *copy, const char *data, size_t size) {
+	if (!copy->data) {
+		return;
+	}
+	if (copy->size + size > copy->capacity) {
+		size_t capacity = copy->capacity * 2 >= copy->size + size ? copy->capacity * 2 : copy->size + size;
+		if (!httpserver_listing_copy_reserve(capacity - copy->capacity)) {
+			httpserver_listing_copy_drop(copy);
+			return;
+		}
+		char *grown = realloc(copy->data, capacity);
+		if (!grown) {
+			__atomic_sub_fetch(&listing_copies_size, capacity - copy->capacity, __ATOMIC_RELAXED);
+			httpserver_listing_copy_drop(copy);
+			return;
+		}
+		copy->data = grown;
+		copy->capacity = capacity;
+	}
+	memcpy(copy->data + copy->size, data, size);
+	copy->size += size;
+}
+
+// Store a complete listing with a Content-Length as the response of a cached directory
+static void httpserver_listing_copy_store(ListingCopy *copy, FileCacheEntry *directory,
+		const Validators *validators) {
+	char header[HEADER_MAX];
+	size_t header_size = httpserver_format_header_with(header, sizeof header, "200 OK",
+		TEXT_PLAIN, validators->fields, copy->size, false);
+	char *response = copy->data ? realloc(copy->data, header_size + copy->size) : NULL;
+	if (!response) {
+		httpserver_listing_copy_drop(copy);
+		return;
+	}
+	copy->data = NULL;
+	memmove(response + header_size, response, copy->size);
+	memcpy(response, header, header_size);
+	if (!filecache_set_response(directory, response, header_size + copy->size)) {
+		free(response);
+	}
+	// The file cache accounts for the response from here on
+	httpserver_listing_copy_drop(copy);
+}
+
+/**
+ * Print directory contents, one name per line. Entries are read in large
+ * getdents64 batches. A listing of one batch is sent in one write with a
+ * Content-Length; a longer one is streamed a batch at a time with bounded
+ * memory, chunked for HTTP/1.1 clients, sharing the bulk bandwidth. A cached
+ * listing is sent as is, and a listing made for a cached directory is kept for
+ * the next request.
+ */
+static void httpserver_reply_get_directory(int network_socket, FileCacheEntry *directory, bool chunked,
+		const Validators *validators, PacerFlow *flow) {
+	const char *response;
+	size_t response_size;
+	if (filecache_response(directory, &response, &response_size)) {
+		metrics_count(METRICS_LISTING_CACHE_HIT);
+		metrics_status(200);
+		socket_write(network_socket, response, response_size);
+		return;
+	}
+	metrics_count(METRICS_LISTING_CACHE_MISS);
+
+	// The cached descriptor is shared; read the entries through one of our own
+	int fd = openat(directory->fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	char *batch = malloc(LISTING_BATCH_SIZE);
+	char *buffer = malloc(LISTING_BATCH_SIZE);
+	if (fd == -1 || !batch || !buffer) {
 		VERBOSE("Error allocating memory");
+		httpserver_reply_internal_server_error(network_socket);
+		socket_close(&fd);
+		free(batch);
+		free(buffer);
+		return;
+	}
+
+	ListingCopy copy;
+	httpserver_listing_copy_init(&copy, directory->cached && listing_cache_max > 0);
+	char header[HEADER_MAX];
+	size_t used = 0;
+	bool streaming = false;
+	bool failed = false;
+	for (;;) {
+		ssize_t batch_size = syscall(SYS_getdents64, fd, batch, LISTING_BATCH_SIZE);
+		if (batch_size == -1 && errno == EINTR) {
+			continue;
+		}
+		if (batch_size <= 0) {
+			failed = batch_size == -1;
+			break;
+		}
+
+		// A batch renders to fewer bytes than it takes, so emptying the buffer makes room
+		if (used + batch_size > LISTING_BATCH_SIZE) {
+			if (!streaming) {
+				size_t header_size = httpserver_format_header_with(header, sizeof header, "200 OK",
+					TEXT_PLAIN, validators->fields, chunked ? BODY_CHUNKED : BODY_UNTIL_CLOSE, false);
+				pacer_join(&bulk_pacer, flow, network_socket, get_weight, true);
+				failed = socket_write(network_socket, header, header_size) < 0;
+				streaming = true;
+			}
+			failed = failed || httpserver_write_body_part(network_socket, buffer, used, chunked) == -1;
+			httpserver_listing_copy_append(&copy, buffer, used);
+			used = 0;
+			if (failed) {
+				break;
+			}
+		}
+		for (ssize_t offset = 0; offset < batch_size; ) {
+			const struct linux_dirent64 *entry = (const struct linux_dirent64 *) (batch + offset);
+			size_t length = strlen(entry->d_name);
+			memcpy(buffer + used, entry->d_name, length);
+			memcpy(buffer + used + length, CRLF, strlen(CRLF));
+			used += length + strlen(CRLF);
+			offset += entry->d_reclen;
+		}
+	}
+	socket_close(&fd);
+	free(batch);
+
+	if (failed) {
+		VERBOSE("[%d] Could not list directory: %s", network_socket, strerror(errno));
+		if (streaming) {
+			pacer_leave(&bulk_pacer, flow);
+		} else {
+			httpserver_reply_internal_server_error(network_socket);
+		}
+		httpserver_listing_copy_drop(&copy);
+		free(buffer);
+		return;
+	}
+	httpserver_listing_copy_append(&copy, buffer, used);
+	if (!streaming) {
+		struct iovec reply[] = {
+			{ header, httpserver_format_header_with(header, sizeof header, "200 OK",
+				TEXT_PLAIN, validators->fields, used, false) },
+			{ buffer, used },
+		};
+		socket_writev(network_socket, reply, 2);
+	} else {
+		if (used == 0 || httpserver_write_body_part(network_socket, buffer, used, chunked) == 0) {
+			// End the body
+			httpserver_write_body_part(network_socket, NULL, 0, chunked);
+		}
+		pacer_leave(&bulk_pacer, flow);
+	}
+	free(buffer);
+	if (copy.data) {
+		httpserver_listing_copy_store(&copy, directory, validators);
+	}
+}
+
+// Quality from 0 to 1000 a client gives a content coding in Accept-Encoding
+static int httpserver_coding_quality(const char *accept, const char *coding) {
+	int wildcard = 0;
+	for (const char *p = accept; *p; ) {
+		p += strspn(p, " \t,");
+		const char *name = p;
+		size_t length = strcspn(p, " \t,;");
+		p += length;
+		int quality = 1000;
+		while (*p && *p != ',') {
+			p += strspn(p, " \t;");
+			if ((*p == 'q' || *p == 'Q') && p[1] == '=') {
+				double value = strtod(p + 2, NULL);
+				quality = value <= 0 ? 0 : value >= 1 ? 1000 : (int) (value * 1000 + 0.5);
+			}
+			p += strcspn(p, ";,");
+		}
+		if (length == strlen(coding) && strncasecmp(name, coding, length) == 0) {
+			return quality;
+		}
+		if (length == 1 && *name == '*') {
+			wildcard = quality;
+		}
+	}
+	return wildcard;
+}
+
+// Open the fresh precompressed copy of a file the client likes best, NULL if
+// there is none. Missing and stale copies are queued to be made.
+static FileCacheEntry *httpserver_open_sidecar(String **header, const char *path, const FileCacheEntry *file,
+		SidecarEncoding *encoding) {
+	const char *accept = httpserver_header_value(header, "Accept-Encoding");
+	if (!accept) {
+		return NULL;
+	}
+	// Acceptable codings by quality, in order of preference on ties
+	SidecarEncoding order[SIDECAR_ENCODING_COUNT];
+	int quality[SIDECAR_ENCODING_COUNT];
+	int count = 0;
+	for (int e = 0; e < SIDECAR_ENCODING_COUNT; ++e) {
+		quality[e] = httpserver_coding_quality(accept, sidecar_coding(e));
+		if (quality[e] == 0) {
+			continue;
+		}
+		int i = count++;
+		for (; i > 0 && quality[order[i - 1]] < quality[e]; --i) {
+			order[i] = order[i - 1];
+		}
+		order[i] = e;
+	}
+
+	const struct timespec *modified = &file->stats.st_mtim;
+	for (int i = 0; i < count; ++i) {
+		char sidecar_path[PATH_MAX];
+		if (snprintf(sidecar_path, sizeof sidecar_path, "%s%s", path, sidecar_suffix(order[i])) >=
+			(int) sizeof sidecar_path) {
+			continue;
+		}
+		FileCacheEntry *sidecar = filecache_open(sidecar_path);
+		if (sidecar && S_ISREG(sidecar->stats.st_mode) &&
+			(sidecar->stats.st_mtim.tv_sec > modified->tv_sec ||
+			(sidecar->stats.st_mtim.tv_sec == modified->tv_sec && sidecar->stats.st_mtim.tv_nsec >= modified->tv_nsec))) {
+			*encoding = order[i];
+			return sidecar;
+		}
+		if (sidecar) {
+			filecache_release(sidecar);
+		}
+		sidecar_generate(path, order[i], &file->stats);
+	}
+	return NULL;
+}
+
+// Send the metrics, led by gauges of the connections each class holds
+static void httpserver_reply_metrics(int fd) {
+	char *text = NULL;
+	size_t size = 0;
+	FILE *out = open_memstream(&text, &size);
+	if (!out) {
+		httpserver_reply_internal_server_error(fd);
+		return;
+	}
+	fputs("# HELP httpdnsd_connections Connections queued or being served by class\n"
+		"# TYPE httpdnsd_connections gauge\n", out);
+	for (int class = 0; class < ADMISSION_CLASS_COUNT; ++class) {
+		fprintf(out, "httpdnsd_connections{class=\"%s\"} %u\n", class_names[class],
+			__atomic_load_n(&class_connections[class], __ATOMIC_RELAXED));
+	}
+	fputs("# HELP httpdnsd_queued Connections waiting for a worker by class\n"
+		"# TYPE httpdnsd_queued gauge\n", out);
+	for (int class = 0; class < ADMISSION_CLASS_COUNT; ++class) {
+		fprintf(out, "httpdnsd_queued{class=\"%s\"} %zu\n", class_names[class], workqueue_length(work_queues[class]));
+	}
+	fputs("# HELP httpdnsd_pending Connections whose request header is still arriving\n"
+		"# TYPE httpdnsd_pending gauge\n", out);
+	fprintf(out, "httpdnsd_pending %u\n", __atomic_load_n(&pending_connections, __ATOMIC_RELAXED));
+	int rendered = metrics_render(out);
+	if (fclose(out) != 0 || rendered == -1) {
+		free(text);
+		httpserver_reply_internal_server_error(fd);
+		return;
+	}
+
+	char header[HEADER_MAX];
+	struct iovec reply[] = {
+		{ header, httpserver_format_header_with(header, sizeof header, "200 OK",
+			"text/plain; version=0.0.4", "", size, false) },
+		{ text, size },
+	};
+	socket_writev(fd, reply, 2);
+	free(text);
+}
+
+/**
+ * Handle a GET request.
+ * @param header Request header split to lines.
+ * @param chunked Whether the client understands chunked transfer coding.
+ * @param flow Pacing of the transfer, joined only for bodies sent from files.
+ */
+static void httpserver_handle_get(int *fd, const char *path, String **header, bool chunked, PacerFlow *flow) {
+	FileCacheEntry *file = NULL;
+
+	// This allows getting directory contents of document root.
+	if (strcmp(path, "/") == 0) {
+		path = "/.";
+	}
+	if (strlen(path) > 1 && (file = filecache_open(path + 1))) {
+		// Large enough text is sent precompressed to clients that accept it
+		const MimeType *type = mime_type(path);
+		bool negotiable = S_ISREG(file->stats.st_mode) && type->compressible &&
+			(size_t) file->stats.st_size >= sidecar_min;
+		SidecarEncoding encoding;
+		FileCacheEntry *sidecar = negotiable ? httpserver_open_sidecar(header, path + 1, file, &encoding) : NULL;
+		FileCacheEntry *sent = sidecar ? sidecar : file;
+		char extra[64] = "";
+		if (sidecar) {
+			snprintf(extra, sizeof extra, "Content-Encoding: %s" CRLF "Vary: Accept-Encoding" CRLF,
+				sidecar_coding(encoding));
+		} else if (negotiable) {
+			snprintf(extra, sizeof extra, "Vary: Accept-Encoding" CRLF);
+		}
+
+		Validators validators;
+		httpserver_validators(&validators, &sent->stats, extra);
+		bool servable = S_ISREG(file->stats.st_mode) || S_ISDIR(file->stats.st_mode);
+		if (servable && httpserver_not_modified(header, &validators, &sent->stats)) {
+			// The client's copy is current
+			httpserver_reply_not_modified(*fd, &validators);
+		} else if (S_ISREG(file->stats.st_mode)) {
+			// Serve file contents
+			httpserver_reply_get_file(fd, sent, header, &validators, type->type, sidecar != NULL, flow);
+		} else if (S_ISDIR(file->stats.st_mode)) {
+			// Serve directory listing
+			httpserver_reply_get_directory(*fd, file, chunked, &validators, flow);
+		} else {
+			// Other than regular files or directories are not served
+			httpserver_reply_forbidden(*fd);
+		}
+		if (sidecar) {
+			filecache_release(sidecar);
+		}
+		filecache_release(file);
+	} else {
+		httpserver_reply_not_found(*fd);
+	}
+}
+
+/**
+ * Receive a PUT body sent with chunked transfer coding into a file. Replies to the
+ * client only on failure.
+ * @return 0 if the whole body was written, -1 on failure.
+ */
+static int httpserver_put_chunked_body(int *fd, int local_file, char *body, size_t body_size, PacerFlow *flow) {
+	ChunkedDecoder decoder;
+	chunked_decoder_init(&decoder);
+
+	char buf[8192];
+	char *data = body;
+	ssize_t size = body_size;
+	for (;;) {
+		ssize_t decoded = chunked_decode(&decoder, data, size);
+		if (decoded == -1) {
+			httpserver_reply_bad_request(*fd);
+			return -1;
+		}
+		if (decoded > 0 && socket_write(local_file, data, decoded) == -1) {
+			httpserver_reply_internal_server_error(*fd);
+			return -1;
+		}
+		if (decoder.done) {
+			return 0;
+		}
+
+		data = buf;
+		size = socket_read(*fd, buf, pacer_quantum(&bulk_pacer, flow, sizeof buf));
+		if (size <= 0) {
+			// Connection ended before the last chunk
+			httpserver_reply_bad_request(*fd);
+			return -1;
+		}
+		pacer_received(&bulk_pacer, flow, size);
+	}
+}
+
+// Upload target and the file its contents are written to before it is put in place
+typedef struct {
+	const char *path;
+	char directory[PATH_MAX];
+	const char *name; // Last component of path
+	char temp_path[PATH_MAX]; // Named temporary file, empty if the file is anonymous
+	int fd;
+} Upload;
+
+static unsigned upload_counter = 0; // Makes temporary names unique within the process
+
+/**
+ * Create the file an upload is written to: an anonymous O_TMPFILE in the target's
+ * directory, or a hidden temporary file there if the filesystem has no O_TMPFILE.
+ * @return 0 on success, -1 on failure (with errno set).
+ */
+static int httpserver_upload_open(Upload *upload, const char *path) {
+	upload->path = path;
+	upload->temp_path[0] = '\0';
+	const char *slash = strrchr(path, '/');
+	upload->name = slash ? slash + 1 : path;
+	int length = slash ? slash - path : 1;
+	if (length == 0 || length >= (int) sizeof upload->directory) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	snprintf(upload->directory, sizeof upload->directory, "%.*s", length, slash ? path : ".");
+
+	upload->fd = open(upload->directory, O_TMPFILE | O_WRONLY | O_CLOEXEC, 0644);
+	if (upload->fd != -1 || (errno != EOPNOTSUPP && errno != EISDIR && errno != EINVAL)) {
+		return upload->fd == -1 ? -1 : 0;
+	}
+
+	int r = snprintf(upload->temp_path, sizeof upload->temp_path, "%s/.%s.XXXXXX", upload->directory, upload->name);
+	if (r < 0 || (size_t) r >= sizeof upload->temp_path) {
+		upload->temp_path[0] = '\0';
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	upload->fd = mkostemp(upload->temp_path, O_CLOEXEC);
+	if (upload->fd == -1) {
+		upload->temp_path[0] = '\0';
+		return -1;
+	}
+	fchmod(upload->fd, 0644);
+	return 0;
+}
+
+/**
+ * Put a completely written upload in place of the target with one rename, so
+ * readers see either the old file or the new one.
+ * @return 0 on success, -1 on failure.
+ */
+static int httpserver_upload_commit(Upload *upload) {
+	if (upload->temp_path[0] == '\0') {
+		// Give the anonymous file a temporary name first; linkat cannot replace a file
+		char fd_path[32];
+		snprintf(fd_path, sizeof fd_path, "/proc/self/fd/%d", upload->fd);
+		for (int tries = 0; tries < 8; ++tries) {
+			unsigned id = __atomic_fetch_add(&upload_counter, 1, __ATOMIC_RELAXED);
+			int r = snprintf(upload->temp_path, sizeof upload->temp_path, "%s/.%s.%ld.%u",
+				upload->directory, upload->name, (long) getpid(), id);
+			if (r < 0 || (size_t) r >= sizeof upload->temp_path) {
+				break;
+			}
+			if (linkat(AT_FDCWD, fd_path, AT_FDCWD, upload->temp_path, AT_SYMLINK_FOLLOW) == 0) {
+				break;
+			}
+			upload->temp_path[0] = '\0';
+			if (errno != EEXIST) {
+				break;
+			}
+		}
+		if (upload->temp_path[0] == '\0') {
+			return -1;
+		}
 	}
-	return s;
-}
-
-static inline String *httpserver_get_directory_contents(int *directory) {
-	String *s = NULL;
-	DIR *dir = fdopendir(*directory);
-	*directory = -1; // DIR *dir takes ownership of the file descriptor
-	if (dir) {
-		s = httpserver_get_directory_contents_dir(dir);
+	if (rename(upload->temp_path, upload->path) == -1) {
+		return -1;
 	}
-	closedir(dir);
-
-	return s;
+	upload->temp_path[0] = '\0';
+	return 0;
 }
 
-// Print directory contents
-static void httpserver_reply_get_directory(int *network_socket, int *directory) {
-
-	String *directory_contents = httpserver_get_directory_contents(directory);
-	if (directory_contents) {
-		char content_length[16];
-		snprintf(content_length, sizeof(content_length), "%zu", directory_contents->size);
-
-		String *reply = string_new("");
-		string_append_c(reply, "HTTP/1.1 200 OK" CRLF);
-		string_append_c(reply, "Iam: " I_AM CRLF);
-		string_append_c(reply, "Content-Type: text/plain" CRLF);
-		string_append_c(reply, "Content-Length: ");
-		string_append_c(reply, content_length);
-		string_append_c(reply, CRLF);
-		string_append_c(reply, "Connection: close" CRLF CRLF);
-		string_append(reply, directory_contents);
-		socket_write(*network_socket, reply->c_str, reply->size);
-		string_delete(reply);
-	}
-	else {
-		httpserver_reply_internal_server_error(*network_socket);
+/**
+ * Release an upload. A file that was not committed is removed.
+ */
+static void httpserver_upload_close(Upload *upload) {
+	if (upload->temp_path[0] != '\0') {
+		unlink(upload->temp_path);
 	}
-	string_delete(directory_contents);
+	socket_close(&upload->fd);
 }
 
-static void httpserver_handle_get(int *fd, const char *path) {
-	int local_file = -1;
+#define PUT_PIPE_SIZE 1048576 // Most bytes moved per splice round
 
-	// This allows getting directory contents of document root.
-	if (strcmp(path, "/") == 0) {
-		path = "/.";
+/**
+ * Receive a PUT body into a file. Replies to the client only on failure.
+ * @return 0 if the whole body was written, -1 on failure.
+ */
+static int httpserver_put_body(int *fd, int local_file, size_t content_length,
+		const char *body, size_t body_size, PacerFlow *flow) {
+	// Write the part of the body that arrived with the header
+	if (body_size > content_length) {
+		body_size = content_length;
 	}
-	if (strlen(path) > 1 && (local_file = open(path + 1, O_RDONLY)) != -1) {
-		if (is_regular_file(local_file)) {
-			// Serve file contents
-			httpserver_reply_get_file(fd, &local_file);
-		} else if (is_directory(local_file)) {
-			// Serve directory listing
-			httpserver_reply_get_directory(fd, &local_file);
-		} else {
-			// Other than regular files or directories are not served
-			httpserver_reply_forbidden(*fd);
+	if (body_size > 0) {
+		if (socket_write(local_file, body, body_size) == -1) {
+			httpserver_reply_internal_server_error(*fd);
+			return -1;
 		}
-	} else {
-		httpserver_reply_not_found(*fd);
+		content_length -= body_size;
 	}
 
-	socket_close(&local_file);
-}
-
-static void httpserver_reply_put(int *fd, int local_file, size_t content_length, String *header) {
-	ssize_t r = -1;
-
-	// Write initial header
-	if (header) {
-		r = socket_write(local_file, header->c_str, header->size);
-		if (r == -1) {
-			httpserver_reply_internal_server_error(*fd);
-			return;
+	// Move the rest from the socket to the file without copying it through
+	// user space. If splicing is not supported, fall back to the copy loop.
+	int pipe_fds[2] = { -1, -1 };
+	if (content_length > 0 && pipe2(pipe_fds, O_CLOEXEC) == 0) {
+		fcntl(pipe_fds[1], F_SETPIPE_SZ, PUT_PIPE_SIZE);
+		bool spliced = false;
+		while (content_length > 0) {
+			ssize_t moved = socket_splice(*fd, pipe_fds, local_file,
+				pacer_quantum(&bulk_pacer, flow, content_length));
+			if (moved > 0) {
+				pacer_received(&bulk_pacer, flow, moved);
+				content_length -= moved;
+				spliced = true;
+				continue;
+			}
+			if (moved == -1 && errno == EINVAL && !spliced) {
+				break;
+			}
+			socket_close(&pipe_fds[0]);
+			socket_close(&pipe_fds[1]);
+			if (moved == 0) {
+				// Could not read while content still remaining -- bad request
+				httpserver_reply_bad_request(*fd);
+			} else {
+				httpserver_reply_internal_server_error(*fd);
+			}
+			return -1;
 		}
-		content_length -= header->size;
+		socket_close(&pipe_fds[0]);
+		socket_close(&pipe_fds[1]);
 	}
 
 	// Loop read and write
 	while (content_length > 0) {
 		char buf[8192];
 		ssize_t bytes_read;
-		bytes_read = socket_read(*fd, buf, sizeof(buf));
+		bytes_read = socket_read(*fd, buf, pacer_quantum(&bulk_pacer, flow, sizeof(buf)));
 		if (bytes_read > 0) {
+			pacer_received(&bulk_pacer, flow, bytes_read);
 			content_length -= bytes_read;
 			while (bytes_read > 0) {
 				ssize_t bytes_written = socket_write(local_file, buf, bytes_read);
 				if (bytes_written == -1) {
 					// Could not write to disk -- internal error
 					httpserver_reply_internal_server_error(*fd);
-					return;
+					return -1;
 				}
 				bytes_read -= bytes_written;
 			}
@@ -266,21 +1267,28 @@ static void httpserver_reply_put(int *fd, int local_file, size_t content_length,
 		else {
 			// Could not read while content still remaining -- bad request
 			httpserver_reply_bad_request(*fd);
-			return;
+			return -1;
 		}
 	}
-	httpserver_reply_full(*fd, "201 Created");
+	return 0;
 }
 
-static void httpserver_handle_put(int *fd, const char *path, String **header) {
+/**
+ * Handle a PUT request.
+ * @param header Request header split to lines.
+ * @param body Start of the body, received together with the header.
+ * @param body_size Number of bytes at body.
+ */
+static void httpserver_handle_put(int *fd, const char *path, String **header,
+		char *body, size_t body_size, PacerFlow *flow) {
 	// Find content length and allocate a new file with enough space.
 	ssize_t content_length = 0;
+	bool chunked = false;
 	bool header_ok = false;
 	bool expect_100 = false;
 	++header; // Skip the first HTTP action line
 	while (header[0]) {
 		if (strcmp(header[0]->c_str, "") == 0) {
-			++header; // header contains the payload start now.
 			header_ok = true;
 			break;
 		}
@@ -289,6 +1297,16 @@ static void httpserver_handle_put(int *fd, const char *path, String **header) {
 			String **line = string_split(header[0], ":");
 			sscanf(line[1]->c_str, "%zd", &content_length);
 			string_delete_array(line);
+		}
+		// A chunked body has no length up front; any other coding is not supported
+		if (strncasecmp(header[0]->c_str, "transfer-encoding:", strlen("transfer-encoding:")) == 0) {
+			const char *coding = header[0]->c_str + strlen("transfer-encoding:");
+			coding += strspn(coding, " \t");
+			if (strncasecmp(coding, "chunked", strlen("chunked")) == 0) {
+				chunked = true;
+			} else {
+				content_length = -1;
+			}
 		}
 			if (strncasecmp(header[0]->c_str, "Expect: 100-continue", strlen("Expect: 100-continue")) == 0) {
 			expect_100 = true;
@@ -298,14 +1316,49 @@ static void httpserver_handle_put(int *fd, const char *path, String **header) {
 	if (header_ok && content_length >= 0) {
 		if (expect_100) {
 			// Happily accept anything
-			httpserver_reply_header(*fd, "100 Continue");
+			httpserver_reply_static(*fd, REPLY_CONTINUE);
+		}
+		// Write to a new file next to the target, with all its space allocated up front
+		Upload upload;
+		if (httpserver_upload_open(&upload, path + 1) == -1) {
+			VERBOSE("[%d] Could not create upload file: %s", *fd, strerror(errno));
+			if (errno == ENOENT || errno == ENOTDIR) {
+				httpserver_reply_not_found(*fd);
+			} else if (errno == EACCES || errno == EPERM) {
+				httpserver_reply_forbidden(*fd);
+			} else {
+				httpserver_reply_internal_server_error(*fd);
+			}
+			return;
 		}
-		// Create a new file for writing
-		int local_file = open(path + 1, O_WRONLY | O_CREAT | O_TRUNC);
-		if (local_file != -1) {
-			httpserver_reply_put(fd, local_file, content_length, header[0]);
+		int r;
+		if (chunked) {
+			r = httpserver_put_chunked_body(fd, upload.fd, body, body_size, flow);
+		} else if (content_length > 0 && fallocate(upload.fd, 0, 0, content_length) == -1 &&
+			errno != EOPNOTSUPP && errno != ENOSYS) {
+			VERBOSE("[%d] Could not allocate %zd bytes: %s", *fd, content_length, strerror(errno));
+			httpserver_reply_internal_server_error(*fd);
+			r = -1;
+		} else {
+			r = httpserver_put_body(fd, upload.fd, content_length, body, body_size, flow);
+		}
+		if (r == 0) {
+			// The data has to be durable before the rename can replace the old file,
+			// and the rename before the upload is acknowledged. A group flushes both at once.
+			if (durability_sync_file(upload.fd) == -1) {
+				VERBOSE("[%d] Could not flush %s: %s", *fd, path, strerror(errno));
+				httpserver_reply_internal_server_error(*fd);
+			} else if (httpserver_upload_commit(&upload) == -1) {
+				VERBOSE("[%d] Could not replace %s: %s", *fd, path, strerror(errno));
+				httpserver_reply_internal_server_error(*fd);
+			} else if (durability_sync_rename(upload.fd, upload.directory) == -1) {
+				VERBOSE("[%d] Could not flush directory of %s: %s", *fd, path, strerror(errno));
+				httpserver_reply_internal_server_error(*fd);
+			} else {
+				httpserver_reply_static(*fd, REPLY_CREATED);
+			}
 		}
-		socket_close(&local_file);
+		httpserver_upload_close(&upload);
 	} else {
 		httpserver_reply_bad_request(*fd);
 	}
@@ -323,6 +1376,7 @@ static void httpserver_handle_dns_request(int *fd, int dns_type, const char *dns
 	}
 	int dns_socket = socket_udp_connect(dns_server, "53");
 	if (dns_socket != -1) {
+		uint64_t sent_us = metrics_now_us();
 		dns_send_query(dns_socket, dns_type, dns_name);
 		fd_set set;
 		FD_ZERO(&set);
@@ -330,8 +1384,10 @@ static void httpserver_handle_dns_request(int *fd, int dns_type, const char *dns
 		struct timeval timeout = { 2, 0 };
 		select(dns_socket + 1, &set, NULL, NULL, &timeout);
 		if FD_ISSET(dns_socket, &set) {
+			metrics_upstream(dns_server, metrics_now_us() - sent_us);
 			httpserver_reply_dns(fd, dns_socket);
 		} else {
+			metrics_count(METRICS_UPSTREAM_TIMEOUT);
 			httpserver_reply_not_found(*fd);
 		}
 	}
@@ -399,23 +1455,119 @@ static void httpserver_handle_post(int *fd, String **header) {
 }
 
 /**
- * Worker thread. Handles incoming connections. Assumes ownership of argument struct.
+ * Deadline expiry. Body and write deadlines only count inactivity: they are
+ * extended as long as the kernel has seen the transfer move since the last check.
+ * Otherwise the socket is shut down, which fails the worker's pending and future
+ * I/O on it; the worker then closes the connection as usual.
+ */
+static unsigned httpserver_deadline_expired(Timer *timer) {
+	Connection *connection = (Connection *) ((char *) timer - offsetof(Connection, deadline));
+	int phase = __atomic_load_n(&connection->phase, __ATOMIC_RELAXED);
+
+	if (phase == DEADLINE_BODY || phase == DEADLINE_WRITE) {
+		struct tcp_info info;
+		socklen_t length = sizeof(info);
+		memset(&info, 0, sizeof(info));
+		if (getsockopt(connection->client_fd, IPPROTO_TCP, TCP_INFO, &info, &length) == 0) {
+			// A body counts as moving while the worker reads it, even if the peer
+			// has already sent all of it into a large receive buffer
+			uint64_t progress = phase == DEADLINE_BODY ?
+				info.tcpi_bytes_received + __atomic_load_n(&connection->flow.received, __ATOMIC_RELAXED) :
+				info.tcpi_bytes_acked;
+			if (progress != connection->progress) {
+				connection->progress = progress;
+				return deadline_ms[phase];
+			}
+		}
+	}
+
+	VERBOSE("[%d] Deadline expired, closing connection", connection->client_fd);
+	shutdown(connection->client_fd, SHUT_RDWR);
+	return 0;
+}
+
+/**
+ * Enter a new phase and arm its deadline.
+ */
+static void httpserver_set_deadline(Connection *connection, DeadlinePhase phase) {
+	__atomic_store_n(&connection->phase, phase, __ATOMIC_RELAXED);
+	if (deadline_ms[phase]) {
+		timer_arm(&connection->deadline, deadline_ms[phase]);
+	} else {
+		timer_cancel(&connection->deadline);
+	}
+}
+
+/**
+ * Check whether a buffer holds a complete request header.
  */
-static void *httpserver_worker_thread(void *args) {
-	ThreadData *thread_data = args;
-
-	// Avoid wasting stack space on individual threads -- use the heap instead
-	const int buffer_size = 8192;
-	char *buffer = malloc(sizeof(*buffer) * buffer_size);
-	// Read in the header...
-	ssize_t bytes_read = socket_read(thread_data->client_fd, buffer, buffer_size);
-	// ... and split it to lines. The first line will be the
-	// request line; subsequent lines will be the rest of the header. The last field
-	// will hold the start of the payload; this needs to be sent to the file before
+static bool httpserver_header_complete(const char *buffer, size_t size) {
+	return memmem(buffer, size, CRLF CRLF, strlen(CRLF CRLF)) != NULL;
+}
+
+/**
+ * Execution class of a request: DNS lookups are served by the DNS pool.
+ */
+static AdmissionClass httpserver_request_class(const char *action, const char *path) {
+	return !strcmp(action, "POST") && !strcasecmp(path, "/dns-query") ? ADMISSION_DNS : ADMISSION_BULK;
+}
+
+/**
+ * Execution class of a received request, from its request line parsed the way
+ * the worker parses it.
+ */
+static AdmissionClass httpserver_classify(const char *data, size_t size) {
+	char request_line[640];
+	const char *end = memchr(data, '\n', size);
+	size_t length = end ? (size_t) (end - data) : size;
+	if (length >= sizeof request_line) {
+		length = sizeof request_line - 1;
+	}
+	memcpy(request_line, data, length);
+	request_line[length] = '\0';
+	char action[10] = "", path[512] = "";
+	sscanf(request_line, "%9s %511s", action, path);
+	return httpserver_request_class(action, path);
+}
+
+
+/**
+ * Worker. Serves a queued connection and frees it.
+ */
+static void httpserver_worker(WorkItem *work, uint64_t queued_us) {
+	Connection *connection = (Connection *) ((char *) work - offsetof(Connection, work));
+	uint64_t started_us = metrics_now_us();
+
+	// Render the peer address only when the message is actually logged
+	if (LOG_ENABLED(LOG_LEVEL_VERBOSE)) {
+		char peer_hostname[128];
+		peer_hostname[0] = '\0';
+		char peer_port[16];
+		peer_port[0] = '\0';
+		if (connection->peer_length == 0) {
+			connection->peer_length = sizeof(connection->peer);
+			getpeername(connection->client_fd, (struct sockaddr *) &connection->peer, &connection->peer_length);
+		}
+		getnameinfo((struct sockaddr *) &connection->peer, connection->peer_length,
+			peer_hostname, sizeof peer_hostname,
+			peer_port, sizeof peer_port,
+			NI_NUMERICHOST | NI_NUMERICSERV);
+		VERBOSE("[%d] Incoming connection from %s:%s", connection->client_fd, peer_hostname, peer_port);
+	}
+
+	// Replies go out under the write deadline unless the request needs another
+	httpserver_set_deadline(connection, DEADLINE_WRITE);
+
+	// The listener has received the header, or as much of it as fits the buffer.
+	// Split it to lines. The first line will be the request line; subsequent lines
+	// will be the rest of the header. The last field will hold the start of the
+	// payload; this needs to be sent to the file before
+	char *buffer = connection->buffer;
+	ssize_t bytes_read = connection->buffered;
 	String *incoming_data = string_new_from_range(buffer, buffer + bytes_read);
 	String **header = string_split(incoming_data, "\r\n");
 	if (!header) {
-		VERBOSE("[%d] Bad data: %d read from %d", thread_data->client_fd, bytes_read, thread_data->client_fd);
+		VERBOSE("[%d] Bad data: %zd read from %d", connection->client_fd, bytes_read, connection->client_fd);
 		perror("socket_read");
 	}
 	string_delete(incoming_data);
@@ -424,161 +1576,777 @@ static void *httpserver_worker_thread(void *args) {
 		size_t header_size = 0;
 		for (; header[header_size]; ++header_size);
 
-		if (header_size > 2) {
-			// At least request \r\n \r\n payload
-			char action[10], path[512], version[10];
-			sscanf(header[0]->c_str, "%9s %511s %9s", action, path, version);
-			VERBOSE("[%d] %s %s %s", thread_data->client_fd, action, path, version);
+		// At least request \r\n \r\n payload, and a request line of three words
+		char action[10] = "", path[512] = "", version[10] = "";
+		if (header_size > 2 && sscanf(header[0]->c_str, "%9s %511s %9s", action, path, version) == 3) {
+			VERBOSE("[%d] %s %s %s", connection->client_fd, action, path, version);
 
-			if (!strcmp(action, "GET")) {
-				httpserver_handle_get(&thread_data->client_fd, path);
+			AdmissionClass class = connection->class;
+			bool admitted = admission_admit(&admission, class, queued_us, workqueue_length(work_queues[class]));
+			if (!admitted) {
+				VERBOSE("[%d] Shedding load, queued for %u ms", connection->client_fd, (unsigned) (queued_us / 1000));
+				metrics_count(METRICS_SHED);
+				httpserver_reply_static(connection->client_fd, REPLY_SERVICE_UNAVAILABLE);
+			}
+			else if (!strcmp(action, "GET") && *metrics_path && !strcmp(path, metrics_path)) {
+				httpserver_reply_metrics(connection->client_fd);
+			}
+			else if (!strcmp(action, "GET")) {
+				httpserver_set_deadline(connection, DEADLINE_WRITE);
+				httpserver_handle_get(&connection->client_fd, path, header, !strcmp(version, "HTTP/1.1"),
+					&connection->flow);
 			}
 			else if (!strcmp(action, "PUT")) {
-				httpserver_handle_put(&thread_data->client_fd, path, header);
+				httpserver_set_deadline(connection, DEADLINE_BODY);
+				pacer_join(&bulk_pacer, &connection->flow, connection->client_fd, put_weight, false);
+				// The body starts after the blank line; the split lines lose its exact bytes
+				const char *end = memmem(buffer, bytes_read, CRLF CRLF, strlen(CRLF CRLF));
+				char *body = end ? (char *) end + strlen(CRLF CRLF) : buffer + bytes_read;
+				httpserver_handle_put(&connection->client_fd, path, header,
+					body, buffer + bytes_read - body, &connection->flow);
+				pacer_leave(&bulk_pacer, &connection->flow);
 			}
 			else if (!strcmp(action, "POST") &&
 				!strcasecmp(path, "/dns-query")) {
-				httpserver_handle_post(&thread_data->client_fd, header);
+				httpserver_set_deadline(connection, DEADLINE_WRITE);
+				httpserver_handle_post(&connection->client_fd, header);
 			}
 			else {
-				httpserver_reply_method_not_allowed(thread_data->client_fd);
+				httpserver_reply_method_not_allowed(connection->client_fd);
+			}
+			if (admitted) {
+				admission_done(&admission, class);
 			}
+			metrics_request(metrics_method(action));
 		}
 		else {
-			httpserver_reply_bad_request(thread_data->client_fd);
+			httpserver_reply_bad_request(connection->client_fd);
+			metrics_request(METRICS_METHOD_OTHER);
 		}
+
+		uint64_t done_us = metrics_now_us();
+		metrics_latency(METRICS_STAGE_HEADER, connection->reading_us);
+		metrics_latency(METRICS_STAGE_QUEUE, queued_us);
+		metrics_latency(METRICS_STAGE_RESPONSE, done_us - started_us);
+		metrics_latency(METRICS_STAGE_TOTAL, connection->reading_us + queued_us + done_us - started_us);
 	}
 	string_delete_array(header);
 
-	socket_close(&thread_data->client_fd);
+	// The deadline must not fire on a closed, possibly reused descriptor
+	timer_cancel(&connection->deadline);
+	__atomic_sub_fetch(&class_connections[connection->class], 1, __ATOMIC_RELAXED);
+	socket_close(&connection->client_fd);
 	free(buffer);
-	free(thread_data);
+	free(connection);
+}
 
-	return NULL;
+// Close and free a connection that never reached a worker
+static void httpserver_connection_drop(Connection *connection) {
+	timer_cancel(&connection->deadline);
+	socket_close(&connection->client_fd);
+	free(connection->buffer);
+	free(connection);
+}
+
+/**
+ * Queue a connection whose request header has arrived for a worker. The request
+ * line decides the class: DNS lookups go to the DNS pool, the rest to the bulk
+ * pool. Connections count against the limit of their class only from here, and
+ * a class over its limit gets a 503. The worker arms the deadlines of its own
+ * phases, and the time spent queued is measured from here.
+ */
+static void httpserver_dispatch_connection(Connection *connection) {
+	timer_cancel(&connection->deadline);
+	connection->reading_us = metrics_now_us() - connection->accepted_us;
+
+	AdmissionClass class = httpserver_classify(connection->buffer, connection->buffered);
+	// Take a place in the class in one step, so concurrent listeners cannot overshoot
+	if (__atomic_add_fetch(&class_connections[class], 1, __ATOMIC_RELAXED) > class_limit[class]) {
+		__atomic_sub_fetch(&class_connections[class], 1, __ATOMIC_RELAXED);
+		VERBOSE("[%d] Connection limit of %s class reached", connection->client_fd, class_names[class]);
+		metrics_count(METRICS_REJECTED);
+		httpserver_reply_static(connection->client_fd, REPLY_SERVICE_UNAVAILABLE);
+		httpserver_connection_drop(connection);
+		return;
+	}
+	connection->class = class;
+	workqueue_submit(work_queues[class], &connection->work, WORK_PRIORITY_NORMAL);
+}
+
+/**
+ * Receive what has arrived of a request header without blocking.
+ * @return 1 when the header is complete or fills the buffer, 0 to wait for more,
+ * -1 if the client closed the connection, it failed or its deadline expired.
+ */
+static int httpserver_receive_header(Connection *connection) {
+	while (!httpserver_header_complete(connection->buffer, connection->buffered) &&
+		connection->buffered < REQUEST_BUFFER_SIZE) {
+		ssize_t r = recv(connection->client_fd, connection->buffer + connection->buffered,
+			REQUEST_BUFFER_SIZE - connection->buffered, 0);
+		if (r > 0) {
+			if (connection->buffered == 0) {
+				httpserver_set_deadline(connection, DEADLINE_HEADER);
+			}
+			connection->buffered += r;
+		} else if (r == -1 && errno == EINTR) {
+			continue;
+		} else if (r == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return 0;
+		} else {
+			return -1;
+		}
+	}
+	return 1;
+}
+
+/**
+ * Take an incoming connection. Assumes ownership of the socket and the buffer.
+ * The connection is queued for a worker once its request header has arrived;
+ * until then it waits in the listener's pending set, bounded by the idle and
+ * header deadlines.
+ * @param listener Listener that accepted the connection
+ * @param connected_fd Non-blocking socket with an incoming connection. Ownership is assumed
+ * @param peer Address of the remote end, NULL if not known
+ * @param peer_length Size of the address
+ * @param buffer Start of the request if already received, or NULL. Ownership is
+ * assumed; a buffer must hold REQUEST_BUFFER_SIZE bytes
+ * @param buffered Number of bytes in buffer
+ */
+static void httpserver_handle_connection(Listener *listener, int connected_fd,
+		const struct sockaddr_storage *peer, socklen_t peer_length, char *buffer, ssize_t buffered) {
+	Connection *connection = malloc(sizeof(*connection));
+	if (!buffer) {
+		buffer = malloc(REQUEST_BUFFER_SIZE);
+		buffered = 0;
+	}
+	if (!connection || !buffer) {
+		socket_close(&connected_fd);
+		free(buffer);
+		free(connection);
+		return;
+	}
+	connection->client_fd = connected_fd;
+	connection->peer_length = 0;
+	if (peer) {
+		connection->peer = *peer;
+		connection->peer_length = peer_length;
+	}
+	connection->buffer = buffer;
+	connection->buffered = buffered;
+	timer_init(&connection->deadline, httpserver_deadline_expired);
+	connection->phase = DEADLINE_IDLE;
+	connection->progress = 0;
+	connection->flow.received = 0;
+	connection->accepted_us = metrics_now_us();
+	connection->reading_us = 0;
+	connection->work.function = httpserver_worker;
+	httpserver_set_deadline(connection, buffered > 0 ? DEADLINE_HEADER : DEADLINE_IDLE);
+
+	int received = httpserver_receive_header(connection);
+	if (received == 0) {
+		struct epoll_event event = { .events = EPOLLIN | EPOLLRDHUP, .data.ptr = connection };
+		if (epoll_ctl(listener->pending, EPOLL_CTL_ADD, connected_fd, &event) == 0) {
+			connection->pending_prev = NULL;
+			connection->pending_next = listener->pending_list;
+			if (listener->pending_list) {
+				listener->pending_list->pending_prev = connection;
+			}
+			listener->pending_list = connection;
+			__atomic_add_fetch(&pending_connections, 1, __ATOMIC_RELAXED);
+			return;
+		}
+		VERBOSE("[%d] Could not wait for the request: %s", connected_fd, strerror(errno));
+		received = -1;
+	}
+	if (received == 1) {
+		httpserver_dispatch_connection(connection);
+	} else {
+		httpserver_connection_drop(connection);
+	}
+}
+
+// Take a connection out of the pending list of its listener
+static void httpserver_pending_remove(Listener *listener, Connection *connection) {
+	if (connection->pending_prev) {
+		connection->pending_prev->pending_next = connection->pending_next;
+	} else {
+		listener->pending_list = connection->pending_next;
+	}
+	if (connection->pending_next) {
+		connection->pending_next->pending_prev = connection->pending_prev;
+	}
+	__atomic_sub_fetch(&pending_connections, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Receive on the pending connections that have become readable, and pass on
+ * those that are complete or gone.
+ */
+static void httpserver_receive_pending(Listener *listener) {
+	struct epoll_event events[PENDING_EVENTS];
+	int count;
+	do {
+		count = epoll_wait(listener->pending, events, PENDING_EVENTS, 0);
+		for (int i = 0; i < count; ++i) {
+			Connection *connection = events[i].data.ptr;
+			int received = httpserver_receive_header(connection);
+			if (received == 0) {
+				continue;
+			}
+			epoll_ctl(listener->pending, EPOLL_CTL_DEL, connection->client_fd, NULL);
+			httpserver_pending_remove(listener, connection);
+			if (received == 1) {
+				httpserver_dispatch_connection(connection);
+			} else {
+				httpserver_connection_drop(connection);
+			}
+		}
+	} while (count == PENDING_EVENTS);
+}
+
+/**
+ * Close the connections left in the pending set of a listener whose thread has
+ * stopped, and the set itself.
+ */
+static void httpserver_pending_close(Listener *listener) {
+	while (listener->pending_list) {
+		Connection *connection = listener->pending_list;
+		httpserver_pending_remove(listener, connection);
+		httpserver_connection_drop(connection);
+	}
+	socket_close(&listener->pending);
 }
 
 /**
- * Handle an incoming connection. Assumes ownership of the socket.
- * @param connected_fd Socket with an incoming connection. Ownership is assumed
+ * Accept all pending connections on a non-blocking listening socket.
+ * @return 0 when the accept queue is empty, -1 on an error other than EAGAIN.
  */
-static void httpserver_handle_connection(int connected_fd) {
-	ThreadData *thread_data = malloc(sizeof(*thread_data));
-	thread_data->client_fd = connected_fd;
-	if (0 != thread_create_detached(httpserver_worker_thread, thread_data)) {
-		VERBOSE("Could not spawn a worker thread");
+static int httpserver_accept_pending(Listener *listener) {
+	for (;;) {
+		struct sockaddr_storage peer;
+		socklen_t peer_length = sizeof(peer);
+		int incoming_socket = accept4(listener->listen_socket, (struct sockaddr *) &peer, &peer_length,
+			SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (incoming_socket != -1) {
+			httpserver_handle_connection(listener, incoming_socket, &peer, peer_length, NULL, 0);
+		}
+		else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			return 0;
+		}
+		else if (errno == EINTR || errno == ECONNABORTED) {
+			continue;
+		}
+		else {
+			VERBOSE("Error accepting connection: %s", strerror(errno));
+			return -1;
+		}
+	}
+}
+
+void httpserver_config_default(HttpServerConfig *config) {
+	config->port = NULL;
+	config->listeners = 1;
+	config->backlog = SOCKET_DEFAULT_BACKLOG;
+	config->incoming_cpu = false;
+	config->io_uring = false;
+	config->defer_accept = 0;
+	config->fastopen = 0;
+	config->nodelay = false;
+	config->send_buffer = 0;
+	config->receive_buffer = 0;
+	config->notsent_lowat = 0;
+	config->busy_poll = 0;
+	config->user_timeout = 0;
+	config->idle_timeout = HTTPSERVER_DEFAULT_IDLE_TIMEOUT;
+	config->header_timeout = HTTPSERVER_DEFAULT_HEADER_TIMEOUT;
+	config->body_timeout = HTTPSERVER_DEFAULT_BODY_TIMEOUT;
+	config->write_timeout = HTTPSERVER_DEFAULT_WRITE_TIMEOUT;
+	config->dns_workers = HTTPSERVER_DEFAULT_DNS_WORKERS;
+	config->bulk_workers = HTTPSERVER_DEFAULT_BULK_WORKERS;
+	config->dns_limit = HTTPSERVER_DEFAULT_DNS_LIMIT;
+	config->bulk_limit = HTTPSERVER_DEFAULT_BULK_LIMIT;
+	config->bulk_rate = 0;
+	config->get_weight = 1;
+	config->put_weight = 1;
+	config->durability = DURABILITY_NONE;
+	config->group_window = HTTPSERVER_DEFAULT_GROUP_WINDOW;
+	config->file_cache = HTTPSERVER_DEFAULT_FILE_CACHE;
+	config->file_cache_check = HTTPSERVER_DEFAULT_FILE_CACHE_CHECK;
+	config->response_cache = HTTPSERVER_DEFAULT_RESPONSE_CACHE;
+	config->small_file = HTTPSERVER_DEFAULT_SMALL_FILE;
+	config->sidecar_min = HTTPSERVER_DEFAULT_SIDECAR_MIN;
+	config->sidecar_generate = false;
+	config->registry = REGISTRATION_URL;
+	config->registry_deadline = HTTPSERVER_DEFAULT_REGISTRY_DEADLINE;
+	config->metrics = HTTPSERVER_DEFAULT_METRICS;
+	config->shed_target = HTTPSERVER_DEFAULT_SHED_TARGET;
+	config->shed_interval = HTTPSERVER_DEFAULT_SHED_INTERVAL;
+}
+
+// Readable once the server is shutting down
+static int shutdown_pipe[2] = { -1, -1 };
+
+// Completion tags of the io_uring accept loop. Receives carry the socket in the upper bits.
+enum {
+	URING_TAG_ACCEPT,
+	URING_TAG_RECV,
+	URING_TAG_SHUTDOWN,
+	URING_TAG_PROVIDE,
+	URING_TAG_TIMEOUT,
+	URING_TAG_PENDING,
+	URING_TAG_CANCEL,
+	URING_TAG_BITS = 8
+};
+
+static void httpserver_uring_provide(Uring *ring, char *buffers, int first, int count) {
+	struct io_uring_sqe *sqe = uring_get_sqe(ring);
+	if (sqe) {
+		sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+		sqe->fd = count;
+		sqe->addr = (uintptr_t) (buffers + (size_t) first * REQUEST_BUFFER_SIZE);
+		sqe->len = REQUEST_BUFFER_SIZE;
+		sqe->off = first;
+		sqe->buf_group = URING_BUFFER_GROUP;
+		sqe->user_data = URING_TAG_PROVIDE;
+	}
+}
+
+static bool httpserver_uring_accept(Uring *ring, int listen_socket) {
+	struct io_uring_sqe *sqe = uring_get_sqe(ring);
+	if (sqe) {
+		sqe->opcode = IORING_OP_ACCEPT;
+		sqe->fd = listen_socket;
+		sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+		sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+		sqe->user_data = URING_TAG_ACCEPT;
+	}
+	return sqe;
+}
+
+// Wait for a pending connection to become readable
+static void httpserver_uring_poll_pending(Uring *ring, Listener *listener) {
+	struct io_uring_sqe *sqe = uring_get_sqe(ring);
+	if (sqe) {
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->fd = listener->pending;
+		sqe->poll32_events = POLLIN;
+		sqe->user_data = URING_TAG_PENDING;
 	}
 }
 
 /**
- * Register to the central bookkeeping server
+ * Accept loop on io_uring: one multishot accept, then a receive into a kernel
+ * selected buffer for each new connection. The connection is taken together
+ * with the first request bytes once they arrive; the rest of the header is
+ * received through the pending set. Submissions are batched; each loop
+ * iteration is one io_uring_enter.
+ * @return 0 after shutdown, -1 if io_uring is not usable (nothing was accepted).
  */
-static void httpserver_register(const char *port) {
-	VERBOSE("Registering to central server...");
+static int httpserver_listener_uring(Listener *listener) {
+	Uring ring;
+	if (uring_init(&ring, URING_ENTRIES) == -1) {
+		VERBOSE("io_uring not available: %s", strerror(errno));
+		return -1;
+	}
+	if (!uring_supports(&ring, IORING_OP_ACCEPT) ||
+		!uring_supports(&ring, IORING_OP_RECV) ||
+		!uring_supports(&ring, IORING_OP_PROVIDE_BUFFERS) ||
+		!uring_supports(&ring, IORING_OP_POLL_ADD)) {
+		VERBOSE("io_uring lacks required operations");
+		uring_destroy(&ring);
+		return -1;
+	}
+	char *buffers = malloc((size_t) URING_BUFFER_COUNT * REQUEST_BUFFER_SIZE);
+	if (!buffers) {
+		uring_destroy(&ring);
+		return -1;
+	}
+
+	// Receives of the first request bytes are bounded by the idle deadline
+	struct __kernel_timespec idle_timeout = {
+		.tv_sec = deadline_ms[DEADLINE_IDLE] / 1000,
+		.tv_nsec = (deadline_ms[DEADLINE_IDLE] % 1000) * 1000000L,
+	};
+	bool link_timeout = deadline_ms[DEADLINE_IDLE] && uring_supports(&ring, IORING_OP_LINK_TIMEOUT);
 
-	char registration_string[64];
-	snprintf(registration_string, sizeof registration_string,
-		"nwprog1.netlab.hut.fi:%s\n", port);
+	httpserver_uring_provide(&ring, buffers, 0, URING_BUFFER_COUNT);
+	httpserver_uring_accept(&ring, listener->listen_socket);
+	struct io_uring_sqe *sqe = uring_get_sqe(&ring);
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = shutdown_pipe[0];
+	sqe->poll32_events = POLLIN;
+	sqe->user_data = URING_TAG_SHUTDOWN;
+	httpserver_uring_poll_pending(&ring, listener);
 
-	for (int max_retries = 3; max_retries > 0; --max_retries) {
-		int status_code = http_put_buf(REGISTRATION_URL, registration_string, strlen(registration_string));
-		if (200 <= status_code && status_code < 300) {
-			VERBOSE("Registered to central server.");
+	int result = 0;
+	bool accepted = false;
+	bool running = true;
+	unsigned receiving = 0; // Receives of a first request in flight
+	while (running) {
+		if (uring_submit(&ring, 1) == -1) {
+			VERBOSE("io_uring_enter failed: %s", strerror(errno));
+			result = accepted ? 0 : -1;
 			break;
-		} else if (max_retries == 1) {
-			VERBOSE("Could not register to central server. Starting up regardless.");
-		} else {
-			VERBOSE("Could not register to central server. Retrying...");
-			sleep(5);
+		}
+
+		struct io_uring_cqe *cqe;
+		while ((cqe = uring_peek_cqe(&ring))) {
+			uint64_t user_data = cqe->user_data;
+			int res = cqe->res;
+			unsigned flags = cqe->flags;
+			uring_cqe_seen(&ring);
+
+			switch (user_data & ((1 << URING_TAG_BITS) - 1)) {
+			case URING_TAG_ACCEPT:
+				if (res >= 0) {
+					accepted = true;
+					if (uring_sq_space(&ring) < (link_timeout ? 2u : 1u)) {
+						// No room for the receive and its timeout: the pending set has a deadline too
+						httpserver_handle_connection(listener, res, NULL, 0, NULL, 0);
+					} else {
+						sqe = uring_get_sqe(&ring);
+						sqe->opcode = IORING_OP_RECV;
+						sqe->fd = res;
+						sqe->len = REQUEST_BUFFER_SIZE;
+						sqe->flags = IOSQE_BUFFER_SELECT;
+						sqe->buf_group = URING_BUFFER_GROUP;
+						sqe->user_data = (uint64_t) res << URING_TAG_BITS | URING_TAG_RECV;
+						++receiving;
+						__atomic_add_fetch(&pending_connections, 1, __ATOMIC_RELAXED);
+						if (link_timeout) {
+							struct io_uring_sqe *timeout = uring_get_sqe(&ring);
+							sqe->flags |= IOSQE_IO_LINK;
+							timeout->opcode = IORING_OP_LINK_TIMEOUT;
+							timeout->addr = (uintptr_t) &idle_timeout;
+							timeout->len = 1;
+							timeout->user_data = URING_TAG_TIMEOUT;
+						}
+					}
+				} else if (!accepted && res == -EINVAL) {
+					// Multishot accept not supported (before Linux 5.19)
+					running = false;
+					result = -1;
+					break;
+				} else if (res != -EINTR && res != -ECONNABORTED) {
+					VERBOSE("Error accepting connection: %s", strerror(-res));
+				}
+				if (!(flags & IORING_CQE_F_MORE) && running) {
+					httpserver_uring_accept(&ring, listener->listen_socket);
+				}
+				break;
+			case URING_TAG_RECV: {
+				int fd = user_data >> URING_TAG_BITS;
+				--receiving;
+				__atomic_sub_fetch(&pending_connections, 1, __ATOMIC_RELAXED);
+				if (res > 0 && (flags & IORING_CQE_F_BUFFER)) {
+					int buffer_id = flags >> IORING_CQE_BUFFER_SHIFT;
+					char *request = malloc(REQUEST_BUFFER_SIZE);
+					if (request) {
+						memcpy(request, buffers + (size_t) buffer_id * REQUEST_BUFFER_SIZE, res);
+					}
+					httpserver_uring_provide(&ring, buffers, buffer_id, 1);
+					httpserver_handle_connection(listener, fd, NULL, 0, request, request ? res : 0);
+				} else if (res == -ENOBUFS || res == -EAGAIN) {
+					// Out of provided buffers: receive through the pending set instead
+					httpserver_handle_connection(listener, fd, NULL, 0, NULL, 0);
+				} else {
+					// Closed, failed or timed out before sending anything
+					socket_close(&fd);
+				}
+				break;
+			}
+			case URING_TAG_SHUTDOWN:
+				running = false;
+				break;
+			case URING_TAG_PROVIDE:
+				if (res < 0) {
+					VERBOSE("Could not provide receive buffers: %s", strerror(-res));
+				}
+				break;
+			case URING_TAG_TIMEOUT:
+			case URING_TAG_CANCEL:
+				break;
+			case URING_TAG_PENDING:
+				httpserver_receive_pending(listener);
+				if (running) {
+					httpserver_uring_poll_pending(&ring, listener);
+				}
+				break;
+			}
+		}
+	}
+
+	// Cancel the receives still waiting for a request and close their sockets;
+	// tearing down the ring cancels the other outstanding requests
+	sqe = receiving > 0 ? uring_get_sqe(&ring) : NULL;
+	if (sqe) {
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+		sqe->user_data = URING_TAG_CANCEL;
+	}
+	bool cancelling = sqe != NULL;
+	while (receiving > 0 && cancelling && uring_submit(&ring, 1) != -1) {
+		struct io_uring_cqe *cqe;
+		while ((cqe = uring_peek_cqe(&ring))) {
+			uint64_t user_data = cqe->user_data;
+			int res = cqe->res;
+			uring_cqe_seen(&ring);
+
+			switch (user_data & ((1 << URING_TAG_BITS) - 1)) {
+			case URING_TAG_RECV: {
+				int fd = user_data >> URING_TAG_BITS;
+				--receiving;
+				__atomic_sub_fetch(&pending_connections, 1, __ATOMIC_RELAXED);
+				socket_close(&fd);
+				break;
+			}
+			case URING_TAG_CANCEL:
+				// Cancelling everything at once needs Linux 5.19
+				cancelling = res >= 0 || res == -ENOENT;
+				break;
+			}
 		}
 	}
+	uring_destroy(&ring);
+	free(buffers);
+	return result;
 }
 
 /**
- * Deregister from the central bookkeeping servert
+ * Accept loop of one listening socket using poll and accept4.
  */
-static void httpserver_deregister(void) {
-	VERBOSE("Deregistering from central server...");
-	for (int max_retries = 3; max_retries > 0; --max_retries) {
-		int status_code = http_put_buf(REGISTRATION_URL, "", 0);
-		if (200 <= status_code  && status_code < 300) {
-			VERBOSE("Deregistered from central server.");
+static void *httpserver_listener_thread(void *args) {
+	Listener *listener = args;
+
+	// Wait for the listening socket and the pending connections, then drain the
+	// accept queue and receive what has arrived
+	struct pollfd fds[] = {
+		{ listener->listen_socket, POLLIN, 0 },
+		{ shutdown_pipe[0], POLLIN, 0 },
+		{ listener->pending, POLLIN, 0 },
+	};
+	for (;;) {
+		if (poll(fds, 3, -1) == -1) {
+			if (errno != EINTR) {
+				VERBOSE("Error polling listening socket: %s", strerror(errno));
+			}
+			continue;
+		}
+		if (fds[1].revents) {
 			break;
 		}
-		else if (max_retries == 1) {
-			VERBOSE("Could not deregister from central server, giving up.");
+		if (fds[2].revents) {
+			httpserver_receive_pending(listener);
 		}
-		else {
-			VERBOSE("Could not deregister from central server, retrying...");
-			sleep(5);
+		if (fds[0].revents) {
+			httpserver_accept_pending(listener);
 		}
 	}
+	return NULL;
 }
 
-int httpserver_run(const char *port) {
+/**
+ * Accept thread of one listening socket.
+ */
+static void *httpserver_listener_thread_main(void *args) {
+	Listener *listener = args;
 
-	// Ignore some common signals
-	struct sigaction handler;
-	handler.sa_handler = signal_handler;
-	handler.sa_flags = 0;
-	sigemptyset(&handler.sa_mask);
-	if (sigaction(SIGINT, &handler, NULL) ||
-		sigaction(SIGTERM, &handler, NULL) ||
-		sigaction(SIGPIPE, &handler, NULL)) {
-		VERBOSE("Error setting signal handlers");
+	if (listener->cpu >= 0) {
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(listener->cpu, &cpus);
+		pthread_setaffinity_np(pthread_self(), sizeof cpus, &cpus);
+	}
+
+	// Fall back to poll and accept4 if io_uring cannot be used
+	if (use_uring && httpserver_listener_uring(listener) == 0) {
+		return NULL;
+	}
+	return httpserver_listener_thread(listener);
+}
+
+/**
+ * Open the listening sockets and serve until a termination signal arrives.
+ * @return 0 after a clean shutdown, -1 if the listeners could not be started.
+ */
+static int httpserver_serve(const HttpServerConfig *config) {
+	const char *port = config->port;
+
+	long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpu_count < 1) {
+		cpu_count = 1;
+	}
+	int listener_count = config->listeners > 0 ? config->listeners : cpu_count;
+	Listener *listeners = calloc(listener_count, sizeof(*listeners));
+	if (!listeners || pipe(shutdown_pipe) == -1) {
+		VERBOSE("Error allocating listeners");
+		free(listeners);
 		return -1;
 	}
 
 	// Bind to a port
-	VERBOSE("Opening a listening socket on localhost:tcp/%s.", port);
-	int listen_socket = socket_tcp_listen(NULL, port);
-	if (listen_socket >= 0) {
+	VERBOSE("Opening %d listening socket(s) on localhost:tcp/%s.", listener_count, port);
+	int opened = 0;
+	for (; opened < listener_count; ++opened) {
+		Listener *listener = &listeners[opened];
+		listener->cpu = listener_count > 1 ? opened % cpu_count : -1;
+		listener->pending = epoll_create1(EPOLL_CLOEXEC);
+		if (listener->pending == -1) {
+			VERBOSE("Error creating epoll set: %s", strerror(errno));
+			break;
+		}
+
+		SocketOptions options;
+		socket_options_default(&options);
+		options.backlog = config->backlog;
+		options.reuse_port = listener_count > 1;
+		options.incoming_cpu = config->incoming_cpu ? opened % cpu_count : -1;
+		options.defer_accept = config->defer_accept;
+		options.fastopen = config->fastopen;
+		options.nodelay = config->nodelay;
+		options.send_buffer = config->send_buffer;
+		options.receive_buffer = config->receive_buffer;
+		options.notsent_lowat = config->notsent_lowat;
+		options.busy_poll = config->busy_poll;
+		options.user_timeout = config->user_timeout;
+		listener->listen_socket = socket_tcp_listen_with(NULL, port, &options);
+		if (listener->listen_socket < 0 || socket_set_nonblocking(listener->listen_socket) == -1) {
+			VERBOSE("Error opening listening socket: %s", strerror(errno));
+			socket_close(&listener->listen_socket);
+			socket_close(&listener->pending);
+			break;
+		}
+	}
+
+	int result = -1;
+	if (opened == listener_count) {
 		VERBOSE("Listening socket open.");
 
-		// Register to central server
-		httpserver_register(port);
+		// Register to central server in the background
+		char registration[64];
+		snprintf(registration, sizeof registration, "nwprog1.netlab.hut.fi:%s\n", port);
+		if (registration_start(config->registry, registration) == -1) {
+			VERBOSE("Could not start registering to central server");
+		}
 
-		// Listen for incoming connections and pass them to the handler
-		bool running = true;
-		while (running) {
-			if (caught_signal) {
-				VERBOSE("Caught signal, shutting down.");
-				shutdown(listen_socket, SHUT_RDWR);
-				running = false;
-				continue;
-			}
+		// Accept threads get the termination signals blocked; the main thread
+		// waits for them and tells the accept threads to stop.
+		sigset_t blocked, original;
+		sigemptyset(&blocked);
+		sigaddset(&blocked, SIGINT);
+		sigaddset(&blocked, SIGTERM);
+		pthread_sigmask(SIG_BLOCK, &blocked, &original);
 
-			struct sockaddr_in6 peer;
-			socklen_t peer_length = sizeof(peer);
-			int incoming_socket = accept(listen_socket, &peer, &peer_length);
-			if (incoming_socket != -1) {
-				char peer_hostname[128];
-				peer_hostname[0] = '\0';
-				char peer_port[16];
-				peer_port[0] = '\0';
-				getnameinfo((struct sockaddr *) &peer, peer_length,
-					peer_hostname, sizeof peer_hostname,
-					peer_port, sizeof peer_port,
-					NI_NUMERICHOST | NI_NUMERICSERV);
-				VERBOSE("[%d] Incoming connection from %s:%s", incoming_socket, peer_hostname, peer_port);
-				httpserver_handle_connection(incoming_socket);
-			} 
-			else if (errno == EINTR) {
-				// Signal? Try again and handle it
-				continue;
+		int started = 0;
+		for (; started < listener_count; ++started) {
+			if (pthread_create(&listeners[started].thread, NULL, httpserver_listener_thread_main, &listeners[started])) {
+				VERBOSE("Could not spawn an accept thread");
+				break;
 			}
-			else {
-				VERBOSE("Error accepting connection: %s", strerror(errno));
+		}
+		if (started == listener_count) {
+			while (!caught_signal) {
+				sigsuspend(&original);
 			}
+			VERBOSE("Caught signal, shutting down.");
+		}
+		pthread_sigmask(SIG_SETMASK, &original, NULL);
+
+		socket_write(shutdown_pipe[1], "", 1);
+		for (int i = 0; i < started; ++i) {
+			pthread_join(listeners[i].thread, NULL);
+			shutdown(listeners[i].listen_socket, SHUT_RDWR);
 		}
 
 		// Deregister from central server
-		httpserver_deregister();
+		registration_stop(config->registry_deadline);
+		http_pool_close();
+		result = 0;
+	}
 
-	} else {
-		VERBOSE("Error opening listening socket: %s", strerror(errno));
+	// The accept threads are gone, so their pending connections can be closed
+	VERBOSE("Closing listening sockets");
+	for (int i = 0; i < opened; ++i) {
+		socket_close(&listeners[i].listen_socket);
+		httpserver_pending_close(&listeners[i]);
 	}
-	VERBOSE("Closing listening socket", listen_socket);
-	socket_close(&listen_socket);
+	socket_close(&shutdown_pipe[0]);
+	socket_close(&shutdown_pipe[1]);
+	free(listeners);
+	return result;
+}
 
-	return 0;
+int httpserver_run(const HttpServerConfig *config) {
+	// Catch the termination signals; a client closing its end is not one
+	struct sigaction handler;
+	handler.sa_handler = signal_handler;
+	handler.sa_flags = 0;
+	sigemptyset(&handler.sa_mask);
+	if (sigaction(SIGINT, &handler, NULL) ||
+		sigaction(SIGTERM, &handler, NULL) ||
+		signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
+		VERBOSE("Error setting signal handlers");
+		return -1;
+	}
+
+	const unsigned timeouts[DEADLINE_COUNT] = {
+		[DEADLINE_IDLE] = config->idle_timeout,
+		[DEADLINE_HEADER] = config->header_timeout,
+		[DEADLINE_BODY] = config->body_timeout,
+		[DEADLINE_WRITE] = config->write_timeout,
+	};
+	for (int phase = 0; phase < DEADLINE_COUNT; ++phase) {
+		deadline_ms[phase] = timeouts[phase] < UINT_MAX / 1000 ? timeouts[phase] * 1000 : UINT_MAX;
+	}
+
+	durability_init(config->durability, config->group_window);
+	admission_init(&admission, config->shed_target, config->shed_interval);
+	pacer_init(&bulk_pacer, (uint64_t) config->bulk_rate * 1024);
+	get_weight = config->get_weight;
+	put_weight = config->put_weight;
+	class_limit[ADMISSION_DNS] = config->dns_limit;
+	class_limit[ADMISSION_BULK] = config->bulk_limit;
+	small_file_max = config->file_cache > 0 && config->response_cache > 0 ? config->small_file : 0;
+	listing_cache_max = config->file_cache > 0 ? (size_t) config->response_cache * 1024 : 0;
+	sidecar_min = config->sidecar_min;
+	metrics_path = config->metrics ? config->metrics : "";
+	if (metrics_init() == -1) {
+		VERBOSE("Could not set up metrics");
+	}
+	metrics_upstream_add(DEFAULT_DNS_SERVER);
+	if (config->sidecar_generate && sidecar_init() == -1) {
+		VERBOSE("Could not start making precompressed files");
+	}
+	if (filecache_init(config->file_cache, config->file_cache_check, (size_t) config->response_cache * 1024) == -1) {
+		VERBOSE("Could not allocate file cache");
+		return -1;
+	}
+
+	// Everything set up from here is released in reverse order on every path
+	int result = -1;
+	if (httpserver_render_static_replies() == -1) {
+		VERBOSE("Error rendering static replies");
+	} else if (timer_start(TIMER_TICK_MS) == 0) {
+		work_queues[ADMISSION_DNS] = workqueue_new(config->dns_workers);
+		work_queues[ADMISSION_BULK] = workqueue_new(config->bulk_workers);
+		if (!work_queues[ADMISSION_DNS] || !work_queues[ADMISSION_BULK]) {
+			VERBOSE("Could not start worker threads");
+		} else {
+			use_uring = config->io_uring && pthread_key_create(&uring_key, httpserver_thread_ring_delete) == 0;
+			result = httpserver_serve(config);
+		}
+
+		// Workers finish the connections they were given; their deadlines still run
+		for (int class = 0; class < ADMISSION_CLASS_COUNT; ++class) {
+			workqueue_delete(work_queues[class]);
+			work_queues[class] = NULL;
+		}
+		if (use_uring) {
+			pthread_key_delete(uring_key);
+			use_uring = false;
+		}
+		timer_stop();
+	}
+	httpserver_free_static_replies();
+	return result;
 }
@@ -1,12 +1,112 @@
 #ifndef HTTPSERVER_H_
 #define HTTPSERVER_H_
 
+#include <stdbool.h>
+
+#include "durability.h"
+
+#define HTTPSERVER_DEFAULT_IDLE_TIMEOUT 60
+#define HTTPSERVER_DEFAULT_HEADER_TIMEOUT 10
+#define HTTPSERVER_DEFAULT_BODY_TIMEOUT 30
+#define HTTPSERVER_DEFAULT_WRITE_TIMEOUT 30
+#define HTTPSERVER_DEFAULT_DNS_WORKERS 8
+#define HTTPSERVER_DEFAULT_BULK_WORKERS 64
+#define HTTPSERVER_DEFAULT_DNS_LIMIT 1024
+#define HTTPSERVER_DEFAULT_BULK_LIMIT 256
+#define HTTPSERVER_DEFAULT_GROUP_WINDOW 2
+#define HTTPSERVER_DEFAULT_FILE_CACHE 256
+#define HTTPSERVER_DEFAULT_FILE_CACHE_CHECK 1000
+#define HTTPSERVER_DEFAULT_RESPONSE_CACHE 32768
+#define HTTPSERVER_DEFAULT_SMALL_FILE 65536
+#define HTTPSERVER_DEFAULT_SIDECAR_MIN 1024
+#define HTTPSERVER_DEFAULT_REGISTRY_DEADLINE 3000
+#define HTTPSERVER_DEFAULT_METRICS "/metrics"
+#define HTTPSERVER_DEFAULT_SHED_TARGET 5
+#define HTTPSERVER_DEFAULT_SHED_INTERVAL 100
+
+/**
+ * Server configuration. Initialize with httpserver_config_default.
+ */
+typedef struct {
+	const char *port; // Service name or numeric port to listen on
+	int listeners; // Listening sockets sharing the port with SO_REUSEPORT, each with
+	               // its own accept thread pinned to a CPU. 0 for one per online CPU.
+	int backlog; // Accept queue length of each listening socket
+	bool incoming_cpu; // Steer connections to the listener of the CPU that received them
+	bool io_uring; // Use io_uring for accepting, receiving requests and sending large files,
+	               // if the kernel supports it
+
+	// TCP tunables of the listening sockets, inherited by accepted connections.
+	// 0 leaves the kernel default. See SocketOptions.
+	unsigned defer_accept; // Seconds the kernel holds a connection until its first data
+	unsigned fastopen; // Pending TCP Fast Open requests allowed
+	bool nodelay;
+	unsigned send_buffer; // Bytes
+	unsigned receive_buffer; // Bytes
+	unsigned notsent_lowat; // Bytes
+	unsigned busy_poll; // Microseconds
+	unsigned user_timeout; // Milliseconds
+
+	// Deadlines in seconds, 0 for none. Idle and header deadlines are absolute;
+	// body and write deadlines allow that much time without any progress.
+	unsigned idle_timeout; // From accepting a connection to its first request byte
+	unsigned header_timeout; // From the first byte to the end of the request header
+	unsigned body_timeout; // Receiving the request body
+	unsigned write_timeout; // Sending the response
+
+	// Execution classes. DNS lookups and bulk transfers (everything else) have
+	// separate worker pools, and a limit on the connections queued or served.
+	int dns_workers;
+	int bulk_workers;
+	unsigned dns_limit;
+	unsigned bulk_limit;
+	// Bulk bandwidth in KiB/s shared by transfers in proportion to their weight, 0 for unlimited
+	unsigned bulk_rate;
+	unsigned get_weight; // Weight of each download
+	unsigned put_weight; // Weight of each upload
+
+	DurabilityMode durability; // When an upload is flushed to disk before it is acknowledged
+	unsigned group_window; // Milliseconds a group commit waits for more uploads
+
+	// Open files and their metadata kept for repeated GETs, dropped on changes
+	// reported by inotify and checked with stat when older than the interval
+	unsigned file_cache; // Files kept open, 0 to disable
+	unsigned file_cache_check; // Milliseconds, 0 to rely on inotify alone
+	// Complete responses for small cached files, sent with a single write
+	unsigned response_cache; // KiB of responses kept, 0 to disable
+	unsigned small_file; // Largest file in bytes whose response is kept
+
+	// Precompressed copies next to text files, such as file.txt.gz, are sent
+	// to clients accepting their coding while they are not older than the file
+	unsigned sidecar_min; // Smallest file in bytes to look for a copy of
+	bool sidecar_generate; // Make missing copies in the background with gzip and zstd
+
+	// The central bookkeeping server is told about the server in the background
+	const char *registry; // URL to PUT the registration to, NULL or empty for none
+	unsigned registry_deadline; // Milliseconds shutdown waits for deregistration
+
+	const char *metrics; // Path answering GET with the server's metrics, NULL or empty for none
+
+	// Load shedding: once connections have been queued for longer than the target
+	// for a whole interval, bulk requests are answered 503 until the queue drains.
+	unsigned shed_target; // Queue delay target in milliseconds, 0 to never shed
+	unsigned shed_interval; // Milliseconds
+} HttpServerConfig;
+
+/**
+ * Fill in the default configuration: a single listener with the default backlog
+ * and the default deadlines, execution classes, load shedding, durability and
+ * file cache.
+ * @param config Configuration to initialize.
+ */
+void httpserver_config_default(HttpServerConfig *config);
+
 /**
- * Run a listening HTTP server on given port. Exit on a signal.
- * @param port Service name or numeric port to listen on.
+ * Run a listening HTTP server. Exit on a signal.
+ * @param config Server configuration.
  * @return 0 if server was run (and shutdown) correctly. -1 if the server could not
  * bind to given port for one reason or another.
  */
-int httpserver_run(const char *port);
+int httpserver_run(const HttpServerConfig *config);
 
 #endif
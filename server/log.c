@@ -0,0 +1,425 @@
+#include "common.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+
+#define LOG_RING_SIZE 128 // Records per thread. Must be a power of two.
+#define LOG_MAX_ARGS 8
+#define LOG_STRINGS_SIZE 256 // Room for copied %s arguments in one record
+#define LOG_LINE_MAX 1024
+#define LOG_OUTPUT_SIZE 65536
+#define LOG_IDLE_SLEEP_NS 10000000 // 10 ms
+#define CACHE_LINE 64
+
+volatile int log_level = LOG_LEVEL_VERBOSE;
+
+typedef union {
+	long long i;
+	unsigned long long u;
+	double d;
+	const void *p;
+	size_t string; // Offset in LogRecord.strings
+} LogArg;
+
+// A log message in binary form. Formatting is left to the writer thread.
+typedef struct {
+	const char *format;
+	struct timespec timestamp;
+	LogArg args[LOG_MAX_ARGS];
+	size_t arg_count;
+	char strings[LOG_STRINGS_SIZE];
+} LogRecord;
+
+// Single producer, single consumer ring. The producer is whichever thread
+// currently owns the ring; the consumer is the writer thread.
+typedef struct LogRing {
+	size_t head; // Written by the producer only
+	char pad_head[CACHE_LINE - sizeof(size_t)];
+	size_t tail; // Written by the consumer only
+	char pad_tail[CACHE_LINE - sizeof(size_t)];
+	size_t dropped;
+	struct LogRing *next; // List of all rings, never unlinked
+	struct LogRing *next_free;
+	LogRecord records[LOG_RING_SIZE];
+} LogRing;
+
+static pthread_key_t log_ring_key;
+static pthread_mutex_t log_rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static LogRing *log_rings = NULL;
+static LogRing *log_free_rings = NULL;
+
+static pthread_t log_writer;
+static bool log_running = false;
+static bool log_stopping = false;
+
+// One conversion specification within a format string
+typedef struct {
+	const char *begin; // The '%'
+	const char *end; // One past the conversion character
+	int stars; // Number of '*' widths and precisions
+	char length; // 'H' for hh, 'Q' for ll, otherwise the modifier itself or '\0'
+	char conversion;
+} LogSpec;
+
+// Find the next conversion specification. Returns NULL when there are none left.
+static const char *log_next_spec(const char *format, LogSpec *spec) {
+	const char *p = strchr(format, '%');
+	if (!p) {
+		return NULL;
+	}
+	spec->begin = p++;
+	spec->stars = 0;
+	spec->length = '\0';
+
+	while (*p && strchr("-+ #0", *p)) {
+		++p;
+	}
+	while (*p && (strchr("0123456789.", *p) || *p == '*')) {
+		spec->stars += *p == '*';
+		++p;
+	}
+	if (p[0] == 'h' && p[1] == 'h') {
+		spec->length = 'H';
+		p += 2;
+	} else if (p[0] == 'l' && p[1] == 'l') {
+		spec->length = 'Q';
+		p += 2;
+	} else if (*p && strchr("hlLjzt", *p)) {
+		spec->length = *p++;
+	}
+	spec->conversion = *p;
+	spec->end = *p ? p + 1 : p;
+	return spec->begin;
+}
+
+static long long log_va_signed(char length, va_list *args) {
+	switch (length) {
+	case 'l': return va_arg(*args, long);
+	case 'Q': return va_arg(*args, long long);
+	case 'j': return va_arg(*args, intmax_t);
+	case 'z': return va_arg(*args, ssize_t);
+	case 't': return va_arg(*args, ptrdiff_t);
+	default: return va_arg(*args, int);
+	}
+}
+
+static unsigned long long log_va_unsigned(char length, va_list *args) {
+	switch (length) {
+	case 'l': return va_arg(*args, unsigned long);
+	case 'Q': return va_arg(*args, unsigned long long);
+	case 'j': return va_arg(*args, uintmax_t);
+	case 'z': return va_arg(*args, size_t);
+	case 't': return va_arg(*args, ptrdiff_t);
+	default: return va_arg(*args, unsigned int);
+	}
+}
+
+// Copy the arguments of a format string into a record
+static void log_capture(LogRecord *record, const char *format, va_list *args) {
+	size_t strings_used = 0;
+	record->format = format;
+	record->arg_count = 0;
+	record->strings[LOG_STRINGS_SIZE - 1] = '\0';
+
+	LogSpec spec;
+	for (const char *p = format; (p = log_next_spec(p, &spec)); p = spec.end) {
+		if (spec.conversion == '%') {
+			continue;
+		}
+		if (record->arg_count + spec.stars + 1 > LOG_MAX_ARGS) {
+			break; // The rest of the format is printed as it is
+		}
+		for (int i = 0; i < spec.stars; ++i) {
+			record->args[record->arg_count++].i = va_arg(*args, int);
+		}
+
+		LogArg *arg = &record->args[record->arg_count++];
+		switch (spec.conversion) {
+		case 'd': case 'i':
+			arg->i = log_va_signed(spec.length, args);
+			break;
+		case 'u': case 'o': case 'x': case 'X': case 'c':
+			arg->u = log_va_unsigned(spec.length, args);
+			break;
+		case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+			arg->d = spec.length == 'L' ? (double) va_arg(*args, long double) : va_arg(*args, double);
+			break;
+		case 'p':
+			arg->p = va_arg(*args, void *);
+			break;
+		case 's': {
+			const char *string = va_arg(*args, const char *);
+			if (!string) {
+				string = "(null)";
+			}
+			size_t room = LOG_STRINGS_SIZE - 1 - strings_used;
+			size_t length = strnlen(string, room);
+			memcpy(record->strings + strings_used, string, length);
+			record->strings[strings_used + length] = '\0';
+			arg->string = strings_used;
+			// Next string starts after the terminator, or shares the final one
+			strings_used += length;
+			if (strings_used < LOG_STRINGS_SIZE - 1) {
+				++strings_used;
+			}
+			break;
+		}
+		default:
+			// Unsupported conversion: stop here
+			--record->arg_count;
+			return;
+		}
+	}
+}
+
+// Format a record as a log line into out. Returns the line length.
+// The line is cut to fit, and is not NUL-terminated.
+static size_t log_format(const LogRecord *record, char *out, size_t size) {
+	const size_t limit = size - 1; // Room for the newline
+	size_t used = 0;
+	int r = snprintf(out, limit + 1, "[%ld.%09ld] ", (long) record->timestamp.tv_sec, record->timestamp.tv_nsec);
+	used += r > 0 ? ((size_t) r < limit ? (size_t) r : limit) : 0;
+
+	const char *p = record->format;
+	size_t arg = 0;
+	LogSpec spec;
+	while (used < limit && log_next_spec(p, &spec)) {
+		// Literal text up to the conversion
+		size_t literal = spec.begin - p;
+		if (literal > limit - used) {
+			literal = limit - used;
+		}
+		memcpy(out + used, p, literal);
+		used += literal;
+
+		if (spec.conversion != '%' && arg + spec.stars >= record->arg_count) {
+			// Arguments were not captured, print the rest as it is
+			p = spec.begin;
+			break;
+		}
+		p = spec.end;
+
+		// Rebuild the specification with '*' replaced by the captured values
+		// and the length modifier matching the stored argument type
+		char conversion[64];
+		size_t c = 0;
+		for (const char *s = spec.begin; s < spec.end - 1 && c < 32; ++s) {
+			if (*s == '*') {
+				int n = snprintf(conversion + c, 16, "%d", (int) record->args[arg++].i);
+				c += n > 0 && n < 16 ? n : 0;
+			} else if (!strchr("hlLjzt", *s)) {
+				conversion[c++] = *s;
+			}
+		}
+		if (strchr("diuoxX", spec.conversion)) {
+			conversion[c++] = 'l';
+			conversion[c++] = 'l';
+		}
+		conversion[c++] = spec.conversion;
+		conversion[c] = '\0';
+
+		const LogArg *value = &record->args[arg];
+		char *target = out + used;
+		size_t room = limit + 1 - used;
+		switch (spec.conversion) {
+		case '%':
+			r = snprintf(target, room, "%%");
+			break;
+		case 'd': case 'i':
+			r = snprintf(target, room, conversion, value->i);
+			break;
+		case 'u': case 'o': case 'x': case 'X':
+			r = snprintf(target, room, conversion, value->u);
+			break;
+		case 'c':
+			r = snprintf(target, room, conversion, (int) value->u);
+			break;
+		case 'p':
+			r = snprintf(target, room, conversion, value->p);
+			break;
+		case 's':
+			r = snprintf(target, room, conversion, record->strings + value->string);
+			break;
+		default:
+			r = snprintf(target, room, conversion, value->d);
+			break;
+		}
+		if (spec.conversion != '%') {
+			++arg;
+		}
+		used += r > 0 ? ((size_t) r < limit - used ? (size_t) r : limit - used) : 0;
+	}
+
+	// Remaining literal text and the newline
+	size_t rest = strlen(p);
+	if (rest > limit - used) {
+		rest = limit - used;
+	}
+	memcpy(out + used, p, rest);
+	used += rest;
+	out[used++] = '\n';
+	return used;
+}
+
+// Write the whole buffer, retrying on EINTR and partial writes
+static void log_flush(const char *buffer, size_t size) {
+	size_t written = 0;
+	while (written < size) {
+		ssize_t written_last = write(STDERR_FILENO, buffer + written, size - written);
+		if (written_last == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		written += written_last;
+	}
+}
+
+static void log_release_ring(void *ring_ptr) {
+	LogRing *ring = ring_ptr;
+	pthread_mutex_lock(&log_rings_lock);
+	ring->next_free = log_free_rings;
+	log_free_rings = ring;
+	pthread_mutex_unlock(&log_rings_lock);
+}
+
+// Get the ring of the calling thread. Rings of exited threads are reused.
+static LogRing *log_thread_ring(void) {
+	LogRing *ring = pthread_getspecific(log_ring_key);
+	if (ring) {
+		return ring;
+	}
+
+	pthread_mutex_lock(&log_rings_lock);
+	if (log_free_rings) {
+		ring = log_free_rings;
+		log_free_rings = ring->next_free;
+	} else if ((ring = calloc(1, sizeof(*ring)))) {
+		ring->next = log_rings;
+		__atomic_store_n(&log_rings, ring, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&log_rings_lock);
+
+	if (ring) {
+		pthread_setspecific(log_ring_key, ring);
+	}
+	return ring;
+}
+
+void log_write(LogLevel level, const char *format, ...) {
+	if (!LOG_ENABLED(level)) {
+		return;
+	}
+
+	va_list args;
+	va_start(args, format);
+	if (!__atomic_load_n(&log_running, __ATOMIC_ACQUIRE)) {
+		// No writer thread, format and write right away
+		LogRecord record;
+		char line[LOG_LINE_MAX];
+		clock_gettime(CLOCK_REALTIME, &record.timestamp);
+		log_capture(&record, format, &args);
+		log_flush(line, log_format(&record, line, sizeof line));
+	} else {
+		LogRing *ring = log_thread_ring();
+		if (ring) {
+			size_t head = ring->head;
+			size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+			if (head - tail < LOG_RING_SIZE) {
+				LogRecord *record = &ring->records[head & (LOG_RING_SIZE - 1)];
+				clock_gettime(CLOCK_REALTIME_COARSE, &record->timestamp);
+				log_capture(record, format, &args);
+				__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+			} else {
+				__atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+			}
+		}
+	}
+	va_end(args);
+}
+
+// Format and write out all pending records. Returns the number of records written.
+static size_t log_drain(char *output) {
+	size_t records = 0;
+	size_t used = 0;
+	for (LogRing *ring = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+		size_t tail = ring->tail;
+		size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		for (; tail != head; ++tail, ++records) {
+			if (LOG_OUTPUT_SIZE - used < LOG_LINE_MAX) {
+				log_flush(output, used);
+				used = 0;
+			}
+			used += log_format(&ring->records[tail & (LOG_RING_SIZE - 1)], output + used, LOG_LINE_MAX);
+			__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+		}
+
+		size_t dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+		if (dropped > 0) {
+			if (LOG_OUTPUT_SIZE - used < LOG_LINE_MAX) {
+				log_flush(output, used);
+				used = 0;
+			}
+			used += snprintf(output + used, LOG_LINE_MAX, "Log buffer full, %zu records dropped\n", dropped);
+		}
+	}
+	log_flush(output, used);
+	return records;
+}
+
+static void *log_writer_thread(void *arg) {
+	char *output = arg;
+	bool stopping;
+	do {
+		// Drain once more after the stop request has been seen
+		stopping = __atomic_load_n(&log_stopping, __ATOMIC_ACQUIRE);
+		if (log_drain(output) == 0 && !stopping) {
+			struct timespec idle = { 0, LOG_IDLE_SLEEP_NS };
+			nanosleep(&idle, NULL);
+		}
+	} while (!stopping);
+	free(output);
+	return NULL;
+}
+
+int log_start(LogLevel level) {
+	log_level = level;
+	if (level == LOG_LEVEL_NONE || log_running) {
+		return 0;
+	}
+
+	char *output = malloc(LOG_OUTPUT_SIZE);
+	if (!output || pthread_key_create(&log_ring_key, log_release_ring)) {
+		free(output);
+		return -1;
+	}
+	log_stopping = false;
+	if (pthread_create(&log_writer, NULL, log_writer_thread, output)) {
+		free(output);
+		pthread_key_delete(log_ring_key);
+		return -1;
+	}
+	__atomic_store_n(&log_running, true, __ATOMIC_RELEASE);
+	return 0;
+}
+
+void log_stop(void) {
+	if (!log_running) {
+		return;
+	}
+	__atomic_store_n(&log_running, false, __ATOMIC_RELEASE);
+	__atomic_store_n(&log_stopping, true, __ATOMIC_RELEASE);
+	pthread_join(log_writer, NULL);
+}
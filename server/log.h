@@ -0,0 +1,55 @@
+#ifndef LOG_H_
+#define LOG_H_
+/**
+ * Logging module
+ * Request threads append binary records (format string, arguments and a coarse
+ * timestamp) to per-thread lock-free ring buffers. A background thread formats
+ * the records and writes them to stderr. When a ring is full the record is
+ * dropped and counted instead of blocking the caller.
+ */
+
+typedef enum {
+	LOG_LEVEL_NONE = -1,
+	LOG_LEVEL_ERROR,
+	LOG_LEVEL_WARNING,
+	LOG_LEVEL_INFO,
+	LOG_LEVEL_VERBOSE,
+} LogLevel;
+
+/**
+ * Records above this level are discarded before anything is copied or formatted.
+ */
+extern volatile int log_level;
+
+#define LOG_ENABLED(level) ((int) (level) <= log_level)
+
+/**
+ * Log a printf style message if the level is enabled.
+ * Supports the d, i, u, o, x, X, c, e, f, g, a, s, p conversions with the
+ * usual flags, widths and length modifiers. %s arguments are copied.
+ */
+#define LOG(level, ...) do { \
+		if (LOG_ENABLED(level)) { \
+			log_write((level), __VA_ARGS__); \
+		} \
+	} while (0)
+
+/**
+ * Set the log level and start the background writer thread.
+ * Before this is called, and after log_stop, messages are written synchronously.
+ * @param level Most verbose level to log.
+ * @return 0 on success, -1 if the writer thread could not be started.
+ */
+int log_start(LogLevel level);
+
+/**
+ * Write out all pending records and stop the background writer thread.
+ */
+void log_stop(void);
+
+/**
+ * Append a record to the calling thread's ring buffer. Use the LOG macro instead.
+ */
+void log_write(LogLevel level, const char *format, ...);
+
+#endif
@@ -0,0 +1,373 @@
+#include "common.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "metrics.h"
+
+#define CACHE_LINE 64
+#define METRICS_SUB_BITS 3 // Buckets per power of two: 1 << METRICS_SUB_BITS
+#define METRICS_SUB_BUCKETS (1 << METRICS_SUB_BITS)
+#define METRICS_MAX_BITS 32 // Larger values, over an hour, go to the last bucket
+#define METRICS_BUCKETS ((METRICS_MAX_BITS - METRICS_SUB_BITS + 1) * METRICS_SUB_BUCKETS)
+#define METRICS_UPSTREAM_MAX 4 // Servers with a histogram of their own
+
+// Status codes counted separately; the rest are counted as "other"
+static const int metrics_status_codes[] = { 200, 201, 206, 304, 400, 403, 404, 405, 416, 503 };
+#define METRICS_STATUS_COUNT (sizeof metrics_status_codes / sizeof metrics_status_codes[0] + 1)
+
+static const char *const metrics_method_names[METRICS_METHOD_COUNT] = {
+	[METRICS_METHOD_GET] = "GET",
+	[METRICS_METHOD_PUT] = "PUT",
+	[METRICS_METHOD_POST] = "POST",
+	[METRICS_METHOD_OTHER] = "other",
+};
+
+// Counters sharing a name must be adjacent
+static const struct {
+	const char *name;
+	const char *labels;
+	const char *help;
+} metrics_counters[METRICS_COUNTER_COUNT] = {
+	[METRICS_FILE_CACHE_HIT] = { "httpdnsd_cache_lookups_total", "cache=\"file\",result=\"hit\"",
+		"Cache lookups by cache and result" },
+	[METRICS_FILE_CACHE_MISS] = { "httpdnsd_cache_lookups_total", "cache=\"file\",result=\"miss\"", NULL },
+	[METRICS_FILE_CACHE_STALE] = { "httpdnsd_cache_lookups_total", "cache=\"file\",result=\"stale\"", NULL },
+	[METRICS_RESPONSE_CACHE_HIT] = { "httpdnsd_cache_lookups_total", "cache=\"response\",result=\"hit\"", NULL },
+	[METRICS_RESPONSE_CACHE_MISS] = { "httpdnsd_cache_lookups_total", "cache=\"response\",result=\"miss\"", NULL },
+	[METRICS_LISTING_CACHE_HIT] = { "httpdnsd_cache_lookups_total", "cache=\"listing\",result=\"hit\"", NULL },
+	[METRICS_LISTING_CACHE_MISS] = { "httpdnsd_cache_lookups_total", "cache=\"listing\",result=\"miss\"", NULL },
+	[METRICS_SHED] = { "httpdnsd_shed_total", "", "Requests shed by admission control" },
+	[METRICS_REJECTED] = { "httpdnsd_rejected_total", "", "Connections rejected over the class limit" },
+	[METRICS_UPSTREAM_TIMEOUT] = { "httpdnsd_upstream_timeouts_total", "", "DNS queries left unanswered" },
+};
+
+static const char *const metrics_stage_names[METRICS_STAGE_COUNT] = {
+	[METRICS_STAGE_HEADER] = "header",
+	[METRICS_STAGE_QUEUE] = "queue",
+	[METRICS_STAGE_RESPONSE] = "response",
+	[METRICS_STAGE_TOTAL] = "total",
+};
+
+typedef struct {
+	uint64_t count;
+	uint64_t sum_us;
+	uint64_t buckets[METRICS_BUCKETS];
+} MetricsHistogram;
+
+// Everything one thread records. Only the owning thread writes to it, so
+// updates are plain relaxed stores; readers may see a slightly old value but
+// never a torn one.
+typedef struct MetricsShard {
+	uint64_t requests[METRICS_METHOD_COUNT][METRICS_STATUS_COUNT];
+	uint64_t counters[METRICS_COUNTER_COUNT];
+	MetricsHistogram stages[METRICS_STAGE_COUNT];
+	MetricsHistogram upstream[METRICS_UPSTREAM_MAX + 1]; // The last for all other servers
+	int status; // Of the response being sent, 0 if none
+	struct MetricsShard *next; // List of all shards, never unlinked
+	struct MetricsShard *next_free;
+} MetricsShard;
+
+// Rounded up so that shards never share a cache line
+#define METRICS_SHARD_SIZE ((sizeof(MetricsShard) + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE)
+
+static bool metrics_ready = false;
+static pthread_key_t metrics_shard_key;
+static pthread_mutex_t metrics_shards_lock = PTHREAD_MUTEX_INITIALIZER;
+static MetricsShard *metrics_shards = NULL;
+static MetricsShard *metrics_free_shards = NULL;
+
+static struct {
+	pthread_mutex_t lock;
+	char *names[METRICS_UPSTREAM_MAX];
+	unsigned count; // Names are set once, before the count covering them is published
+} upstreams = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void metrics_release_shard(void *shard_ptr) {
+	MetricsShard *shard = shard_ptr;
+	pthread_mutex_lock(&metrics_shards_lock);
+	shard->next_free = metrics_free_shards;
+	metrics_free_shards = shard;
+	pthread_mutex_unlock(&metrics_shards_lock);
+}
+
+// Get the shard of the calling thread. Shards of exited threads are reused,
+// keeping their counts.
+static MetricsShard *metrics_shard(void) {
+	if (!__atomic_load_n(&metrics_ready, __ATOMIC_ACQUIRE)) {
+		return NULL;
+	}
+	MetricsShard *shard = pthread_getspecific(metrics_shard_key);
+	if (shard) {
+		return shard;
+	}
+
+	pthread_mutex_lock(&metrics_shards_lock);
+	void *memory = NULL;
+	if (metrics_free_shards) {
+		shard = metrics_free_shards;
+		metrics_free_shards = shard->next_free;
+	} else if (posix_memalign(&memory, CACHE_LINE, METRICS_SHARD_SIZE) == 0) {
+		shard = memset(memory, 0, METRICS_SHARD_SIZE);
+		shard->next = metrics_shards;
+		__atomic_store_n(&metrics_shards, shard, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&metrics_shards_lock);
+
+	if (shard) {
+		pthread_setspecific(metrics_shard_key, shard);
+	}
+	return shard;
+}
+
+static void metrics_add(uint64_t *counter, uint64_t value) {
+	__atomic_store_n(counter, *counter + value, __ATOMIC_RELAXED);
+}
+
+static uint64_t metrics_load(const uint64_t *counter) {
+	return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+// Exact below 2 * METRICS_SUB_BUCKETS, then METRICS_SUB_BUCKETS per power of two
+static unsigned metrics_bucket(uint64_t us) {
+	if (us < 2 * METRICS_SUB_BUCKETS) {
+		return us;
+	}
+	if (us >= (UINT64_C(1) << METRICS_MAX_BITS)) {
+		us = (UINT64_C(1) << METRICS_MAX_BITS) - 1;
+	}
+	unsigned shift = 63 - __builtin_clzll(us) - METRICS_SUB_BITS;
+	return (shift + 1) * METRICS_SUB_BUCKETS + (us >> shift) - METRICS_SUB_BUCKETS;
+}
+
+// Largest value that falls in a bucket
+static uint64_t metrics_bucket_max(unsigned bucket) {
+	if (bucket < 2 * METRICS_SUB_BUCKETS) {
+		return bucket;
+	}
+	unsigned shift = bucket / METRICS_SUB_BUCKETS - 1;
+	uint64_t low = (uint64_t) (bucket % METRICS_SUB_BUCKETS + METRICS_SUB_BUCKETS) << shift;
+	return low + (UINT64_C(1) << shift) - 1;
+}
+
+static void metrics_histogram_add(MetricsHistogram *histogram, uint64_t us) {
+	metrics_add(&histogram->buckets[metrics_bucket(us)], 1);
+	metrics_add(&histogram->sum_us, us);
+	metrics_add(&histogram->count, 1);
+}
+
+int metrics_init(void) {
+	if (metrics_ready) {
+		return 0;
+	}
+	if (pthread_key_create(&metrics_shard_key, metrics_release_shard)) {
+		return -1;
+	}
+	__atomic_store_n(&metrics_ready, true, __ATOMIC_RELEASE);
+	return 0;
+}
+
+uint64_t metrics_now_us(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+MetricsMethod metrics_method(const char *method) {
+	for (int i = 0; i < METRICS_METHOD_OTHER; ++i) {
+		if (strcmp(method, metrics_method_names[i]) == 0) {
+			return i;
+		}
+	}
+	return METRICS_METHOD_OTHER;
+}
+
+void metrics_count(MetricsCounter counter) {
+	MetricsShard *shard = metrics_shard();
+	if (shard) {
+		metrics_add(&shard->counters[counter], 1);
+	}
+}
+
+void metrics_status(int status_code) {
+	MetricsShard *shard = metrics_shard();
+	if (shard && status_code >= 200) {
+		shard->status = status_code;
+	}
+}
+
+void metrics_request(MetricsMethod method) {
+	MetricsShard *shard = metrics_shard();
+	if (!shard) {
+		return;
+	}
+	size_t status = METRICS_STATUS_COUNT - 1;
+	for (size_t i = 0; i < METRICS_STATUS_COUNT - 1; ++i) {
+		if (metrics_status_codes[i] == shard->status) {
+			status = i;
+			break;
+		}
+	}
+	metrics_add(&shard->requests[method][status], 1);
+	shard->status = 0;
+}
+
+void metrics_latency(MetricsStage stage, uint64_t us) {
+	MetricsShard *shard = metrics_shard();
+	if (shard) {
+		metrics_histogram_add(&shard->stages[stage], us);
+	}
+}
+
+void metrics_upstream_add(const char *server) {
+	pthread_mutex_lock(&upstreams.lock);
+	unsigned index = 0;
+	while (index < upstreams.count && strcmp(upstreams.names[index], server) != 0) {
+		++index;
+	}
+	if (index == upstreams.count && index < METRICS_UPSTREAM_MAX && (upstreams.names[index] = strdup(server))) {
+		__atomic_store_n(&upstreams.count, index + 1, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&upstreams.lock);
+}
+
+// Index of a server's histogram; servers that were not added share the last one
+static unsigned metrics_upstream_index(const char *server) {
+	unsigned count = __atomic_load_n(&upstreams.count, __ATOMIC_ACQUIRE);
+	for (unsigned i = 0; i < count; ++i) {
+		if (strcmp(upstreams.names[i], server) == 0) {
+			return i;
+		}
+	}
+	return METRICS_UPSTREAM_MAX;
+}
+
+void metrics_upstream(const char *server, uint64_t us) {
+	MetricsShard *shard = metrics_shard();
+	if (shard) {
+		metrics_histogram_add(&shard->upstream[metrics_upstream_index(server)], us);
+	}
+}
+
+// Write a label value, escaped as the text format requires
+static void metrics_write_label(FILE *out, const char *value) {
+	for (; *value; ++value) {
+		if (*value == '\\' || *value == '"') {
+			fputc('\\', out);
+			fputc(*value, out);
+		} else if (*value == '\n') {
+			fputs("\\n", out);
+		} else {
+			fputc(*value, out);
+		}
+	}
+}
+
+static void metrics_write_histogram(FILE *out, const char *name, const char *label, const char *value,
+		const MetricsHistogram *histogram) {
+	// Only the buckets that hold something; the counts are cumulative
+	uint64_t cumulative = 0;
+	for (unsigned bucket = 0; bucket < METRICS_BUCKETS; ++bucket) {
+		if (histogram->buckets[bucket] == 0) {
+			continue;
+		}
+		cumulative += histogram->buckets[bucket];
+		fprintf(out, "%s_bucket{%s=\"", name, label);
+		metrics_write_label(out, value);
+		fprintf(out, "\",le=\"%.6f\"} %llu\n", metrics_bucket_max(bucket) / 1e6, (unsigned long long) cumulative);
+	}
+	fprintf(out, "%s_bucket{%s=\"", name, label);
+	metrics_write_label(out, value);
+	fprintf(out, "\",le=\"+Inf\"} %llu\n", (unsigned long long) histogram->count);
+	fprintf(out, "%s_sum{%s=\"", name, label);
+	metrics_write_label(out, value);
+	fprintf(out, "\"} %.6f\n", histogram->sum_us / 1e6);
+	fprintf(out, "%s_count{%s=\"", name, label);
+	metrics_write_label(out, value);
+	fprintf(out, "\"} %llu\n", (unsigned long long) histogram->count);
+}
+
+static void metrics_sum_histogram(MetricsHistogram *total, const MetricsHistogram *histogram) {
+	for (unsigned bucket = 0; bucket < METRICS_BUCKETS; ++bucket) {
+		total->buckets[bucket] += metrics_load(&histogram->buckets[bucket]);
+	}
+	total->sum_us += metrics_load(&histogram->sum_us);
+	total->count += metrics_load(&histogram->count);
+}
+
+int metrics_render(FILE *out) {
+	MetricsShard *total = calloc(1, sizeof(*total));
+	if (!total) {
+		return -1;
+	}
+	for (const MetricsShard *shard = __atomic_load_n(&metrics_shards, __ATOMIC_ACQUIRE); shard; shard = shard->next) {
+		for (int method = 0; method < METRICS_METHOD_COUNT; ++method) {
+			for (size_t status = 0; status < METRICS_STATUS_COUNT; ++status) {
+				total->requests[method][status] += metrics_load(&shard->requests[method][status]);
+			}
+		}
+		for (int counter = 0; counter < METRICS_COUNTER_COUNT; ++counter) {
+			total->counters[counter] += metrics_load(&shard->counters[counter]);
+		}
+		for (int stage = 0; stage < METRICS_STAGE_COUNT; ++stage) {
+			metrics_sum_histogram(&total->stages[stage], &shard->stages[stage]);
+		}
+		for (int server = 0; server <= METRICS_UPSTREAM_MAX; ++server) {
+			metrics_sum_histogram(&total->upstream[server], &shard->upstream[server]);
+		}
+	}
+
+	fputs("# HELP httpdnsd_requests_total Requests served by method and status code\n"
+		"# TYPE httpdnsd_requests_total counter\n", out);
+	for (int method = 0; method < METRICS_METHOD_COUNT; ++method) {
+		for (size_t status = 0; status < METRICS_STATUS_COUNT; ++status) {
+			if (total->requests[method][status] == 0) {
+				continue;
+			}
+			char code[16] = "other";
+			if (status < METRICS_STATUS_COUNT - 1) {
+				snprintf(code, sizeof code, "%d", metrics_status_codes[status]);
+			}
+			fprintf(out, "httpdnsd_requests_total{method=\"%s\",code=\"%s\"} %llu\n",
+				metrics_method_names[method], code, (unsigned long long) total->requests[method][status]);
+		}
+	}
+
+	for (int counter = 0; counter < METRICS_COUNTER_COUNT; ++counter) {
+		const char *name = metrics_counters[counter].name;
+		if (metrics_counters[counter].help) {
+			fprintf(out, "# HELP %s %s\n# TYPE %s counter\n", name, metrics_counters[counter].help, name);
+		}
+		const char *labels = metrics_counters[counter].labels;
+		fprintf(out, "%s%s%s%s %llu\n", name, *labels ? "{" : "", labels, *labels ? "}" : "",
+			(unsigned long long) total->counters[counter]);
+	}
+
+	fputs("# HELP httpdnsd_stage_seconds Time requests spent in each stage\n"
+		"# TYPE httpdnsd_stage_seconds histogram\n", out);
+	for (int stage = 0; stage < METRICS_STAGE_COUNT; ++stage) {
+		metrics_write_histogram(out, "httpdnsd_stage_seconds", "stage", metrics_stage_names[stage], &total->stages[stage]);
+	}
+
+	fputs("# HELP httpdnsd_upstream_rtt_seconds Round trip time of DNS queries by server\n"
+		"# TYPE httpdnsd_upstream_rtt_seconds histogram\n", out);
+	unsigned servers = __atomic_load_n(&upstreams.count, __ATOMIC_ACQUIRE);
+	for (unsigned server = 0; server < servers; ++server) {
+		metrics_write_histogram(out, "httpdnsd_upstream_rtt_seconds", "server", upstreams.names[server],
+			&total->upstream[server]);
+	}
+	if (total->upstream[METRICS_UPSTREAM_MAX].count > 0) {
+		metrics_write_histogram(out, "httpdnsd_upstream_rtt_seconds", "server", "other",
+			&total->upstream[METRICS_UPSTREAM_MAX]);
+	}
+
+	free(total);
+	return ferror(out) ? -1 : 0;
+}
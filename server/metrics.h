@@ -0,0 +1,101 @@
+#ifndef METRICS_H_
+#define METRICS_H_
+/**
+ * Metrics module
+ * Counters and latency histograms for the metrics endpoint. Every thread records
+ * into a shard of its own, padded to whole cache lines, with plain stores and no
+ * locks; shards are summed only when the metrics are rendered. Histograms are
+ * log-linear in the manner of HDR histograms: each power of two of microseconds
+ * is split into eight buckets, bounding the relative error to 12.5%.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+
+typedef enum {
+	METRICS_METHOD_GET,
+	METRICS_METHOD_PUT,
+	METRICS_METHOD_POST,
+	METRICS_METHOD_OTHER,
+	METRICS_METHOD_COUNT
+} MetricsMethod;
+
+typedef enum {
+	METRICS_FILE_CACHE_HIT,
+	METRICS_FILE_CACHE_MISS,
+	METRICS_FILE_CACHE_STALE, // Found, but changed since it was cached
+	METRICS_RESPONSE_CACHE_HIT,
+	METRICS_RESPONSE_CACHE_MISS,
+	METRICS_LISTING_CACHE_HIT,
+	METRICS_LISTING_CACHE_MISS,
+	METRICS_SHED, // Requests answered 503 by admission control
+	METRICS_REJECTED, // Connections answered 503 over the class limit
+	METRICS_UPSTREAM_TIMEOUT, // DNS queries that got no answer in time
+	METRICS_COUNTER_COUNT
+} MetricsCounter;
+
+typedef enum {
+	METRICS_STAGE_HEADER, // Accepted until the request header has arrived
+	METRICS_STAGE_QUEUE, // Header received until a worker takes the connection
+	METRICS_STAGE_RESPONSE, // Serving the request
+	METRICS_STAGE_TOTAL, // All of the above
+	METRICS_STAGE_COUNT
+} MetricsStage;
+
+/**
+ * Set up per-thread recording. Before this is called nothing is recorded.
+ * @return 0 on success, -1 on failure.
+ */
+int metrics_init(void);
+
+/**
+ * Monotonic time in microseconds, for measuring latencies.
+ */
+uint64_t metrics_now_us(void);
+
+/**
+ * Map a request method to its label.
+ */
+MetricsMethod metrics_method(const char *method);
+
+/**
+ * Increment a counter.
+ */
+void metrics_count(MetricsCounter counter);
+
+/**
+ * Remember the status of the response the calling thread is sending, to be
+ * counted by metrics_request. Interim 1xx responses are ignored.
+ */
+void metrics_status(int status_code);
+
+/**
+ * Count a served request with the status last given by the calling thread.
+ */
+void metrics_request(MetricsMethod method);
+
+/**
+ * Record the time a request spent in a stage.
+ */
+void metrics_latency(MetricsStage stage, uint64_t us);
+
+/**
+ * Give a configured upstream server its own round trip time histogram. Only the
+ * first few servers added get one.
+ */
+void metrics_upstream_add(const char *server);
+
+/**
+ * Record the round trip time of a query to an upstream server. Servers not
+ * added with metrics_upstream_add share one histogram, so clients naming
+ * servers cannot take the labels.
+ */
+void metrics_upstream(const char *server, uint64_t us);
+
+/**
+ * Write the sum of all threads' metrics in the Prometheus text format.
+ * @return 0 on success, -1 on a write error.
+ */
+int metrics_render(FILE *out);
+
+#endif
@@ -0,0 +1,51 @@
+#include "common.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "mime.h"
+
+// Sorted by extension for bsearch
+static const MimeType mime_types[] = {
+	{ "css", "text/css", true },
+	{ "csv", "text/csv", true },
+	{ "gif", "image/gif", false },
+	{ "gz", "application/gzip", false },
+	{ "htm", "text/html", true },
+	{ "html", "text/html", true },
+	{ "ico", "image/x-icon", true },
+	{ "jpeg", "image/jpeg", false },
+	{ "jpg", "image/jpeg", false },
+	{ "js", "text/javascript", true },
+	{ "json", "application/json", true },
+	{ "log", "text/plain", true },
+	{ "md", "text/markdown", true },
+	{ "pdf", "application/pdf", false },
+	{ "png", "image/png", false },
+	{ "svg", "image/svg+xml", true },
+	{ "txt", "text/plain", true },
+	{ "wasm", "application/wasm", true },
+	{ "webp", "image/webp", false },
+	{ "xml", "application/xml", true },
+	{ "zip", "application/zip", false },
+	{ "zone", "text/dns", true }, // DNS master files, RFC 4027
+	{ "zst", "application/zstd", false },
+};
+
+static const MimeType mime_default = { "", "application/octet-stream", false };
+
+static int mime_compare(const void *key, const void *member) {
+	return strcasecmp(key, ((const MimeType *) member)->extension);
+}
+
+const MimeType *mime_type(const char *path) {
+	const char *name = strrchr(path, '/');
+	const char *dot = strrchr(name ? name : path, '.');
+	if (!dot) {
+		return &mime_default;
+	}
+	const MimeType *type = bsearch(dot + 1, mime_types, sizeof mime_types / sizeof mime_types[0],
+		sizeof mime_types[0], mime_compare);
+	return type ? type : &mime_default;
+}
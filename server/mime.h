@@ -0,0 +1,23 @@
+#ifndef MIME_H_
+#define MIME_H_
+/**
+ * MIME module
+ * Content types of files by their extension, from a table compiled in.
+ */
+
+#include <stdbool.h>
+
+typedef struct {
+	const char *extension; // Lowercase, without the dot
+	const char *type;
+	bool compressible; // Worth sending compressed
+} MimeType;
+
+/**
+ * Find the content type of a file.
+ * @param path Path or name of the file. The extension is matched case-insensitively.
+ * @return The type, application/octet-stream for unknown extensions. Never NULL.
+ */
+const MimeType *mime_type(const char *path);
+
+#endif
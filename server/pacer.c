@@ -0,0 +1,124 @@
+#include "common.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#include "pacer.h"
+#include "util.h"
+
+#ifndef SO_MAX_PACING_RATE
+#define SO_MAX_PACING_RATE 47
+#endif
+
+#define PACER_MAX_BURST_US 100000 // Idle time a receiver may make up for
+#define PACER_MIN_RATE 1024 // Bytes per second, so no transfer stalls completely
+#define PACER_QUANTUM_US 100000 // Share of time a receiver reads at a time
+
+static uint64_t pacer_now_us(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// Hand out the shares again. Called with the lock held.
+static void pacer_rebalance(Pacer *pacer) {
+	for (PacerFlow *flow = pacer->flows.next; flow != &pacer->flows; flow = flow->next) {
+		uint64_t rate = pacer->rate * flow->weight / pacer->total_weight;
+		if (rate < PACER_MIN_RATE) {
+			rate = PACER_MIN_RATE;
+		}
+		if (rate == flow->rate) {
+			continue;
+		}
+		flow->rate = rate;
+		if (flow->sending) {
+			// The option takes 32 bits on older kernels
+			unsigned value = rate < UINT32_MAX ? rate : UINT32_MAX - 1;
+			if (setsockopt(flow->fd, SOL_SOCKET, SO_MAX_PACING_RATE, &value, sizeof value) == -1) {
+				VERBOSE("[%d] Could not set pacing rate", flow->fd);
+			}
+		}
+	}
+}
+
+void pacer_init(Pacer *pacer, uint64_t rate) {
+	pthread_mutex_init(&pacer->lock, NULL);
+	pacer->rate = rate;
+	pacer->total_weight = 0;
+	pacer->flows.next = pacer->flows.prev = &pacer->flows;
+}
+
+void pacer_join(Pacer *pacer, PacerFlow *flow, int fd, unsigned weight, bool sending) {
+	flow->fd = fd;
+	flow->weight = weight > 0 ? weight : 1;
+	flow->sending = sending;
+	flow->rate = 0;
+	flow->next_us = pacer_now_us();
+	__atomic_store_n(&flow->received, 0, __ATOMIC_RELAXED);
+	if (pacer->rate == 0) {
+		flow->next = flow->prev = NULL;
+		return;
+	}
+
+	pthread_mutex_lock(&pacer->lock);
+	flow->next = &pacer->flows;
+	flow->prev = pacer->flows.prev;
+	pacer->flows.prev->next = flow;
+	pacer->flows.prev = flow;
+	pacer->total_weight += flow->weight;
+	pacer_rebalance(pacer);
+	pthread_mutex_unlock(&pacer->lock);
+}
+
+void pacer_leave(Pacer *pacer, PacerFlow *flow) {
+	if (!flow->next) {
+		return;
+	}
+	pthread_mutex_lock(&pacer->lock);
+	flow->prev->next = flow->next;
+	flow->next->prev = flow->prev;
+	flow->next = flow->prev = NULL;
+	pacer->total_weight -= flow->weight;
+	if (pacer->total_weight > 0) {
+		pacer_rebalance(pacer);
+	}
+	pthread_mutex_unlock(&pacer->lock);
+}
+
+size_t pacer_quantum(Pacer *pacer, PacerFlow *flow, size_t max) {
+	if (!flow->next) {
+		return max;
+	}
+	pthread_mutex_lock(&pacer->lock);
+	uint64_t rate = flow->rate;
+	pthread_mutex_unlock(&pacer->lock);
+	uint64_t quantum = rate * PACER_QUANTUM_US / 1000000;
+	return rate == 0 || quantum >= max ? max : quantum;
+}
+
+void pacer_received(Pacer *pacer, PacerFlow *flow, size_t bytes) {
+	__atomic_store_n(&flow->received, flow->received + bytes, __ATOMIC_RELAXED);
+	if (!flow->next) {
+		return;
+	}
+	pthread_mutex_lock(&pacer->lock);
+	uint64_t rate = flow->rate;
+	pthread_mutex_unlock(&pacer->lock);
+	if (rate == 0) {
+		return;
+	}
+
+	uint64_t now = pacer_now_us();
+	if (flow->next_us + PACER_MAX_BURST_US < now) {
+		flow->next_us = now - PACER_MAX_BURST_US;
+	}
+	flow->next_us += bytes * 1000000 / rate;
+	if (flow->next_us > now) {
+		uint64_t delay = flow->next_us - now;
+		struct timespec sleep = { delay / 1000000, (delay % 1000000) * 1000 };
+		nanosleep(&sleep, NULL);
+	}
+}
@@ -0,0 +1,72 @@
+#ifndef PACER_H_
+#define PACER_H_
+/**
+ * Pacing module
+ * Shares a bandwidth budget between the transfers using it in proportion to
+ * their weights. Shares are recomputed whenever a transfer joins or leaves.
+ * Sending sockets are paced by the kernel through SO_MAX_PACING_RATE; receiving
+ * transfers report what they read and are slowed down by pacer_received, which
+ * lets TCP flow control throttle the peer.
+ */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct PacerFlow PacerFlow;
+
+/**
+ * A transfer sharing the budget. Embed it in the object owning the transfer.
+ */
+struct PacerFlow {
+	PacerFlow *next;
+	PacerFlow *prev;
+	int fd;
+	unsigned weight;
+	bool sending;
+	uint64_t rate; // Current share in bytes per second
+	uint64_t next_us; // Receiving: when the bytes read so far are due
+	uint64_t received; // Receiving: bytes reported to pacer_received, readable by other threads
+};
+
+typedef struct {
+	pthread_mutex_t lock;
+	uint64_t rate; // Bytes per second, 0 for unlimited
+	unsigned total_weight;
+	PacerFlow flows; // List head
+} Pacer;
+
+/**
+ * Initialize a pacer.
+ * @param rate Total bandwidth in bytes per second. 0 disables pacing.
+ */
+void pacer_init(Pacer *pacer, uint64_t rate);
+
+/**
+ * Start pacing a transfer.
+ * @param fd Socket of the transfer.
+ * @param weight Relative share of the transfer, at least 1.
+ * @param sending true if data is sent on the socket, false if it is received.
+ */
+void pacer_join(Pacer *pacer, PacerFlow *flow, int fd, unsigned weight, bool sending);
+
+/**
+ * Stop pacing a transfer. Must be called before the socket is closed.
+ */
+void pacer_leave(Pacer *pacer, PacerFlow *flow);
+
+/**
+ * Largest number of bytes a receiving transfer should read at a time: about a
+ * tenth of a second of its share. Reading no more keeps each sleep in
+ * pacer_received short, so the transfer is seen to make steady progress.
+ * @param max Bytes the caller would read otherwise.
+ */
+size_t pacer_quantum(Pacer *pacer, PacerFlow *flow, size_t max);
+
+/**
+ * Account for bytes received by a transfer, sleeping if it is ahead of its share.
+ */
+void pacer_received(Pacer *pacer, PacerFlow *flow, size_t bytes);
+
+#endif
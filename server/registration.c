@@ -0,0 +1,149 @@
+#include "common.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "http.h"
+#include "registration.h"
+#include "thread.h"
+#include "util.h"
+
+#define REGISTRATION_BACKOFF_MIN_MS 500
+#define REGISTRATION_BACKOFF_MAX_MS 60000
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+	bool started;
+	bool stopping;
+	bool finished; // Deregistered, or gave up
+	struct timespec deadline; // Of deregistration, on CLOCK_MONOTONIC
+	char *url;
+	char *body;
+} registration = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static struct timespec registration_after(unsigned ms) {
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	time.tv_sec += ms / 1000;
+	time.tv_nsec += (ms % 1000) * 1000000L;
+	if (time.tv_nsec >= 1000000000L) {
+		time.tv_sec += 1;
+		time.tv_nsec -= 1000000000L;
+	}
+	return time;
+}
+
+static bool registration_before(const struct timespec *a, const struct timespec *b) {
+	return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+// Delay before retrying a failed attempt: exponential, with a random part of
+// up to half taken off so servers restarted together do not retry together
+static unsigned registration_backoff(unsigned attempt, unsigned *seed) {
+	unsigned delay = REGISTRATION_BACKOFF_MAX_MS;
+	if (attempt < 16 && (REGISTRATION_BACKOFF_MIN_MS << attempt) < REGISTRATION_BACKOFF_MAX_MS) {
+		delay = REGISTRATION_BACKOFF_MIN_MS << attempt;
+	}
+	return delay - rand_r(seed) % (delay / 2 + 1);
+}
+
+static bool registration_put(const char *body) {
+	int status_code = http_put_buf(registration.url, body, strlen(body));
+	return 200 <= status_code && status_code < 300;
+}
+
+static void *registration_thread(void *arg) {
+	(void) arg;
+	unsigned seed = (unsigned) time(NULL) ^ (unsigned) getpid();
+
+	// Register until it succeeds or shutdown begins
+	VERBOSE("Registering to central server...");
+	bool registered = false;
+	pthread_mutex_lock(&registration.lock);
+	for (unsigned attempt = 0; !registration.stopping; ++attempt) {
+		pthread_mutex_unlock(&registration.lock);
+		registered = registration_put(registration.body);
+		pthread_mutex_lock(&registration.lock);
+		if (registered) {
+			VERBOSE("Registered to central server.");
+			break;
+		}
+		unsigned delay = registration_backoff(attempt, &seed);
+		VERBOSE("Could not register to central server, retrying in %u ms.", delay);
+		struct timespec retry = registration_after(delay);
+		while (!registration.stopping &&
+			pthread_cond_timedwait(&registration.changed, &registration.lock, &retry) != ETIMEDOUT);
+	}
+	while (!registration.stopping) {
+		pthread_cond_wait(&registration.changed, &registration.lock);
+	}
+
+	// Deregister until it succeeds or the deadline passes
+	if (registered) {
+		VERBOSE("Deregistering from central server...");
+	}
+	for (unsigned attempt = 0; registered; ++attempt) {
+		pthread_mutex_unlock(&registration.lock);
+		bool deregistered = registration_put("");
+		pthread_mutex_lock(&registration.lock);
+		if (deregistered) {
+			VERBOSE("Deregistered from central server.");
+			break;
+		}
+		struct timespec retry = registration_after(registration_backoff(attempt, &seed));
+		if (!registration_before(&retry, &registration.deadline)) {
+			VERBOSE("Could not deregister from central server, giving up.");
+			break;
+		}
+		VERBOSE("Could not deregister from central server, retrying...");
+		while (pthread_cond_timedwait(&registration.changed, &registration.lock, &retry) != ETIMEDOUT);
+	}
+	registration.finished = true;
+	pthread_cond_broadcast(&registration.changed);
+	pthread_mutex_unlock(&registration.lock);
+	return NULL;
+}
+
+int registration_start(const char *url, const char *body) {
+	if (!url || *url == '\0') {
+		return 0;
+	}
+	pthread_condattr_t attributes;
+	pthread_condattr_init(&attributes);
+	pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+	pthread_cond_init(&registration.changed, &attributes);
+	pthread_condattr_destroy(&attributes);
+
+	registration.url = strdup(url);
+	registration.body = strdup(body);
+	if (!registration.url || !registration.body ||
+		thread_create_detached(registration_thread, NULL) == -1) {
+		free(registration.url);
+		free(registration.body);
+		return -1;
+	}
+	registration.started = true;
+	return 0;
+}
+
+void registration_stop(unsigned deadline_ms) {
+	if (!registration.started) {
+		return;
+	}
+	pthread_mutex_lock(&registration.lock);
+	registration.stopping = true;
+	registration.deadline = registration_after(deadline_ms);
+	pthread_cond_broadcast(&registration.changed);
+	// A request in progress cannot be interrupted; stop waiting for it at the deadline
+	while (!registration.finished &&
+		pthread_cond_timedwait(&registration.changed, &registration.lock, &registration.deadline) != ETIMEDOUT);
+	pthread_mutex_unlock(&registration.lock);
+}
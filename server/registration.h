@@ -0,0 +1,25 @@
+#ifndef REGISTRATION_H_
+#define REGISTRATION_H_
+/**
+ * Registration module
+ * Keeps the server registered to the central bookkeeping server from a
+ * background thread, so startup and shutdown do not wait for it. Failed
+ * attempts are retried with jittered exponential backoff.
+ */
+
+/**
+ * Start registering in the background.
+ * @param url URL to PUT the registration to. NULL or empty to not register.
+ * @param body Registration to PUT.
+ * @return 0 on success, -1 if the thread could not be started.
+ */
+int registration_start(const char *url, const char *body);
+
+/**
+ * Stop registering and deregister if registered, waiting for it at most the
+ * given time. Does nothing if registration was not started.
+ * @param deadline_ms Milliseconds to wait for deregistration.
+ */
+void registration_stop(unsigned deadline_ms);
+
+#endif
@@ -0,0 +1,250 @@
+#include "common.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <spawn.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sidecar.h"
+#include "socket.h"
+#include "util.h"
+#include "workqueue.h"
+
+#define SIDECAR_PENDING_MAX 64 // Requests beyond this are dropped; they come again
+#define SIDECAR_FAILED_MAX 64 // Failures remembered; the oldest is forgotten first
+#define SIDECAR_SETTLE_S 5 // Files modified more recently may still be being written
+
+static const struct {
+	const char *suffix;
+	const char *coding;
+	char *const argv[5]; // Compress standard input to standard output
+} sidecar_encodings[SIDECAR_ENCODING_COUNT] = {
+	[SIDECAR_ZSTD] = { ".zst", "zstd", { "zstd", "-q", "-c", "-19", NULL } },
+	[SIDECAR_GZIP] = { ".gz", "gzip", { "gzip", "-c", "-9", "-n", NULL } },
+};
+
+// A sidecar to be made
+typedef struct SidecarJob {
+	WorkItem work;
+	struct SidecarJob *next; // In the pending list
+	SidecarEncoding encoding;
+	char path[];
+} SidecarJob;
+
+static struct {
+	pthread_mutex_t lock;
+	WorkQueue *queue; // NULL if sidecars are not made
+	SidecarJob *pending; // Queued or being made
+	unsigned pending_count;
+	bool missing[SIDECAR_ENCODING_COUNT]; // The tool could not be run
+	struct {
+		char *path; // NULL if the slot is free
+		SidecarEncoding encoding;
+		off_t size;
+		struct timespec modified;
+	} failed[SIDECAR_FAILED_MAX]; // Files whose sidecar could not be made, as they were then
+	unsigned failed_next; // Slot to reuse next
+} sidecars = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+const char *sidecar_suffix(SidecarEncoding encoding) {
+	return sidecar_encodings[encoding].suffix;
+}
+
+const char *sidecar_coding(SidecarEncoding encoding) {
+	return sidecar_encodings[encoding].coding;
+}
+
+// Run a compressor from one file to another. Returns 0 if it succeeded.
+static int sidecar_compress(SidecarEncoding encoding, int input, int output) {
+	posix_spawn_file_actions_t actions;
+	if (posix_spawn_file_actions_init(&actions) != 0) {
+		return -1;
+	}
+	posix_spawn_file_actions_adddup2(&actions, input, STDIN_FILENO);
+	posix_spawn_file_actions_adddup2(&actions, output, STDOUT_FILENO);
+	pid_t pid;
+	int r = posix_spawnp(&pid, sidecar_encodings[encoding].argv[0], &actions, NULL,
+		sidecar_encodings[encoding].argv, environ);
+	posix_spawn_file_actions_destroy(&actions);
+	if (r != 0) {
+		VERBOSE("Could not run %s: %s", sidecar_encodings[encoding].argv[0], strerror(r));
+		__atomic_store_n(&sidecars.missing[encoding], true, __ATOMIC_RELAXED);
+		return -1;
+	}
+
+	int status;
+	while (waitpid(pid, &status, 0) == -1) {
+		if (errno != EINTR) {
+			return -1;
+		}
+	}
+	if (WIFEXITED(status) && WEXITSTATUS(status) == 127) {
+		// The shell convention for a command that was not found
+		__atomic_store_n(&sidecars.missing[encoding], true, __ATOMIC_RELAXED);
+	}
+	return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+// Find a remembered failure. Called with the lock held. Returns its slot, or -1.
+static int sidecar_failed_find(const char *path, SidecarEncoding encoding) {
+	for (int i = 0; i < SIDECAR_FAILED_MAX; ++i) {
+		if (sidecars.failed[i].path && sidecars.failed[i].encoding == encoding &&
+			strcmp(sidecars.failed[i].path, path) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+// Remember that a sidecar could not be made for a file as it is now
+static void sidecar_failed_add(const char *path, SidecarEncoding encoding, const struct stat *stats) {
+	pthread_mutex_lock(&sidecars.lock);
+	int slot = sidecar_failed_find(path, encoding);
+	char *copy = slot == -1 ? strdup(path) : NULL;
+	if (copy) {
+		slot = sidecars.failed_next;
+		sidecars.failed_next = (slot + 1) % SIDECAR_FAILED_MAX;
+		free(sidecars.failed[slot].path);
+		sidecars.failed[slot].path = copy;
+		sidecars.failed[slot].encoding = encoding;
+	}
+	if (slot != -1) {
+		sidecars.failed[slot].size = stats->st_size;
+		sidecars.failed[slot].modified = stats->st_mtim;
+	}
+	pthread_mutex_unlock(&sidecars.lock);
+}
+
+// Give a complete anonymous sidecar its name. A stale sidecar in the way is
+// never served, so it can be removed first.
+static int sidecar_link(int fd, const char *sidecar) {
+	char fd_path[32];
+	snprintf(fd_path, sizeof fd_path, "/proc/self/fd/%d", fd);
+	if (linkat(AT_FDCWD, fd_path, AT_FDCWD, sidecar, AT_SYMLINK_FOLLOW) == 0) {
+		return 0;
+	}
+	if (errno != EEXIST || (unlink(sidecar) == -1 && errno != ENOENT)) {
+		return -1;
+	}
+	return linkat(AT_FDCWD, fd_path, AT_FDCWD, sidecar, AT_SYMLINK_FOLLOW);
+}
+
+// Make a sidecar. Returns 0 if it was made, -1 if not, with the stat results
+// of the file it was made from in before.
+static int sidecar_make(const char *path, SidecarEncoding encoding, struct stat *before) {
+	char sidecar[PATH_MAX];
+	char directory[PATH_MAX];
+	char temp_path[PATH_MAX] = ""; // Named temporary file, empty if the file is anonymous
+	const char *slash = strrchr(path, '/');
+	int directory_length = slash ? slash + 1 - path : 0;
+	memset(before, 0, sizeof(*before));
+	if (snprintf(sidecar, sizeof sidecar, "%s%s", path, sidecar_suffix(encoding)) >= (int) sizeof sidecar ||
+		snprintf(directory, sizeof directory, "%.*s", slash ? directory_length : 1, slash ? path : ".") >= (int) sizeof directory ||
+		snprintf(temp_path, sizeof temp_path, "%.*s.%s%s.XXXXXX", directory_length, path,
+			path + directory_length, sidecar_suffix(encoding)) >= (int) sizeof temp_path) {
+		return -1;
+	}
+
+	int input = open(path, O_RDONLY | O_CLOEXEC);
+	if (input == -1 || fstat(input, before) == -1) {
+		socket_close(&input);
+		return -1;
+	}
+	// Compress to an anonymous file, so nothing partial shows up in the directory.
+	// A hidden temporary file is the fallback on filesystems without O_TMPFILE.
+	int output = open(directory, O_TMPFILE | O_WRONLY | O_CLOEXEC, 0644);
+	if (output != -1 || (errno != EOPNOTSUPP && errno != EISDIR && errno != EINVAL)) {
+		temp_path[0] = '\0';
+	} else if ((output = mkostemp(temp_path, O_CLOEXEC)) == -1) {
+		temp_path[0] = '\0';
+	}
+	if (output == -1) {
+		VERBOSE("Could not create a temporary file in %s: %s", directory, strerror(errno));
+		socket_close(&input);
+		return -1;
+	}
+
+	struct stat after;
+	struct stat compressed;
+	bool keep = sidecar_compress(encoding, input, output) == 0 &&
+		fstat(input, &after) == 0 && fstat(output, &compressed) == 0 &&
+		after.st_size == before->st_size &&
+		after.st_mtim.tv_sec == before->st_mtim.tv_sec &&
+		after.st_mtim.tv_nsec == before->st_mtim.tv_nsec &&
+		compressed.st_size < before->st_size &&
+		fchmod(output, 0644) == 0 &&
+		(temp_path[0] ? rename(temp_path, sidecar) : sidecar_link(output, sidecar)) == 0;
+	if (!keep && temp_path[0]) {
+		unlink(temp_path);
+	}
+	VERBOSE(keep ? "Made %s" : "Not making %s", sidecar);
+	socket_close(&output);
+	socket_close(&input);
+	return keep ? 0 : -1;
+}
+
+static void sidecar_job(WorkItem *item, uint64_t queued_us) {
+	(void) queued_us;
+	SidecarJob *job = (SidecarJob *) item;
+	struct stat made_from;
+	if (sidecar_make(job->path, job->encoding, &made_from) == -1) {
+		sidecar_failed_add(job->path, job->encoding, &made_from);
+	}
+
+	pthread_mutex_lock(&sidecars.lock);
+	SidecarJob **link = &sidecars.pending;
+	while (*link != job) {
+		link = &(*link)->next;
+	}
+	*link = job->next;
+	--sidecars.pending_count;
+	pthread_mutex_unlock(&sidecars.lock);
+	free(job);
+}
+
+int sidecar_init(void) {
+	sidecars.queue = workqueue_new(1);
+	return sidecars.queue ? 0 : -1;
+}
+
+void sidecar_generate(const char *path, SidecarEncoding encoding, const struct stat *stats) {
+	if (!sidecars.queue || __atomic_load_n(&sidecars.missing[encoding], __ATOMIC_RELAXED) ||
+		time(NULL) - stats->st_mtime < SIDECAR_SETTLE_S) {
+		return;
+	}
+
+	pthread_mutex_lock(&sidecars.lock);
+	int failed = sidecar_failed_find(path, encoding);
+	bool skip = sidecars.pending_count >= SIDECAR_PENDING_MAX || (failed != -1 &&
+		sidecars.failed[failed].size == stats->st_size &&
+		sidecars.failed[failed].modified.tv_sec == stats->st_mtim.tv_sec &&
+		sidecars.failed[failed].modified.tv_nsec == stats->st_mtim.tv_nsec);
+	for (SidecarJob *job = sidecars.pending; job && !skip; job = job->next) {
+		skip = job->encoding == encoding && strcmp(job->path, path) == 0;
+	}
+	SidecarJob *job = skip ? NULL : malloc(sizeof(*job) + strlen(path) + 1);
+	if (job) {
+		job->work.function = sidecar_job;
+		job->encoding = encoding;
+		strcpy(job->path, path);
+		job->next = sidecars.pending;
+		sidecars.pending = job;
+		++sidecars.pending_count;
+	}
+	pthread_mutex_unlock(&sidecars.lock);
+
+	if (job) {
+		workqueue_submit(sidecars.queue, &job->work, WORK_PRIORITY_NORMAL);
+	}
+}
@@ -0,0 +1,46 @@
+#ifndef SIDECAR_H_
+#define SIDECAR_H_
+/**
+ * Sidecar module
+ * Precompressed copies of files kept next to them, such as file.txt.gz, and an
+ * optional background job that makes missing ones with the gzip and zstd tools.
+ * A sidecar is fresh when it is not older than its file.
+ */
+
+#include <stdbool.h>
+#include <sys/stat.h>
+
+typedef enum {
+	SIDECAR_ZSTD, // Preferred when a client accepts both equally
+	SIDECAR_GZIP,
+	SIDECAR_ENCODING_COUNT
+} SidecarEncoding;
+
+/**
+ * File name suffix of a sidecar, such as ".gz".
+ */
+const char *sidecar_suffix(SidecarEncoding encoding);
+
+/**
+ * Content coding of a sidecar, as named in Accept-Encoding and Content-Encoding.
+ */
+const char *sidecar_coding(SidecarEncoding encoding);
+
+/**
+ * Start the thread making sidecars. Without it sidecar_generate does nothing.
+ * @return 0 on success, -1 on failure.
+ */
+int sidecar_init(void);
+
+/**
+ * Queue making a sidecar for a file, unless it is already queued. The sidecar
+ * is written to an anonymous temporary file and linked into place, and discarded
+ * if the file changes meanwhile or does not compress. Files modified in the last
+ * few seconds may still be being written and are left alone, as is a file whose
+ * sidecar could not be made until its size or modification time changes.
+ * @param path Path of the file.
+ * @param stats Current stat results of the file.
+ */
+void sidecar_generate(const char *path, SidecarEncoding encoding, const struct stat *stats);
+
+#endif
@@ -1,17 +1,35 @@
-#define _POSIX_C_SOURCE 200809L
+#include "common.h"
 
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "socket.h"
 #include "util.h"
 
+#ifndef SO_INCOMING_CPU
+#define SO_INCOMING_CPU 49 // Linux 3.19, missing from older headers
+#endif
+#ifndef SO_BUSY_POLL
+#define SO_BUSY_POLL 46 // Linux 3.11
+#endif
+#ifndef TCP_NOTSENT_LOWAT
+#define TCP_NOTSENT_LOWAT 25 // Linux 3.12
+#endif
+
 int socket_close(int *fd_ptr) {
 	int r = -1;
 	while (fd_ptr) {
@@ -34,45 +52,151 @@ int socket_close(int *fd_ptr) {
 	return r;
 }
 
-// Common functionality to all protocols
-static int socket_connect(const char *hostname, const char *port, int socktype) {
+int socket_resolve(const char *hostname, const char *port, int socktype, SocketAddress *addresses, int max) {
 	if (!hostname || !port) {
 		return -1;
 	}
 
-	// Prepare the hints struct
+	// Prepare the hints struct. Both families are asked for so that they can
+	// be raced; only families with a configured address are returned.
 	struct addrinfo *address, hints;
 	memset(&hints, 0, sizeof hints);
-	hints.ai_family = AF_INET6;
+	hints.ai_family = AF_UNSPEC;
 	hints.ai_socktype = socktype;
-	hints.ai_flags = AI_PASSIVE | AI_ALL | AI_V4MAPPED;
+	hints.ai_flags = AI_ADDRCONFIG;
 
-	// Get a list of addresses to try
-	int r = -1;	
-	if (0 != (r = getaddrinfo(hostname, port, &hints, &address))) {
+	if (0 != getaddrinfo(hostname, port, &hints, &address)) {
 		return -1;
 	}
 
-	// Iterate over the list of addresses
-	int fd = -1;
-	for (struct addrinfo *iter = address; iter; iter = iter->ai_next) {
-		if (-1 == (fd = socket(iter->ai_family, iter->ai_socktype, address->ai_protocol))) {
-			perror("socket");
+	// Alternate the families, starting with the one getaddrinfo prefers (RFC 8305 section 4)
+	int count = 0;
+	int first_family = address->ai_family;
+	struct addrinfo *next[2] = { address, address };
+	for (int turn = 0; count < max && (next[0] || next[1]); turn = !turn) {
+		struct addrinfo *iter = next[turn];
+		while (iter && (iter->ai_family == first_family) != (turn == 0)) {
+			iter = iter->ai_next;
+		}
+		if (!iter) {
+			next[turn] = NULL;
 			continue;
 		}
-		if (-1 == connect(fd, address->ai_addr, address->ai_addrlen)) {
-			perror("connect");
-			socket_close(&fd);
-			fd = -1;
+		next[turn] = iter->ai_next;
+		if (iter->ai_addrlen > sizeof addresses[count].address) {
+			continue;
 		}
-		// Success
-		break;
+		addresses[count].socktype = iter->ai_socktype;
+		addresses[count].length = iter->ai_addrlen;
+		memcpy(&addresses[count].address, iter->ai_addr, iter->ai_addrlen);
+		++count;
 	}
 	freeaddrinfo(address);
+	return count;
+}
 
+static int64_t socket_now_ms(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (int64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// Start a non-blocking connect. Returns the descriptor, with *done set if it
+// connected at once, or -1 with errno set if the attempt failed. A failed
+// attempt is not logged; the next address may well work.
+static int socket_connect_start(const SocketAddress *address, bool *done) {
+	int fd = socket(address->address.ss_family, address->socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd == -1) {
+		return -1;
+	}
+	*done = connect(fd, (const struct sockaddr *) &address->address, address->length) == 0;
+	if (!*done && errno != EINPROGRESS) {
+		int error = errno;
+		socket_close(&fd);
+		errno = error;
+	}
 	return fd;
 }
 
+int socket_connect_addresses(const SocketAddress *addresses, int count) {
+	struct pollfd attempts[SOCKET_RESOLVE_MAX];
+	int pending = 0;
+	int next = 0;
+	int winner = -1;
+	int error = ETIMEDOUT;
+	int64_t now = socket_now_ms();
+	int64_t deadline = now + SOCKET_CONNECT_TIMEOUT_MS;
+	int64_t next_start = now;
+
+	if (count > SOCKET_RESOLVE_MAX) {
+		count = SOCKET_RESOLVE_MAX;
+	}
+	// Start the attempts one delay apart, or at once when the others have
+	// failed, and take the first that connects
+	while (winner == -1 && now < deadline && (pending > 0 || next < count)) {
+		if (next < count && (now >= next_start || pending == 0)) {
+			bool done = false;
+			int fd = socket_connect_start(&addresses[next++], &done);
+			if (done) {
+				winner = fd;
+				break;
+			}
+			if (fd == -1) {
+				error = errno;
+				continue;
+			}
+			attempts[pending++] = (struct pollfd) { fd, POLLOUT, 0 };
+			next_start = now + SOCKET_CONNECT_DELAY_MS;
+		}
+
+		int64_t until = next < count && next_start < deadline ? next_start : deadline;
+		int r = poll(attempts, pending, until > now ? (int) (until - now) : 0);
+		if (r == -1 && errno != EINTR) {
+			error = errno;
+			break;
+		}
+		for (int i = 0; r > 0 && i < pending; ++i) {
+			if (!attempts[i].revents) {
+				continue;
+			}
+			int result = 0;
+			socklen_t length = sizeof(result);
+			if (getsockopt(attempts[i].fd, SOL_SOCKET, SO_ERROR, &result, &length) == 0 && result == 0) {
+				winner = attempts[i].fd;
+				attempts[i] = attempts[--pending];
+				break;
+			}
+			error = result ? result : errno;
+			socket_close(&attempts[i].fd);
+			attempts[i--] = attempts[--pending];
+			next_start = now; // Fail over without waiting out the delay
+		}
+		now = socket_now_ms();
+	}
+
+	// Cancel the losers
+	for (int i = 0; i < pending; ++i) {
+		socket_close(&attempts[i].fd);
+	}
+	if (winner == -1) {
+		VERBOSE("Could not connect: %s", strerror(error));
+		errno = error;
+		return -1;
+	}
+	int flags = fcntl(winner, F_GETFL);
+	if (flags == -1 || fcntl(winner, F_SETFL, flags & ~O_NONBLOCK) == -1) {
+		socket_close(&winner);
+	}
+	return winner;
+}
+
+// Common functionality to all protocols
+static int socket_connect(const char *hostname, const char *port, int socktype) {
+	SocketAddress addresses[SOCKET_RESOLVE_MAX];
+	int count = socket_resolve(hostname, port, socktype, addresses, SOCKET_RESOLVE_MAX);
+	return count > 0 ? socket_connect_addresses(addresses, count) : -1;
+}
+
 int socket_udp_connect(const char *hostname, const char *port) {
 	return socket_connect(hostname, port, SOCK_DGRAM);
 }
@@ -81,12 +205,55 @@ int socket_tcp_connect(const char *hostname, const char *port) {
 	return socket_connect(hostname, port, SOCK_STREAM);
 }
 
+void socket_options_default(SocketOptions *options) {
+	options->backlog = SOCKET_DEFAULT_BACKLOG;
+	options->reuse_port = false;
+	options->incoming_cpu = -1;
+	options->defer_accept = 0;
+	options->fastopen = 0;
+	options->nodelay = false;
+	options->send_buffer = 0;
+	options->receive_buffer = 0;
+	options->notsent_lowat = 0;
+	options->busy_poll = 0;
+	options->user_timeout = 0;
+}
+
+// Set an integer socket option unless it is 0, reporting failures
+static int socket_set_int(int fd, int level, int name, int value, const char *description) {
+	if (value == 0 || 0 == setsockopt(fd, level, name, &value, sizeof(value))) {
+		return 0;
+	}
+	perror(description);
+	return -1;
+}
+
+int socket_tcp_tune(int fd, const SocketOptions *options) {
+	int r = 0;
+	r |= socket_set_int(fd, IPPROTO_TCP, TCP_NODELAY, options->nodelay, "setsockopt TCP_NODELAY");
+	r |= socket_set_int(fd, SOL_SOCKET, SO_SNDBUF, options->send_buffer, "setsockopt SO_SNDBUF");
+	r |= socket_set_int(fd, SOL_SOCKET, SO_RCVBUF, options->receive_buffer, "setsockopt SO_RCVBUF");
+	r |= socket_set_int(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, options->notsent_lowat, "setsockopt TCP_NOTSENT_LOWAT");
+	r |= socket_set_int(fd, SOL_SOCKET, SO_BUSY_POLL, options->busy_poll, "setsockopt SO_BUSY_POLL");
+	r |= socket_set_int(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, options->user_timeout, "setsockopt TCP_USER_TIMEOUT");
+	return r;
+}
+
 int socket_tcp_listen(const char *hostname, const char *port) {
+	return socket_tcp_listen_with(hostname, port, NULL);
+}
+
+int socket_tcp_listen_with(const char *hostname, const char *port, const SocketOptions *options) {
 	// NULL port / service name is not accepted.
 	// NULL hostname is OK. (== bind to any interface)
 	if (!port) {
 		return -1;
 	}
+	SocketOptions defaults;
+	if (!options) {
+		socket_options_default(&defaults);
+		options = &defaults;
+	}
 
 	struct addrinfo *address, hints;
 	memset(&hints, 0, sizeof(hints));
@@ -110,12 +277,28 @@ int socket_tcp_listen(const char *hostname, const char *port) {
 			socket_close(&fd);
 			continue;
 		}
+		if (options->reuse_port &&
+			-1 == setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes))) {
+			perror("setsockopt SO_REUSEPORT");
+			socket_close(&fd);
+			continue;
+		}
+		// Only a hint to the kernel, failure is not fatal
+		if (options->incoming_cpu >= 0 &&
+			-1 == setsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &options->incoming_cpu, sizeof(options->incoming_cpu))) {
+			perror("setsockopt SO_INCOMING_CPU");
+		}
+		// Also only hints. Buffer sizes must be set before listen to affect the
+		// window scale offered in the handshake.
+		socket_set_int(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, options->defer_accept, "setsockopt TCP_DEFER_ACCEPT");
+		socket_set_int(fd, IPPROTO_TCP, TCP_FASTOPEN, options->fastopen, "setsockopt TCP_FASTOPEN");
+		socket_tcp_tune(fd, options);
 		if (-1 == bind(fd, iter->ai_addr, iter->ai_addrlen)) {
 			perror("bind");
 			socket_close(&fd);
 			continue;
 		}
-		if (-1 == listen(fd, 128)) {
+		if (-1 == listen(fd, options->backlog)) {
 			perror("listen");
 			socket_close(&fd);
 		}
@@ -127,6 +310,22 @@ int socket_tcp_listen(const char *hostname, const char *port) {
 	return fd;
 }
 
+int socket_set_nonblocking(int fd) {
+	int flags = fcntl(fd, F_GETFL);
+	if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+		return -1;
+	}
+	return 0;
+}
+
+// Wait until a non-blocking descriptor is ready for the given poll events
+static int socket_wait(int fd, short events) {
+	struct pollfd pfd = { fd, events, 0 };
+	int r;
+	while (-1 == (r = poll(&pfd, 1, -1)) && errno == EINTR);
+	return r == -1 ? -1 : 0;
+}
+
 ssize_t socket_read(int fd, void *buf, size_t count) {
 	// Prevent UB
 	if (fd < 0 || buf == NULL || count > SSIZE_MAX) {
@@ -134,8 +333,17 @@ ssize_t socket_read(int fd, void *buf, size_t count) {
 	}
 
 	char *buffer = buf;
-	// TODO better return value checking
-	return read(fd, buffer, count);
+	for (;;) {
+		ssize_t r = read(fd, buffer, count);
+		if (r == -1) {
+			if (errno == EINTR) {
+				continue;
+			} else if ((errno == EAGAIN || errno == EWOULDBLOCK) && socket_wait(fd, POLLIN) == 0) {
+				continue;
+			}
+		}
+		return r;
+	}
 }
 
 ssize_t socket_write(int fd, const void *buf, size_t count) {
@@ -147,8 +355,8 @@ ssize_t socket_write(int fd, const void *buf, size_t count) {
 		if (written_now == -1) {
 			if (errno == EINTR) {
 				continue;
-			} else if (errno == EAGAIN || errno == EWOULDBLOCK) {
-				return written_total;
+			} else if ((errno == EAGAIN || errno == EWOULDBLOCK) && socket_wait(fd, POLLOUT) == 0) {
+				continue;
 			}
 			else {
 				return -1;
@@ -160,3 +368,131 @@ ssize_t socket_write(int fd, const void *buf, size_t count) {
 	}
 	return written_total;
 }
+
+ssize_t socket_send(int fd, const void *buf, size_t count, int flags) {
+	const char *buffer = buf;
+	size_t sent_total = 0;
+	while (count > 0) {
+		ssize_t sent_now = send(fd, buffer, count, flags);
+		if (sent_now == -1) {
+			if (errno == EINTR) {
+				continue;
+			} else if ((errno == EAGAIN || errno == EWOULDBLOCK) && socket_wait(fd, POLLOUT) == 0) {
+				continue;
+			}
+			return -1;
+		}
+		buffer += sent_now;
+		count -= sent_now;
+		sent_total += sent_now;
+	}
+	return sent_total;
+}
+
+ssize_t socket_writev(int fd, struct iovec *iov, int iovcnt) {
+	size_t written_total = 0;
+	while (iovcnt > 0) {
+		ssize_t written_now = writev(fd, iov, iovcnt < IOV_MAX ? iovcnt : IOV_MAX);
+		if (written_now == -1) {
+			if (errno == EINTR) {
+				continue;
+			} else if ((errno == EAGAIN || errno == EWOULDBLOCK) && socket_wait(fd, POLLOUT) == 0) {
+				continue;
+			}
+			else {
+				return -1;
+			}
+		}
+		written_total += written_now;
+
+		// Skip the buffers that were written in full and trim a partial one
+		while (iovcnt > 0 && (size_t) written_now >= iov->iov_len) {
+			written_now -= iov->iov_len;
+			++iov;
+			--iovcnt;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *) iov->iov_base + written_now;
+			iov->iov_len -= written_now;
+		}
+	}
+	return written_total;
+}
+
+ssize_t socket_splice(int socket, int pipe[2], int file, size_t count) {
+	ssize_t moved;
+	for (;;) {
+		moved = splice(socket, NULL, pipe[1], NULL, count, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (moved == -1) {
+			if (errno == EINTR) {
+				continue;
+			} else if ((errno == EAGAIN || errno == EWOULDBLOCK) && socket_wait(socket, POLLIN) == 0) {
+				continue;
+			}
+			return -1;
+		}
+		break;
+	}
+
+	// Drain the pipe into the file
+	ssize_t remaining = moved;
+	while (remaining > 0) {
+		ssize_t written = splice(pipe[0], NULL, file, NULL, remaining, SPLICE_F_MOVE);
+		if (written == -1 && errno == EINTR) {
+			continue;
+		}
+		if (written <= 0) {
+			return -1;
+		}
+		remaining -= written;
+	}
+	return moved;
+}
+
+// Copy a file range through a buffer, for files sendfile does not support
+static ssize_t socket_copy_file(int socket, int file, off_t offset, size_t count) {
+	char buffer[8192];
+	size_t sent_total = 0;
+	while (count > 0) {
+		ssize_t bytes_read = pread(file, buffer, count < sizeof buffer ? count : sizeof buffer, offset);
+		if (bytes_read == -1 && errno == EINTR) {
+			continue;
+		}
+		if (bytes_read == -1) {
+			return -1;
+		}
+		if (bytes_read == 0) {
+			break;
+		}
+		if (socket_write(socket, buffer, bytes_read) < 0) {
+			return -1;
+		}
+		offset += bytes_read;
+		count -= bytes_read;
+		sent_total += bytes_read;
+	}
+	return sent_total;
+}
+
+ssize_t socket_sendfile(int socket, int file, off_t offset, size_t count) {
+	size_t sent_total = 0;
+	while (count > 0) {
+		ssize_t sent_now = sendfile(socket, file, &offset, count);
+		if (sent_now == -1) {
+			if (errno == EINTR) {
+				continue;
+			} else if ((errno == EAGAIN || errno == EWOULDBLOCK) && socket_wait(socket, POLLOUT) == 0) {
+				continue;
+			} else if ((errno == EINVAL || errno == ENOSYS) && sent_total == 0) {
+				return socket_copy_file(socket, file, offset, count);
+			}
+			return -1;
+		}
+		if (sent_now == 0) {
+			break; // The file is shorter than expected
+		}
+		count -= sent_now;
+		sent_total += sent_now;
+	}
+	return sent_total;
+}
@@ -5,7 +5,11 @@
  * Contains socket and file descriptor related helper and wrapper functionality
  */
 
+#include <stdbool.h>
 #include <stddef.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 /**
@@ -16,6 +20,43 @@
  */
 int socket_close(int *fd);
 
+#define SOCKET_RESOLVE_MAX 8
+#define SOCKET_CONNECT_DELAY_MS 250 // Head start of each connection attempt over the next (RFC 8305)
+#define SOCKET_CONNECT_TIMEOUT_MS 10000
+
+/**
+ * A resolved address of a remote host, as copied out of getaddrinfo.
+ */
+typedef struct {
+	struct sockaddr_storage address;
+	socklen_t length;
+	int socktype;
+} SocketAddress;
+
+/**
+ * Resolve the addresses of an IPv4/IPv6 host.
+ * @param hostname Host name to resolve.
+ * @param port Port or service name.
+ * @param socktype SOCK_STREAM or SOCK_DGRAM.
+ * @param addresses Array to fill in. IPv6 and IPv4 addresses alternate, starting
+ * with the family getaddrinfo prefers.
+ * @param max Size of the array.
+ * @return Number of addresses, -1 if the name could not be resolved.
+ */
+int socket_resolve(const char *hostname, const char *port, int socktype, SocketAddress *addresses, int max);
+
+/**
+ * Connect to one of the given addresses, racing them Happy Eyeballs style: the
+ * attempts are started in order SOCKET_CONNECT_DELAY_MS apart, or as soon as
+ * the previous ones have failed, and the first to connect wins. The others are
+ * cancelled. Gives up after SOCKET_CONNECT_TIMEOUT_MS.
+ * @param addresses Addresses from socket_resolve.
+ * @param count Number of addresses.
+ * @return A blocking file descriptor on success, -1 on failure (with errno set
+ * by the last failed attempt, or ETIMEDOUT).
+ */
+int socket_connect_addresses(const SocketAddress *addresses, int count);
+
 /**
  * Connect to a TCP IPv4/IPv6 host.
  * @param hostname Host name to connect to.
@@ -24,6 +65,44 @@ int socket_close(int *fd);
  */
 int socket_tcp_connect(const char *hostname, const char *port);
 
+#define SOCKET_DEFAULT_BACKLOG 128
+
+/**
+ * Options for listening sockets
+ */
+typedef struct {
+	int backlog; // Length of the accept queue
+	bool reuse_port; // Allow several sockets to bind the same port (SO_REUSEPORT)
+	int incoming_cpu; // Prefer connections handled by this CPU (SO_INCOMING_CPU), -1 for any
+	int defer_accept; // Seconds to wait for the first data before accepting (TCP_DEFER_ACCEPT), 0 for none
+	int fastopen; // Pending TCP Fast Open requests allowed (TCP_FASTOPEN), 0 to disable
+
+	// Connection tunables, see socket_tcp_tune. 0 leaves the kernel default.
+	bool nodelay; // Send small segments at once (TCP_NODELAY)
+	int send_buffer; // Bytes (SO_SNDBUF)
+	int receive_buffer; // Bytes (SO_RCVBUF)
+	int notsent_lowat; // Unsent bytes above which the socket is not writable (TCP_NOTSENT_LOWAT)
+	int busy_poll; // Microseconds to busy poll the device on blocking reads (SO_BUSY_POLL)
+	int user_timeout; // Milliseconds sent data may stay unacknowledged (TCP_USER_TIMEOUT)
+} SocketOptions;
+
+/**
+ * Fill in the default listening socket options.
+ * @param options Options to initialize.
+ */
+void socket_options_default(SocketOptions *options);
+
+/**
+ * Apply the connection tunables of the options to a TCP socket. Failures are
+ * reported but leave the socket usable. Sockets accepted from a listening socket
+ * inherit its tunables, so socket_tcp_listen_with sets them on the listening
+ * socket once rather than on every connection.
+ * @param fd Socket to tune.
+ * @param options Options to apply. Those with a zero value are left alone.
+ * @return 0 on success, -1 if any option could not be set.
+ */
+int socket_tcp_tune(int fd, const SocketOptions *options);
+
 /**
  * Listen on a TCP IPv4/IPv6 socket.
  * @param hostname Host name to bind to. NULL to bind to all interfaces.
@@ -32,6 +111,15 @@ int socket_tcp_connect(const char *hostname, const char *port);
  */
 int socket_tcp_listen(const char *hostname, const char *port);
 
+/**
+ * Listen on a TCP IPv4/IPv6 socket with the given options.
+ * @param hostname Host name to bind to. NULL to bind to all interfaces.
+ * @param port Port or service name to listen on.
+ * @param options Socket options. NULL for defaults.
+ * @return A file descriptor on success, -1 on failure (with appropriate errno set).
+ */
+int socket_tcp_listen_with(const char *hostname, const char *port, const SocketOptions *options);
+
 /**
  * Get a socket bound to a remote UDP IPv4/IPv6 host.
  * NB: UDP is not connection oriented, but POSIX binding refers to local endpoint...
@@ -42,7 +130,15 @@ int socket_tcp_listen(const char *hostname, const char *port);
 int socket_udp_connect(const char *hostname, const char *port);
 
 /**
- * Write to a socket, retrying on EINTR. See man 2 write.
+ * Put a file descriptor in non-blocking mode.
+ * @param fd File descriptor to modify.
+ * @return 0 on success, -1 on failure.
+ */
+int socket_set_nonblocking(int fd);
+
+/**
+ * Read from a socket, retrying on EINTR. See man 2 read.
+ * A non-blocking socket is waited on until data or end of file is available.
  * @param fd File descriptor to read from.
  * @param buf Buffer whose contents to write.
  * @param count Number of bytes to write.
@@ -51,10 +147,52 @@ ssize_t socket_read(int fd, void *buf, size_t count);
 
 /**
  * Write to a socket, retrying on EINTR. See man 2 write.
+ * A non-blocking socket is waited on until everything has been written.
  * @param fd File descriptor to write to.
  * @param buf Buffer whose contents to write.
  * @param count Number of bytes to write.
  */
 ssize_t socket_write(int fd, const void *buf, size_t count);
 
+/**
+ * Send to a socket with flags, retrying on EINTR. See man 2 send.
+ * A non-blocking socket is waited on until everything has been sent.
+ * @param flags For example MSG_MORE to hold the bytes back until the next send.
+ * @return Number of bytes sent, -1 on failure.
+ */
+ssize_t socket_send(int fd, const void *buf, size_t count, int flags);
+
+/**
+ * Gather write to a socket, retrying on EINTR and on partial writes. See man 2 writev.
+ * The vector is consumed: entries are advanced past the bytes that were written.
+ * @param fd File descriptor to write to.
+ * @param iov Array of buffers to write, in order.
+ * @param iovcnt Number of entries in iov. May exceed IOV_MAX.
+ * @return Number of bytes written, -1 on failure.
+ */
+ssize_t socket_writev(int fd, struct iovec *iov, int iovcnt);
+
+/**
+ * Move bytes from a socket to a file through a pipe with splice, without copying
+ * them through user space. A non-blocking socket is waited on until data is available.
+ * Everything taken from the socket is written to the file before returning.
+ * @param socket Socket to read from.
+ * @param pipe Empty pipe to move the bytes through, read end first.
+ * @param file File to write to, at its current offset.
+ * @param count Maximum number of bytes to move. At most the pipe size is moved at once.
+ * @return Number of bytes moved, 0 on end of file, -1 on failure. errno is EINVAL if
+ * the socket or file does not support splicing and nothing was moved.
+ */
+ssize_t socket_splice(int socket, int pipe[2], int file, size_t count);
+
+/**
+ * Send part of a file to a socket with sendfile, without copying it through user
+ * space. Falls back to reading and writing if the file does not support it.
+ * A non-blocking socket is waited on until everything has been sent.
+ * @param offset Position in the file to start from. The file offset is not changed.
+ * @param count Number of bytes to send.
+ * @return Number of bytes sent, less than count if the file ended, -1 on failure.
+ */
+ssize_t socket_sendfile(int socket, int file, off_t offset, size_t count);
+
 #endif
@@ -0,0 +1,191 @@
+#include "common.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "timer.h"
+#include "util.h"
+
+// Four levels of 64 slots. Level n holds timers expiring in less than 64^(n+1) ticks
+// and is cascaded down one level each time the level below it wraps around.
+#define TIMER_LEVELS 4
+#define TIMER_SLOT_BITS 6
+#define TIMER_SLOTS (1 << TIMER_SLOT_BITS)
+#define TIMER_SLOT_MASK (TIMER_SLOTS - 1)
+#define TIMER_MAX_TICKS ((uint64_t) 1 << (TIMER_LEVELS * TIMER_SLOT_BITS))
+
+static struct {
+	pthread_mutex_t lock;
+	Timer slots[TIMER_LEVELS][TIMER_SLOTS]; // List heads
+	uint64_t now; // Ticks processed so far
+	unsigned tick_ms;
+	struct timespec start;
+	pthread_t thread;
+	bool running;
+	bool stopping;
+} wheel = { .lock = PTHREAD_MUTEX_INITIALIZER, .tick_ms = 1 };
+
+static inline bool timer_armed(const Timer *timer) {
+	return timer->next != NULL;
+}
+
+static void timer_unlink(Timer *timer) {
+	timer->prev->next = timer->next;
+	timer->next->prev = timer->prev;
+	timer->next = timer->prev = NULL;
+}
+
+static void timer_link(Timer *timer) {
+	uint64_t delta = timer->expires - wheel.now;
+	if (delta >= TIMER_MAX_TICKS) {
+		// Further than the wheel reaches; fire at the far end instead
+		delta = TIMER_MAX_TICKS - 1;
+		timer->expires = wheel.now + delta;
+	}
+	int level = 0;
+	while (delta >= (uint64_t) 1 << ((level + 1) * TIMER_SLOT_BITS)) {
+		++level;
+	}
+	Timer *head = &wheel.slots[level][(timer->expires >> (level * TIMER_SLOT_BITS)) & TIMER_SLOT_MASK];
+	timer->next = head;
+	timer->prev = head->prev;
+	head->prev->next = timer;
+	head->prev = timer;
+}
+
+// Move the timers of a slot to the levels below
+static void timer_cascade(int level, unsigned slot) {
+	Timer *head = &wheel.slots[level][slot];
+	Timer list = *head;
+	if (list.next == head) {
+		return;
+	}
+	list.next->prev = &list;
+	list.prev->next = &list;
+	head->next = head->prev = head;
+	while (list.next != &list) {
+		Timer *timer = list.next;
+		timer_unlink(timer);
+		timer_link(timer);
+	}
+}
+
+// Advance the wheel by one tick and run the timers expiring on it
+static void timer_tick(void) {
+	++wheel.now;
+	for (int level = 1; level < TIMER_LEVELS; ++level) {
+		if (wheel.now & (((uint64_t) 1 << (level * TIMER_SLOT_BITS)) - 1)) {
+			break;
+		}
+		timer_cascade(level, (wheel.now >> (level * TIMER_SLOT_BITS)) & TIMER_SLOT_MASK);
+	}
+
+	Timer *head = &wheel.slots[0][wheel.now & TIMER_SLOT_MASK];
+	while (head->next != head) {
+		Timer *timer = head->next;
+		timer_unlink(timer);
+		unsigned again = timer->callback(timer);
+		if (again) {
+			timer->expires = wheel.now + (again + wheel.tick_ms - 1) / wheel.tick_ms;
+			timer_link(timer);
+		}
+	}
+}
+
+static uint64_t timer_elapsed_ticks(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	uint64_t ms = (uint64_t) (now.tv_sec - wheel.start.tv_sec) * 1000 +
+		(now.tv_nsec - wheel.start.tv_nsec) / 1000000;
+	return ms / wheel.tick_ms;
+}
+
+static void *timer_thread(void *args) {
+	(void) args;
+	struct timespec next = wheel.start;
+
+	pthread_mutex_lock(&wheel.lock);
+	while (!wheel.stopping) {
+		pthread_mutex_unlock(&wheel.lock);
+		next.tv_nsec += (long) wheel.tick_ms * 1000000;
+		while (next.tv_nsec >= 1000000000) {
+			next.tv_nsec -= 1000000000;
+			++next.tv_sec;
+		}
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) != 0);
+
+		// Catch up if the thread was not scheduled in time
+		pthread_mutex_lock(&wheel.lock);
+		uint64_t target = timer_elapsed_ticks();
+		while (wheel.now < target) {
+			timer_tick();
+		}
+	}
+	pthread_mutex_unlock(&wheel.lock);
+	return NULL;
+}
+
+int timer_start(unsigned tick_ms) {
+	pthread_mutex_lock(&wheel.lock);
+	for (int level = 0; level < TIMER_LEVELS; ++level) {
+		for (int slot = 0; slot < TIMER_SLOTS; ++slot) {
+			wheel.slots[level][slot].next = wheel.slots[level][slot].prev = &wheel.slots[level][slot];
+		}
+	}
+	wheel.now = 0;
+	wheel.tick_ms = tick_ms > 0 ? tick_ms : 1;
+	wheel.stopping = false;
+	clock_gettime(CLOCK_MONOTONIC, &wheel.start);
+	pthread_mutex_unlock(&wheel.lock);
+
+	int r = pthread_create(&wheel.thread, NULL, timer_thread, NULL);
+	if (r) {
+		VERBOSE("Could not start the timer thread: %s", strerror(r));
+		return -1;
+	}
+	wheel.running = true;
+	return 0;
+}
+
+void timer_stop(void) {
+	if (!wheel.running) {
+		return;
+	}
+	pthread_mutex_lock(&wheel.lock);
+	wheel.stopping = true;
+	pthread_mutex_unlock(&wheel.lock);
+	pthread_join(wheel.thread, NULL);
+	wheel.running = false;
+}
+
+void timer_init(Timer *timer, TimerCallback callback) {
+	timer->next = timer->prev = NULL;
+	timer->expires = 0;
+	timer->callback = callback;
+}
+
+void timer_arm(Timer *timer, unsigned timeout_ms) {
+	if (!wheel.running) {
+		return;
+	}
+	pthread_mutex_lock(&wheel.lock);
+	if (timer_armed(timer)) {
+		timer_unlink(timer);
+	}
+	uint64_t ticks = (timeout_ms + wheel.tick_ms - 1) / wheel.tick_ms;
+	timer->expires = wheel.now + (ticks > 0 ? ticks : 1);
+	timer_link(timer);
+	pthread_mutex_unlock(&wheel.lock);
+}
+
+void timer_cancel(Timer *timer) {
+	// Callbacks run with the lock held, so taking it also waits out a running one
+	pthread_mutex_lock(&wheel.lock);
+	if (timer_armed(timer)) {
+		timer_unlink(timer);
+	}
+	pthread_mutex_unlock(&wheel.lock);
+}
@@ -0,0 +1,61 @@
+#ifndef TIMER_H_
+#define TIMER_H_
+/**
+ * Timer module
+ * A hierarchical timer wheel driven by one background thread. Arming and
+ * cancelling a timer is O(1) and needs no system call, so it can be done
+ * several times per request. Expired timers run their callback on the timer
+ * thread; callbacks must be short and must not block.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct Timer Timer;
+
+/**
+ * Called when a timer expires, with the wheel locked.
+ * @return Milliseconds after which to run the callback again, 0 to leave the timer disarmed.
+ */
+typedef unsigned (*TimerCallback)(Timer *timer);
+
+/**
+ * A timer entry. Embed it in the object it times and initialize it with timer_init.
+ */
+struct Timer {
+	Timer *next;
+	Timer *prev;
+	uint64_t expires; // Tick the timer expires on
+	TimerCallback callback;
+};
+
+/**
+ * Start the timer thread.
+ * @param tick_ms Resolution of the wheel in milliseconds.
+ * @return 0 on success, -1 if the thread could not be started.
+ */
+int timer_start(unsigned tick_ms);
+
+/**
+ * Stop the timer thread. Armed timers are left alone and never fire.
+ */
+void timer_stop(void);
+
+/**
+ * Initialize a disarmed timer.
+ */
+void timer_init(Timer *timer, TimerCallback callback);
+
+/**
+ * Arm a timer, or move an armed one to a new expiry time.
+ * @param timeout_ms Milliseconds from now. Rounded up to the next tick.
+ */
+void timer_arm(Timer *timer, unsigned timeout_ms);
+
+/**
+ * Disarm a timer. When this returns the callback is not running and will not run
+ * until the timer is armed again, so the object holding the timer can be freed.
+ */
+void timer_cancel(Timer *timer);
+
+#endif
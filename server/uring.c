@@ -0,0 +1,253 @@
+#include "common.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "socket.h"
+#include "uring.h"
+
+#define URING_SEND_FILE_CHAINS 8 // read -> send pairs per submission
+#define URING_SEND_FILE_BLOCK 65536
+#define URING_PROBE_OPS 256
+
+int uring_init(Uring *ring, unsigned entries) {
+	memset(ring, 0, sizeof(*ring));
+	ring->fd = -1;
+
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	int fd = syscall(SYS_io_uring_setup, entries, &params);
+	if (fd == -1) {
+		return -1;
+	}
+	ring->fd = fd;
+	ring->features = params.features;
+
+	// Map the rings. With IORING_FEAT_SINGLE_MMAP one mapping holds both.
+	ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (ring->features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_size > ring->sq_ring_size) {
+			ring->sq_ring_size = ring->cq_ring_size;
+		}
+		ring->cq_ring_size = ring->sq_ring_size;
+	}
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED) {
+		ring->sq_ring = NULL;
+		uring_destroy(ring);
+		return -1;
+	}
+	if (ring->features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ring = ring->sq_ring;
+	} else {
+		ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		if (ring->cq_ring == MAP_FAILED) {
+			ring->cq_ring = NULL;
+			uring_destroy(ring);
+			return -1;
+		}
+	}
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		ring->sqes = NULL;
+		uring_destroy(ring);
+		return -1;
+	}
+
+	char *sq = ring->sq_ring;
+	ring->sq_head = (unsigned *) (sq + params.sq_off.head);
+	ring->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+	ring->sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned *) (sq + params.sq_off.array);
+	ring->sq_pending_tail = *ring->sq_tail;
+
+	char *cq = ring->cq_ring;
+	ring->cq_head = (unsigned *) (cq + params.cq_off.head);
+	ring->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+	ring->cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+	return 0;
+}
+
+void uring_destroy(Uring *ring) {
+	if (ring->sqes) {
+		munmap(ring->sqes, ring->sqes_size);
+	}
+	if (ring->cq_ring && ring->cq_ring != ring->sq_ring) {
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	}
+	if (ring->sq_ring) {
+		munmap(ring->sq_ring, ring->sq_ring_size);
+	}
+	socket_close(&ring->fd);
+	memset(ring, 0, sizeof(*ring));
+	ring->fd = -1;
+}
+
+bool uring_supports(Uring *ring, int opcode) {
+	size_t size = sizeof(struct io_uring_probe) + URING_PROBE_OPS * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe *probe = calloc(1, size);
+	if (!probe) {
+		return false;
+	}
+	bool supported = false;
+	if (syscall(SYS_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, URING_PROBE_OPS) == 0) {
+		supported = opcode <= probe->last_op &&
+			(probe->ops[opcode].flags & IO_URING_OP_SUPPORTED);
+	}
+	free(probe);
+	return supported;
+}
+
+struct io_uring_sqe *uring_get_sqe(Uring *ring) {
+	unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	if (ring->sq_pending_tail - head > *ring->sq_mask) {
+		return NULL;
+	}
+	unsigned index = ring->sq_pending_tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[index];
+	ring->sq_array[index] = index;
+	++ring->sq_pending_tail;
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+unsigned uring_sq_space(Uring *ring) {
+	unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	return *ring->sq_mask + 1 - (ring->sq_pending_tail - head);
+}
+
+int uring_submit(Uring *ring, unsigned wait_nr) {
+	__atomic_store_n(ring->sq_tail, ring->sq_pending_tail, __ATOMIC_RELEASE);
+	for (;;) {
+		unsigned to_submit = ring->sq_pending_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+		int r = syscall(SYS_io_uring_enter, ring->fd, to_submit, wait_nr,
+			wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+		if (r == -1 && errno == EINTR) {
+			continue;
+		}
+		if (r == -1) {
+			// Without SQPOLL the kernel reads SQEs only inside io_uring_enter,
+			// so entries it did not consume can be taken back.
+			unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+			__atomic_store_n(ring->sq_tail, head, __ATOMIC_RELEASE);
+			ring->sq_pending_tail = head;
+		}
+		return r;
+	}
+}
+
+struct io_uring_cqe *uring_peek_cqe(Uring *ring) {
+	unsigned head = *ring->cq_head;
+	if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+		return NULL;
+	}
+	return &ring->cqes[head & *ring->cq_mask];
+}
+
+void uring_cqe_seen(Uring *ring) {
+	__atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+ssize_t uring_send_file(Uring *ring, int socket, int file, off_t offset, size_t count) {
+	char *buffers = malloc(URING_SEND_FILE_CHAINS * URING_SEND_FILE_BLOCK);
+	if (!buffers) {
+		return -1;
+	}
+
+	size_t sent = 0;
+	bool interrupted = false;
+	while (sent < count && !interrupted) {
+		// One batch: read block 0 -> send block 0 -> read block 1 -> ...
+		// linked into a single chain, so a failure cancels the rest.
+		size_t lengths[URING_SEND_FILE_CHAINS];
+		int send_results[URING_SEND_FILE_CHAINS];
+		unsigned chains = 0;
+		size_t queued = 0;
+		struct io_uring_sqe *send = NULL;
+		while (chains < URING_SEND_FILE_CHAINS && sent + queued < count) {
+			struct io_uring_sqe *read = uring_get_sqe(ring);
+			if (!read || !(send = uring_get_sqe(ring))) {
+				// Ring too small, does not happen with the sizes we use
+				free(buffers);
+				return sent > 0 ? (ssize_t) sent : -1;
+			}
+			char *buffer = buffers + chains * URING_SEND_FILE_BLOCK;
+			size_t length = count - sent - queued;
+			if (length > URING_SEND_FILE_BLOCK) {
+				length = URING_SEND_FILE_BLOCK;
+			}
+
+			read->opcode = IORING_OP_READ;
+			read->fd = file;
+			read->addr = (uintptr_t) buffer;
+			read->len = length;
+			read->off = offset + sent + queued;
+			read->flags = IOSQE_IO_LINK;
+			read->user_data = chains * 2;
+
+			send->opcode = IORING_OP_SEND;
+			send->fd = socket;
+			send->addr = (uintptr_t) buffer;
+			send->len = length;
+			send->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+			send->flags = IOSQE_IO_LINK;
+			send->user_data = chains * 2 + 1;
+
+			lengths[chains] = length;
+			send_results[chains] = -ECANCELED;
+			queued += length;
+			++chains;
+		}
+		send->flags &= ~IOSQE_IO_LINK;
+
+		if (uring_submit(ring, chains * 2) == -1) {
+			break;
+		}
+
+		// Collect every completion of the batch before reusing the buffers
+		unsigned completions = 0;
+		while (completions < chains * 2) {
+			struct io_uring_cqe *cqe = uring_peek_cqe(ring);
+			if (!cqe) {
+				if (uring_submit(ring, 1) == -1) {
+					// The kernel may still be using the buffers: leak them
+					// rather than risk a use after free.
+					return -1;
+				}
+				continue;
+			}
+			if (cqe->user_data % 2 == 1) {
+				send_results[cqe->user_data / 2] = cqe->res;
+			}
+			uring_cqe_seen(ring);
+			++completions;
+		}
+
+		// Count the bytes that made it out in order
+		for (unsigned i = 0; i < chains; ++i) {
+			if (send_results[i] > 0) {
+				sent += send_results[i];
+			}
+			if (send_results[i] != (int) lengths[i]) {
+				interrupted = true;
+				break;
+			}
+		}
+	}
+
+	free(buffers);
+	return sent > 0 || !interrupted ? (ssize_t) sent : -1;
+}
@@ -0,0 +1,104 @@
+#ifndef URING_H_
+#define URING_H_
+/**
+ * io_uring module
+ * A minimal wrapper over the raw io_uring system calls: ring setup, SQE
+ * allocation, batched submission and CQE reaping. Also contains I/O helpers
+ * built on top of it.
+ */
+
+#include "common.h"
+
+#include <linux/io_uring.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+typedef struct {
+	int fd;
+	unsigned features;
+
+	// Submission queue
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned sq_pending_tail; // SQEs prepared but not yet made visible to the kernel
+
+	// Completion queue
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	size_t sqes_size;
+} Uring;
+
+/**
+ * Set up a ring.
+ * @param ring Ring to initialize.
+ * @param entries Submission queue size.
+ * @return 0 on success, -1 if io_uring is not available (with errno set).
+ */
+int uring_init(Uring *ring, unsigned entries);
+
+/**
+ * Tear down a ring set up with uring_init.
+ */
+void uring_destroy(Uring *ring);
+
+/**
+ * Check whether the kernel supports an opcode.
+ */
+bool uring_supports(Uring *ring, int opcode);
+
+/**
+ * Get a zeroed submission queue entry. The entry is submitted by the next
+ * uring_submit call.
+ * @return An SQE, or NULL if the submission queue is full.
+ */
+struct io_uring_sqe *uring_get_sqe(Uring *ring);
+
+/**
+ * Number of SQEs uring_get_sqe can still hand out before the next submission.
+ */
+unsigned uring_sq_space(Uring *ring);
+
+/**
+ * Submit all prepared SQEs with one system call, optionally waiting for completions.
+ * @param wait_nr Number of completions to wait for.
+ * @return Number of SQEs submitted, or -1 on failure (with errno set). On failure
+ * the SQEs the kernel did not consume are discarded.
+ */
+int uring_submit(Uring *ring, unsigned wait_nr);
+
+/**
+ * Get the next completion without waiting.
+ * @return A CQE, or NULL if there are none. Release it with uring_cqe_seen.
+ */
+struct io_uring_cqe *uring_peek_cqe(Uring *ring);
+
+/**
+ * Mark the completion returned by uring_peek_cqe as consumed.
+ */
+void uring_cqe_seen(Uring *ring);
+
+/**
+ * Send a range of a file to a socket with linked read -> send chains,
+ * several chains per submission.
+ * @param ring Ring to use. Needs room for at least 16 SQEs.
+ * @param socket Socket to send to.
+ * @param file File to read from.
+ * @param offset Offset of the first byte to send.
+ * @param count Number of bytes to send.
+ * @return Number of bytes sent, -1 if nothing could be sent. A short count means
+ * the chain was interrupted and the caller should send the rest some other way.
+ */
+ssize_t uring_send_file(Uring *ring, int socket, int file, off_t offset, size_t count);
+
+#endif
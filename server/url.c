@@ -6,7 +6,6 @@
 #define _POSIX_C_SOURCE 200809L
 
 #include <assert.h>
-#include <ctype.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
@@ -14,174 +13,219 @@
 
 #include "url.h"
 
-char *url_get_scheme(const char *base) {
-	int scheme_begin = -1;
-	int scheme_end = -1;
-	sscanf(base, " %n%*[-+.a-zA-Z0-9]:%n", &scheme_begin, &scheme_end);
-	// Scheme found and it is of canonical format
-	if (scheme_end >= 0 && isalpha(base[scheme_begin])) {
-		return strndup(base + scheme_begin, scheme_end - scheme_begin - 1);
-	}
-	return NULL;
+// Character classes for the single pass parser
+#define URL_C_ALPHA 0x01
+#define URL_C_DIGIT 0x02
+#define URL_C_SCHEME 0x04 // "+-." allowed in a scheme after the first letter
+#define URL_C_HEX 0x08
+#define URL_C_END 0x10 // NUL, whitespace and control characters end the URL
+#define URL_C_AUTHORITY_END 0x20 // "/?#"
+#define URL_C_PATH_END 0x40 // "?#"
+
+static const unsigned char url_char_class[256] = {
+	0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+	0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+	0x10, 0x00, 0x00, 0x60, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x04, 0x00, 0x04, 0x04, 0x20,
+	0x0a, 0x0a, 0x0a, 0x0a, 0x0a, 0x0a, 0x0a, 0x0a, 0x0a, 0x0a, 0x00, 0x00, 0x00, 0x00, 0x00, 0x60,
+	0x00, 0x09, 0x09, 0x09, 0x09, 0x09, 0x09, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+	0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x09, 0x09, 0x09, 0x09, 0x09, 0x09, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+	0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x00, 0x00, 0x00, 0x00, 0x10,
+	// Bytes >= 0x80 are passed through as they are
+};
+
+static inline bool url_is(unsigned char c, unsigned char char_class) {
+	return url_char_class[c] & char_class;
 }
 
-char *url_get_userinfo(const char *base) {
-	int userinfo_begin = -1;
-	int userinfo_end = -1;
-	sscanf(base, " %n%*[^@]@%n", &userinfo_begin, &userinfo_end);
-	// Scheme found and it is of canonical format
-	if (userinfo_end >= 0 && isalpha(base[userinfo_begin])) {
-		return strndup(base + userinfo_begin, userinfo_end - userinfo_begin - 1);
-	}
-	return NULL;
+static inline void url_set_span(UrlSpan *span, const char *url, const char *begin, const char *end) {
+	span->offset = begin - url;
+	span->length = end - begin;
+	span->present = true;
 }
 
-char *url_get_authority(const char *base, int field) {
-	if (field == URL_AUTHORITY) {
-		int authority_end = -1;
-		sscanf(base, "%*[^/?#]%n", &authority_end);
-		return strndup(base, authority_end);
+int url_parse(const char *url, Url *parsed) {
+	if (!url || !parsed) {
+		return -1;
 	}
-	const char *next_field = base;
+	memset(parsed, 0, sizeof(*parsed));
 
-	// Parse userinfo@
-	int userinfo_end = -1;
-	int gteq_zero_if_userinfo = sscanf(next_field, " %*[^@]@%n", &userinfo_end);
-	if (field & URL_USERINFO) { // Requested parsing userinfo
-		return url_get_userinfo(next_field);
-	}
-	if (gteq_zero_if_userinfo >= 0) { // Url had a scheme
-		next_field += userinfo_end;
+	const char *p = url;
+	while (*p == ' ' || *p == '\t') {
+		++p;
 	}
+	const char *url_begin = p;
 
-	// Parse hostname
-	int host_end = -1;
-	sscanf(next_field, "%*[^:/?#]%n", &host_end);
-	if (field & URL_HOST) {
-		return strndup(next_field, host_end);
-	}
-	next_field += host_end;
-
-	// Parse :port, if exists
-	if (*next_field == ':') {
-		int port_end = -1;
-		sscanf(next_field, "%*[^/?#]%n", &port_end);
-		if (field & URL_PORT) {
-			return strndup(next_field + 1, port_end - 1);
+	// scheme ":"
+	if (url_is(*p, URL_C_ALPHA)) {
+		const char *scheme_end = p + 1;
+		while (url_is(*scheme_end, URL_C_ALPHA | URL_C_DIGIT | URL_C_SCHEME)) {
+			++scheme_end;
+		}
+		if (*scheme_end == ':') {
+			url_set_span(&parsed->scheme, url, p, scheme_end);
+			p = scheme_end + 1;
 		}
-		next_field += port_end;
 	}
+	const char *hier_part_begin = p;
 
-	return NULL;
-}
+	// "//" [ userinfo "@" ] host [ ":" port ]
+	if (p[0] == '/' && p[1] == '/') {
+		p += 2;
+		const char *authority_begin = p;
+		const char *at = NULL;
+		while (!url_is(*p, URL_C_END | URL_C_AUTHORITY_END)) {
+			if (*p == '@') {
+				at = p;
+			}
+			++p;
+		}
+		const char *authority_end = p;
+		url_set_span(&parsed->authority, url, authority_begin, authority_end);
 
-char *url_get_path(const char *base) {
-	int path_end = -1;
-	sscanf(base, "%*[^?#]%n", &path_end);
-	if (path_end > 0) {
-		return strndup(base, path_end);	
-	}
-	else {
-		return strdup("/");
+		const char *host = authority_begin;
+		if (at) {
+			url_set_span(&parsed->userinfo, url, authority_begin, at);
+			host = at + 1;
+		}
+
+		const char *host_end;
+		const char *port = NULL;
+		if (*host == '[') {
+			// IPv6 literal
+			host_end = memchr(host, ']', authority_end - host);
+			if (!host_end) {
+				return -1;
+			}
+			url_set_span(&parsed->host, url, host + 1, host_end);
+			++host_end;
+			if (host_end != authority_end && *host_end != ':') {
+				return -1;
+			}
+		} else {
+			host_end = memchr(host, ':', authority_end - host);
+			if (!host_end) {
+				host_end = authority_end;
+			}
+			url_set_span(&parsed->host, url, host, host_end);
+		}
+		if (host_end != authority_end) {
+			port = host_end + 1;
+			url_set_span(&parsed->port, url, port, authority_end);
+		}
 	}
-}
 
-char *url_get_hier_part(const char *base, int field) {
-	// Parse the whole hier-part
-	if (field == URL_HIER_PART) {
-		int hier_part_end = -1;
-		sscanf(base, "%*[^?#]%n", &hier_part_end);
-		return strndup(base, hier_part_end);
+	// path
+	const char *path_begin = p;
+	while (!url_is(*p, URL_C_END | URL_C_PATH_END)) {
+		++p;
 	}
+	url_set_span(&parsed->path, url, path_begin, p);
+	url_set_span(&parsed->hier_part, url, hier_part_begin, p);
 
-	// Parse some subfield of authority
-	int leading_slashes = -1;
-	sscanf(base, "%*[/]%n", &leading_slashes);
-	// Full authority + path
-	if (leading_slashes == 2) {
-		int authority_end = -1;
-		sscanf(base + leading_slashes, "%*[^/]%n", &authority_end);
-		if (field & URL_AUTHORITY) {
-			return url_get_authority(base + leading_slashes, field);
+	// "?" query
+	if (*p == '?') {
+		const char *query_begin = ++p;
+		while (!url_is(*p, URL_C_END) && *p != '#') {
+			++p;
 		}
-		if (field & URL_PATH) {
-			return url_get_path(base + leading_slashes + authority_end);
+		url_set_span(&parsed->query, url, query_begin, p);
+	}
+	url_set_span(&parsed->absolute, url, url_begin, p);
+
+	// "#" fragment
+	if (*p == '#') {
+		const char *fragment_begin = ++p;
+		while (!url_is(*p, URL_C_END)) {
+			++p;
 		}
-	// Only path component
-	} else if (leading_slashes == -1 && (field & URL_PATH)) {
-		return url_get_path(base);
+		url_set_span(&parsed->fragment, url, fragment_begin, p);
 	}
 
-	return NULL;
+	return 0;
 }
 
-char *url_get_query(const char *base) {
-	int query_end = -1;
-	sscanf(base, "%*[^#]%n", &query_end);
-	if (query_end > 0) {
-		return strndup(base, query_end);
+bool url_span(const Url *parsed, int field, UrlSpan *span) {
+	const UrlSpan *source = NULL;
+	UrlSpan hostport;
+
+	switch (field) {
+	case URL_SCHEME: source = &parsed->scheme; break;
+	case URL_QUERY: source = &parsed->query; break;
+	case URL_FRAGMENT: source = &parsed->fragment; break;
+	case URL_USERINFO: source = &parsed->userinfo; break;
+	case URL_HOST: source = &parsed->host; break;
+	case URL_PORT: source = &parsed->port; break;
+	case URL_AUTHORITY: source = &parsed->authority; break;
+	case URL_PATH: source = &parsed->path; break;
+	case URL_HIER_PART: source = &parsed->hier_part; break;
+	case URL_ABSOLUTE: source = &parsed->absolute; break;
+	case URL_HOSTPORT:
+		// Authority minus the "userinfo@" prefix
+		hostport = parsed->authority;
+		if (parsed->userinfo.present) {
+			size_t skip = parsed->userinfo.length + 1;
+			hostport.offset += skip;
+			hostport.length -= skip;
+		}
+		source = &hostport;
+		break;
+	default:
+		break;
 	}
-	else {
-		return strdup("");
+
+	if (!source || !source->present) {
+		return false;
 	}
+	*span = *source;
+	return true;
 }
 
-char *url_get_fragment(const char *base) {
-	int fragment_end = -1;
-	sscanf(base, "%*s%n", &fragment_end);
-	return strndup(base, fragment_end);
+static inline int url_hex_value(unsigned char c) {
+	return url_is(c, URL_C_DIGIT) ? c - '0' : (c | 0x20) - 'a' + 10;
 }
 
-// Looks up the url for a given field and then returns a String
-char *url_get_field(const char *url, int field) {
-	assert(url);
-	assert(field);
-
-	const char *next_field = url;
-
-	// Parse scheme:
-	int scheme_end = -1;
-	int minus_one_if_no_scheme = sscanf(next_field, " %*[^:]:%n", &scheme_end);
-	if (field & URL_SCHEME) { // Requested parsing scheme
-		return url_get_scheme(next_field);
-	}
-	if (minus_one_if_no_scheme >= 0) { // Url had a scheme
-		next_field += scheme_end;
+ssize_t url_decode(const char *url, const UrlSpan *span, char *buf, size_t size) {
+	if (!url || !span || !buf || size == 0 || !span->present) {
+		return -1;
 	}
 
-	// Parse //hier-part
-	int hier_part_end = -1;
-	sscanf(next_field, "%*[^?#]%n", &hier_part_end);
-	if (field & URL_HIER_PART) {
-		return url_get_hier_part(next_field, field);
-	}
-	next_field += hier_part_end;
-
-	// Parse ?query, if exists
-	if (*next_field == '?') {
-		int query_end = -1;
-		sscanf(next_field, "%*[^#]%n", &query_end);
-		if (field & URL_QUERY) {
-			return url_get_query(next_field + 1);
+	const char *p = url + span->offset;
+	const char *end = p + span->length;
+	size_t length = 0;
+	while (p < end) {
+		if (length + 1 >= size) {
+			return -1;
+		}
+		if (*p == '%') {
+			if (end - p < 3 || !url_is(p[1], URL_C_HEX) || !url_is(p[2], URL_C_HEX)) {
+				return -1;
+			}
+			buf[length++] = url_hex_value(p[1]) << 4 | url_hex_value(p[2]);
+			p += 3;
+		} else {
+			buf[length++] = *p++;
 		}
-		next_field += query_end;
 	}
+	buf[length] = '\0';
+	return length;
+}
 
-	// Special field value for stripping the fragment
-	if (field == URL_ABSOLUTE) {
-		return strndup(url, next_field - url);
-	}
+// Compatibility wrapper, returns a copy of the requested field
+char *url_get_field(const char *url, int field) {
+	assert(url);
+	assert(field);
 
-	// Parse #fragment, if exists
-	if (*next_field == '#') {
-		int query_end = -1;
-		sscanf(next_field, "%*s%n", &query_end);
-		if (field & URL_FRAGMENT) {
-			return url_get_fragment(next_field + 1);
-		}
+	Url parsed;
+	UrlSpan span;
+	if (url_parse(url, &parsed) == -1 || !url_span(&parsed, field, &span)) {
+		return NULL;
 	}
-
-	return NULL;
+	// An empty path means the root
+	if (field == URL_PATH && span.length == 0) {
+		return strdup("/");
+	}
+	return strndup(url + span.offset, span.length);
 }
 
 /*
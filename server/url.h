@@ -1,6 +1,10 @@
 #ifndef URL_H_
 #define URL_H_
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
 // URL fields
 
 // http://user@host:port/path?query#fragment
@@ -47,8 +51,68 @@
 // ^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^
 #define URL_ABSOLUTE 256
 
+/**
+ * Location of a single URL component within the URL string.
+ * Offsets are relative to the start of the parsed string.
+ */
+typedef struct {
+	size_t offset;
+	size_t length;
+	bool present;
+} UrlSpan;
+
+/**
+ * All components of a URL, filled in by one pass of url_parse.
+ * Components that do not appear in the URL have present == false.
+ * Delimiters (":", "//", "@", ":", "?", "#") are not part of the spans.
+ */
+typedef struct {
+	UrlSpan scheme;
+	UrlSpan userinfo;
+	UrlSpan host; // Without the brackets of an IPv6 literal
+	UrlSpan port;
+	UrlSpan path; // Always present, possibly empty
+	UrlSpan query;
+	UrlSpan fragment;
+	UrlSpan authority;
+	UrlSpan hier_part;
+	UrlSpan absolute; // Whole URL minus the fragment
+} Url;
+
+/**
+ * Parse a URL into component spans. Does not allocate.
+ * Parsing stops at the first whitespace or control character.
+ * @param url URL string to parse
+ * @param parsed Span struct to fill in
+ * @return 0 on success, -1 if the URL is malformed.
+ */
+int url_parse(const char *url, Url *parsed);
+
+/**
+ * Get the span of a field from a parsed URL. Composite fields such as
+ * URL_HOSTPORT or URL_HIER_PART yield the span covering their components.
+ * @param parsed URL parsed with url_parse
+ * @param field Field to get
+ * @param span Output span
+ * @return true if the field is present in the URL.
+ */
+bool url_span(const Url *parsed, int field, UrlSpan *span);
+
+/**
+ * Percent-decode a URL component into a caller supplied buffer.
+ * The result is NUL-terminated.
+ * @param url The string that was given to url_parse
+ * @param span Span of the component to decode
+ * @param buf Output buffer
+ * @param size Size of the output buffer
+ * @return Length of the decoded string, or -1 if the component is malformed
+ * or does not fit in the buffer.
+ */
+ssize_t url_decode(const char *url, const UrlSpan *span, char *buf, size_t size);
+
 /**
  * Get a field from a URL. See the #defines above for field specifications.
+ * Thin wrapper around url_parse.
  * @param url URL string to parse
  * @param field Field to get
  * @return The given field, allocated with malloc, or NULL if parsing failed.
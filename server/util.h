@@ -3,58 +3,17 @@
 
 #include "common.h"
 
-#include <errno.h>
-#include <stdarg.h>
 #include <stdbool.h>
-#include <stddef.h>
-#include <stdio.h>
 #include <sys/stat.h>
 #include <sys/types.h>
-#include <time.h>
-#include <unistd.h>
 
-#include "string.h"
+#include "log.h"
 
 /**
  * For debugging purposes. Use like printf.
  * All caps for legacy reasons
  */
-static inline void VERBOSE(const char *format, ...) {
-	// Use an internal buffer to allow atomic writes to stderr
-
-	// Timestamp
-	String *s = string_new("[");
-	struct timespec ts;
-	clock_gettime(CLOCK_REALTIME, &ts); \
-	char ts_string[32]; \
-	snprintf(ts_string, sizeof ts_string, "%ld.%ld", (long) ts.tv_sec, (long) ts.tv_nsec);
-	string_append_c(s, ts_string);
-	string_append_c(s, "] ");
-
-	// Message
-	char message[1024];
-	va_list args;
-	va_start(args, format);
-	vsnprintf(message, sizeof(message), format, args);
-	va_end(args);
-	string_append_c(s, message);
-
-	// Newline
-	string_append_c(s, "\n");
-
-	// One hopefully atomic write. Retry in any case.
-	size_t written = 0;
-	size_t left = s->size;
-	while (left > 0) {
-		ssize_t written_last = write(STDERR_FILENO, s->c_str + written, left);
-		if (written_last == -1 && errno != EINTR) {
-			break;
-		}
-		written += written_last;
-		left -= written_last;
-	}
-	string_delete(s);
-}
+#define VERBOSE(...) LOG(LOG_LEVEL_VERBOSE, __VA_ARGS__)
 
 // Return whether a file is directory
 static inline bool is_directory(int fd) {
@@ -0,0 +1,131 @@
+#include "common.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "util.h"
+#include "workqueue.h"
+
+struct WorkQueue {
+	pthread_mutex_t lock;
+	pthread_cond_t available;
+	WorkItem *head[WORK_PRIORITY_COUNT];
+	WorkItem *tail[WORK_PRIORITY_COUNT];
+	size_t length;
+	bool stopping; // Workers exit once the queues are empty
+	int threads;
+	pthread_t thread[];
+};
+
+static uint64_t workqueue_now_us(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static void *workqueue_thread(void *args) {
+	WorkQueue *queue = args;
+
+	pthread_mutex_lock(&queue->lock);
+	for (;;) {
+		WorkItem *item = NULL;
+		for (int priority = 0; priority < WORK_PRIORITY_COUNT && !item; ++priority) {
+			item = queue->head[priority];
+			if (item) {
+				queue->head[priority] = item->next;
+				if (!item->next) {
+					queue->tail[priority] = NULL;
+				}
+			}
+		}
+		if (!item && queue->stopping) {
+			break;
+		}
+		if (!item) {
+			pthread_cond_wait(&queue->available, &queue->lock);
+			continue;
+		}
+		--queue->length;
+		pthread_mutex_unlock(&queue->lock);
+
+		uint64_t now = workqueue_now_us();
+		item->function(item, now > item->enqueued_us ? now - item->enqueued_us : 0);
+
+		pthread_mutex_lock(&queue->lock);
+	}
+	pthread_mutex_unlock(&queue->lock);
+	return NULL;
+}
+
+WorkQueue *workqueue_new(int threads) {
+	WorkQueue *queue = calloc(1, sizeof(*queue) + threads * sizeof(queue->thread[0]));
+	if (!queue) {
+		return NULL;
+	}
+	pthread_mutex_init(&queue->lock, NULL);
+	pthread_cond_init(&queue->available, NULL);
+
+	int started = 0;
+	for (int i = 0; i < threads; ++i) {
+		int r = pthread_create(&queue->thread[started], NULL, workqueue_thread, queue);
+		if (r == 0) {
+			++started;
+		} else {
+			VERBOSE("Error spawning thread: %s", strerror(r));
+		}
+	}
+	queue->threads = started;
+	if (started == 0) {
+		pthread_cond_destroy(&queue->available);
+		pthread_mutex_destroy(&queue->lock);
+		free(queue);
+		return NULL;
+	}
+	if (started < threads) {
+		VERBOSE("Started only %d of %d worker threads", started, threads);
+	}
+	return queue;
+}
+
+void workqueue_submit(WorkQueue *queue, WorkItem *item, WorkPriority priority) {
+	item->next = NULL;
+	item->enqueued_us = workqueue_now_us();
+
+	pthread_mutex_lock(&queue->lock);
+	if (queue->tail[priority]) {
+		queue->tail[priority]->next = item;
+	} else {
+		queue->head[priority] = item;
+	}
+	queue->tail[priority] = item;
+	++queue->length;
+	pthread_cond_signal(&queue->available);
+	pthread_mutex_unlock(&queue->lock);
+}
+
+size_t workqueue_length(WorkQueue *queue) {
+	pthread_mutex_lock(&queue->lock);
+	size_t length = queue->length;
+	pthread_mutex_unlock(&queue->lock);
+	return length;
+}
+
+void workqueue_delete(WorkQueue *queue) {
+	if (!queue) {
+		return;
+	}
+	pthread_mutex_lock(&queue->lock);
+	queue->stopping = true;
+	pthread_cond_broadcast(&queue->available);
+	pthread_mutex_unlock(&queue->lock);
+
+	for (int i = 0; i < queue->threads; ++i) {
+		pthread_join(queue->thread[i], NULL);
+	}
+	pthread_cond_destroy(&queue->available);
+	pthread_mutex_destroy(&queue->lock);
+	free(queue);
+}
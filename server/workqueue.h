@@ -0,0 +1,65 @@
+#ifndef WORKQUEUE_H_
+#define WORKQUEUE_H_
+/**
+ * Work queue module
+ * A fixed pool of worker threads fed from FIFO queues of two priorities. High
+ * priority work is always taken first. Each item records when it was queued so
+ * its handler knows how long it waited.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum {
+	WORK_PRIORITY_HIGH,
+	WORK_PRIORITY_NORMAL,
+	WORK_PRIORITY_COUNT
+} WorkPriority;
+
+typedef struct WorkItem WorkItem;
+
+/**
+ * Handler run on a worker thread.
+ * @param item The submitted item. The handler owns it from here on.
+ * @param queued_us Microseconds the item spent in the queue.
+ */
+typedef void (*WorkFunction)(WorkItem *item, uint64_t queued_us);
+
+/**
+ * A unit of work. Embed it in the object describing the work.
+ */
+struct WorkItem {
+	WorkItem *next;
+	WorkFunction function;
+	uint64_t enqueued_us; // Set by workqueue_submit
+};
+
+typedef struct WorkQueue WorkQueue;
+
+/**
+ * Start a pool of worker threads.
+ * @param threads Number of worker threads.
+ * @return The queue, or NULL if no worker thread could be started.
+ */
+WorkQueue *workqueue_new(int threads);
+
+/**
+ * Queue an item to be run by the next free worker.
+ * @param item Item with its function set. Ownership passes to the handler.
+ * @param priority Queue to add the item to.
+ */
+void workqueue_submit(WorkQueue *queue, WorkItem *item, WorkPriority priority);
+
+/**
+ * Number of items waiting for a worker.
+ */
+size_t workqueue_length(WorkQueue *queue);
+
+/**
+ * Let the workers run the items still queued, then stop them and free the
+ * queue. Nothing may be submitted once this is called.
+ * @param queue Queue to delete, or NULL.
+ */
+void workqueue_delete(WorkQueue *queue);
+
+#endif